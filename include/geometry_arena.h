@@ -0,0 +1,239 @@
+#pragma once
+
+#include <memory_report.h>
+#include <vk_helpers.h>
+#include <vk_types.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+
+// Suballocates mesh geometry from a few large device buffers, so a scene needs a handful of allocations however many
+// meshes it has. Each buffer (block) is managed by a VMA virtual block. A new block is created when none has room, and
+// ranges larger than the block size get a block of their own. Blocks left empty, e.g. by an unloaded scene, are released
+// by releaseEmptyBlocks; their slots are reused so the block indices of live ranges stay valid. Like createUploadBuffer, blocks may end up host-visible
+// on unified memory devices: their ranges can then be written in place through mMapped, followed by flush().
+// When uploads and rendering run on different queue families, blocks are shared concurrently between them, so ranges
+// written on one queue can be read on the other without an ownership transfer.
+class GeometryArena
+{
+public:
+	static constexpr VkDeviceSize kAlignment = 16;
+
+	// Blocks are counted as MemoryCategory::Geometry in tracker, if given.
+	void init(VkDevice device, VmaAllocator allocator, VkDeviceSize blockSize, VkBufferUsageFlags usage, std::vector<uint32_t> queueFamilies, MemoryTracker* tracker = nullptr)
+	{
+		mDevice = device;
+		mTracker = tracker;
+		mAllocator = allocator;
+		mBlockSize = blockSize;
+		mUsage = usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;  // Blocks are copied when defragmented.
+		mQueueFamilies = std::move(queueFamilies);
+	}
+
+	void destroy()
+	{
+		for (auto& block : mBlocks) {
+			if (block.virtualBlock) { destroyBlock(block); }
+		}
+		mBlocks.clear();
+	}
+
+	// Frees the memory of the blocks no range is allocated from.
+	void releaseEmptyBlocks()
+	{
+		for (auto& block : mBlocks) {
+			if (block.virtualBlock && vmaIsVirtualBlockEmpty(block.virtualBlock)) { destroyBlock(block); }
+		}
+	}
+
+	// Returns an empty range for size 0.
+	BufferRange allocate(VkDeviceSize size, VkDeviceSize alignment = kAlignment)
+	{
+		BufferRange range;
+		if (size == 0) { return range; }
+		for (uint32_t i = 0; i < mBlocks.size(); ++i) {
+			if (tryAllocate(i, size, alignment, range)) { return range; }
+		}
+		if (!tryAllocate(createBlock(std::max(size, mBlockSize)), size, alignment, range)) {
+			throw std::runtime_error("failed to allocate geometry arena range");
+		}
+		return range;
+	}
+
+	void free(BufferRange& range)
+	{
+		if (range.mAllocation) { vmaVirtualFree(mBlocks[range.mBlock].virtualBlock, range.mAllocation); }
+		range = {};
+	}
+
+	// Makes host writes through range.mMapped visible to the device (a no-op for host-coherent memory).
+	void flush(const BufferRange& range)
+	{
+		if (range.mAllocation) { VK_CHECK(vmaFlushAllocation(mAllocator, mBlocks[range.mBlock].buffer.mAllocation, range.mOffset, range.mSize)); }
+	}
+
+	size_t blockCount() const { return std::count_if(mBlocks.begin(), mBlocks.end(), [](const Block& block) { return block.virtualBlock != VK_NULL_HANDLE; }); }
+
+	// Defragmentation support (see VulkanApp::defragment). When VMA moves the memory of a block, its contents are copied
+	// into a new buffer bound to the destination allocation. That buffer replaces the block buffer once the copy is done,
+	// and after the defragmentation pass has ended the block and the ranges allocated from it are refreshed.
+	// Returns the index of the block backed by allocation, or -1. Empty blocks hold nothing worth copying: they aren't moved.
+	int32_t findBlock(VmaAllocation allocation) const
+	{
+		for (uint32_t i = 0; i < mBlocks.size(); ++i) {
+			if (mBlocks[i].buffer.mAllocation == allocation) {
+				return vmaIsVirtualBlockEmpty(mBlocks[i].virtualBlock) ? -1 : static_cast<int32_t>(i);
+			}
+		}
+		return -1;
+	}
+
+	VkBuffer createMovedBlockBuffer(uint32_t blockIndex, VmaAllocation dstAllocation) const
+	{
+		const VkBufferCreateInfo createInfo = bufferCreateInfo(mBlocks[blockIndex].size);
+		VkBuffer buffer;
+		VK_CHECK(vkCreateBuffer(mDevice, &createInfo, nullptr, &buffer));
+		VK_CHECK(vmaBindBufferMemory(mAllocator, dstAllocation, buffer));
+		return buffer;
+	}
+
+	void recordBlockCopy(VkCommandBuffer cmd, uint32_t blockIndex, VkBuffer dstBuffer) const
+	{
+		const VkBufferCopy copy{ .srcOffset = 0, .dstOffset = 0, .size = mBlocks[blockIndex].size };
+		vkCmdCopyBuffer(cmd, mBlocks[blockIndex].buffer.mBuffer, dstBuffer, 1, &copy);
+	}
+
+	// The old buffer must no longer be in use.
+	void replaceBlockBuffer(uint32_t blockIndex, VkBuffer buffer)
+	{
+		vkDestroyBuffer(mDevice, mBlocks[blockIndex].buffer.mBuffer, nullptr);
+		mBlocks[blockIndex].buffer.mBuffer = buffer;
+	}
+
+	void refreshBlock(uint32_t blockIndex)
+	{
+		Block& block = mBlocks[blockIndex];
+		vmaGetAllocationInfo(mAllocator, block.buffer.mAllocation, &block.buffer.mAllocInfo);
+		block.address = GetBufferDeviceAddress(mDevice, block.buffer.mBuffer);
+	}
+
+	void refreshRange(BufferRange& range) const
+	{
+		if (!range.mAllocation) { return; }
+		const Block& block = mBlocks[range.mBlock];
+		void* mapped = block.buffer.mAllocInfo.pMappedData;
+		range.mBuffer = block.buffer.mBuffer;
+		range.mAddress = block.address + range.mOffset;
+		range.mMapped = mapped ? static_cast<char*>(mapped) + range.mOffset : nullptr;
+	}
+
+	// Total size of the blocks, and the bytes allocated from them.
+	VkDeviceSize size() const
+	{
+		VkDeviceSize total = 0;
+		for (const auto& block : mBlocks) { total += block.buffer.mAllocInfo.size; }
+		return total;
+	}
+
+	VkDeviceSize usedSize() const
+	{
+		VkDeviceSize used = 0;
+		for (const auto& block : mBlocks) {
+			if (!block.virtualBlock) { continue; }
+			VmaStatistics stats;
+			vmaGetVirtualBlockStatistics(block.virtualBlock, &stats);
+			used += stats.allocationBytes;
+		}
+		return used;
+	}
+
+private:
+	struct Block
+	{
+		AllocatedBuffer		buffer{};
+		VmaVirtualBlock		virtualBlock{ VK_NULL_HANDLE };	// Null for a released block.
+		VkDeviceAddress		address{ 0 };
+		VkDeviceSize		size{ 0 };	// Of the buffer. The allocation may be larger.
+	};
+
+	// Create info of the block buffers, for new and moved blocks.
+	VkBufferCreateInfo bufferCreateInfo(VkDeviceSize size) const
+	{
+		const bool bConcurrent = mQueueFamilies.size() > 1;
+		return {
+			.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+			.size = size,
+			.usage = mUsage,
+			.sharingMode = bConcurrent ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+			.queueFamilyIndexCount = bConcurrent ? static_cast<uint32_t>(mQueueFamilies.size()) : 0u,
+			.pQueueFamilyIndices = bConcurrent ? mQueueFamilies.data() : nullptr
+		};
+	}
+
+	// Returns the index of the new block, in the slot of a released one if there is one.
+	uint32_t createBlock(VkDeviceSize size)
+	{
+		const VkBufferCreateInfo createInfo = bufferCreateInfo(size);
+		const VmaAllocationCreateInfo allocInfo{
+			.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT,
+			.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE
+		};
+		checkHeapBudget(mAllocator, MemoryCategory::Geometry, size);	// Ranges that fit in existing blocks need no new memory.
+		Block block{ .size = size };
+		VK_CHECK(vmaCreateBuffer(mAllocator, &createInfo, &allocInfo, &block.buffer.mBuffer, &block.buffer.mAllocation, &block.buffer.mAllocInfo));
+		vmaSetAllocationName(mAllocator, block.buffer.mAllocation, memoryCategoryName(MemoryCategory::Geometry));
+		if (mTracker) { mTracker->add(MemoryCategory::Geometry, block.buffer.mAllocInfo.size); }
+		const VmaVirtualBlockCreateInfo blockInfo{ .size = size };
+		VK_CHECK(vmaCreateVirtualBlock(&blockInfo, &block.virtualBlock));
+		block.address = GetBufferDeviceAddress(mDevice, block.buffer.mBuffer);
+
+		const auto slot = std::find_if(mBlocks.begin(), mBlocks.end(), [](const Block& b) { return b.virtualBlock == VK_NULL_HANDLE; });
+		if (slot != mBlocks.end()) {
+			*slot = block;
+			return static_cast<uint32_t>(slot - mBlocks.begin());
+		}
+		mBlocks.push_back(block);
+		return static_cast<uint32_t>(mBlocks.size() - 1);
+	}
+
+	void destroyBlock(Block& block)
+	{
+		if (mTracker) { mTracker->remove(MemoryCategory::Geometry, block.buffer.mAllocInfo.size); }
+		vmaClearVirtualBlock(block.virtualBlock);
+		vmaDestroyVirtualBlock(block.virtualBlock);
+		vmaDestroyBuffer(mAllocator, block.buffer.mBuffer, block.buffer.mAllocation);
+		block = {};
+	}
+
+	bool tryAllocate(uint32_t blockIndex, VkDeviceSize size, VkDeviceSize alignment, BufferRange& range)
+	{
+		const Block& block = mBlocks[blockIndex];
+		if (!block.virtualBlock) { return false; }
+		const VmaVirtualAllocationCreateInfo allocInfo{ .size = size, .alignment = alignment };
+		VmaVirtualAllocation allocation;
+		VkDeviceSize offset;
+		if (vmaVirtualAllocate(block.virtualBlock, &allocInfo, &allocation, &offset) != VK_SUCCESS) { return false; }
+
+		void* mapped = block.buffer.mAllocInfo.pMappedData;
+		range = {
+			.mBuffer		= block.buffer.mBuffer,
+			.mOffset		= offset,
+			.mSize			= size,
+			.mAddress		= block.address + offset,
+			.mMapped		= mapped ? static_cast<char*>(mapped) + offset : nullptr,
+			.mAllocation	= allocation,
+			.mBlock			= blockIndex
+		};
+		return true;
+	}
+
+	VkDevice				mDevice = VK_NULL_HANDLE;
+	VmaAllocator			mAllocator = VK_NULL_HANDLE;
+	VkDeviceSize			mBlockSize = 0;
+	VkBufferUsageFlags		mUsage = 0;
+	std::vector<uint32_t>	mQueueFamilies;
+	std::vector<Block>		mBlocks;
+	MemoryTracker*			mTracker = nullptr;
+};
@@ -0,0 +1,429 @@
+#pragma once
+
+#include <json.h>
+#include <mapped_file.h>
+#include <scene.h>
+#include <thread_pool.h>
+
+#include <limits>
+
+
+// glTF 2.0 importer (.gltf with external .bin buffers, or binary .glb).
+//
+// Buffers are memory-mapped, never read into memory. Each triangle primitive becomes a mesh asset of the scene:
+// 32-bit index accessors are referenced in place from the mapped buffer (ObjMesh::mIndexView), so their bytes go
+// straight from the file into the staging buffer; vertex attributes are gathered into the interleaved Vertex layout in
+// parallel. Nodes become mesh instances with their world transforms, and glTF materials are mapped onto Material, with
+// their base color textures (external image files) as albedo textures.
+namespace gltf
+{
+	namespace detail
+	{
+		constexpr uint32_t kGlbMagic		= 0x46546C67;	// "glTF"
+		constexpr uint32_t kGlbChunkJson	= 0x4E4F534A;	// "JSON"
+		constexpr uint32_t kGlbChunkBin		= 0x004E4942;	// "BIN\0"
+
+		// Accessor component types.
+		constexpr int kByte				= 5120;
+		constexpr int kUnsignedByte		= 5121;
+		constexpr int kShort			= 5122;
+		constexpr int kUnsignedShort	= 5123;
+		constexpr int kUnsignedInt		= 5125;
+		constexpr int kFloat			= 5126;
+
+		constexpr int kModeTriangles	= 4;
+
+		inline size_t componentSize(int componentType)
+		{
+			switch (componentType) {
+			case kByte: case kUnsignedByte:		return 1;
+			case kShort: case kUnsignedShort:	return 2;
+			case kUnsignedInt: case kFloat:		return 4;
+			default:							return 0;
+			}
+		}
+
+		inline size_t componentCount(std::string_view type)
+		{
+			if (type == "SCALAR")	{ return 1; }
+			if (type == "VEC2")		{ return 2; }
+			if (type == "VEC3")		{ return 3; }
+			if (type == "VEC4")		{ return 4; }
+			if (type == "MAT4")		{ return 16; }
+			return 0;
+		}
+
+		struct Buffer
+		{
+			std::shared_ptr<const MappedFile>	file;	// Keeps the mapping alive for meshes that reference it.
+			std::span<const std::byte>			bytes;
+		};
+
+		// A strided view of an accessor's elements inside a mapped buffer.
+		struct Accessor
+		{
+			const std::byte*	data = nullptr;
+			size_t				count = 0;
+			size_t				stride = 0;
+			size_t				components = 0;
+			int					componentType = 0;
+			bool				bNormalized = false;
+			const Buffer*		buffer = nullptr;
+
+			// Reads component c of element i as a float, applying normalization for integer types.
+			float read(size_t i, size_t c) const
+			{
+				const std::byte* p = data + i * stride + c * componentSize(componentType);
+				const auto load = [p]<typename T>(T) { T value; std::memcpy(&value, p, sizeof(T)); return value; };
+				switch (componentType) {
+				case kFloat:			return load(float{});
+				case kUnsignedByte:		return bNormalized ? load(uint8_t{}) / 255.f : load(uint8_t{});
+				case kUnsignedShort:	return bNormalized ? load(uint16_t{}) / 65535.f : load(uint16_t{});
+				case kByte:				return bNormalized ? std::max(load(int8_t{}) / 127.f, -1.f) : load(int8_t{});
+				case kShort:			return bNormalized ? std::max(load(int16_t{}) / 32767.f, -1.f) : load(int16_t{});
+				case kUnsignedInt:		return static_cast<float>(load(uint32_t{}));
+				default:				return 0.f;
+				}
+			}
+
+			uint32_t readIndex(size_t i) const
+			{
+				const std::byte* p = data + i * stride;
+				switch (componentType) {
+				case kUnsignedByte:		return static_cast<uint32_t>(*p);
+				case kUnsignedShort:	{ uint16_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+				default:				{ uint32_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+				}
+			}
+		};
+
+		// Resolves an accessor index to a bounds-checked view. Returns an error message on failure.
+		inline std::string getAccessor(const json::Value& document, const std::vector<Buffer>& buffers, int64_t index, Accessor& out)
+		{
+			const auto& accessor = document["accessors"][static_cast<size_t>(index)];
+			if (!accessor.isObject())					{ return fmt::format("invalid accessor {}", index); }
+			if (accessor.find("sparse"))				{ return fmt::format("sparse accessor {} is not supported", index); }
+
+			out.count			= static_cast<size_t>(accessor["count"].int_or(0));
+			out.componentType	= static_cast<int>(accessor["componentType"].int_or(0));
+			out.components		= componentCount(accessor["type"].string_or(""));
+			out.bNormalized		= accessor["normalized"].boolean;
+			const size_t elementSize = componentSize(out.componentType) * out.components;
+			if (elementSize == 0)						{ return fmt::format("accessor {} has an unsupported type", index); }
+
+			const auto& view = document["bufferViews"][static_cast<size_t>(accessor["bufferView"].int_or(-1))];
+			const int64_t bufferIndex = view["buffer"].int_or(-1);
+			if (!view.isObject() || bufferIndex < 0 || static_cast<size_t>(bufferIndex) >= buffers.size()) {
+				return fmt::format("accessor {} has no valid buffer view", index);
+			}
+			out.buffer = &buffers[bufferIndex];
+			out.stride = static_cast<size_t>(view["byteStride"].int_or(static_cast<int64_t>(elementSize)));
+
+			const size_t offset = static_cast<size_t>(view["byteOffset"].int_or(0) + accessor["byteOffset"].int_or(0));
+			const size_t viewEnd = static_cast<size_t>(view["byteOffset"].int_or(0) + view["byteLength"].int_or(0));
+			const size_t accessorEnd = out.count == 0 ? offset : offset + (out.count - 1) * out.stride + elementSize;
+			if (out.stride < elementSize || viewEnd > out.buffer->bytes.size() || accessorEnd > viewEnd) {
+				return fmt::format("accessor {} is out of bounds", index);
+			}
+			out.data = out.buffer->bytes.data() + offset;
+			return {};
+		}
+
+		inline glm::mat4 nodeTransform(const json::Value& node)
+		{
+			if (const auto* matrix = node.find("matrix"); matrix && matrix->size() == 16) {
+				glm::mat4 m;
+				for (int i = 0; i < 16; ++i) { m[i / 4][i % 4] = static_cast<float>((*matrix)[i].number_or(0.0)); }	// Column-major, as in glm.
+				return m;
+			}
+
+			const auto& t = node["translation"];
+			const auto& r = node["rotation"];
+			const auto& s = node["scale"];
+			glm::mat4 transform = glm::translate(glm::mat4(1.f), glm::vec3(t[0].number_or(0.0), t[1].number_or(0.0), t[2].number_or(0.0)));
+			transform = transform * glm::mat4_cast(glm::quat(static_cast<float>(r[3].number_or(1.0)), static_cast<float>(r[0].number_or(0.0)), static_cast<float>(r[1].number_or(0.0)), static_cast<float>(r[2].number_or(0.0))));
+			return glm::scale(transform, glm::vec3(s[0].number_or(1.0), s[1].number_or(1.0), s[2].number_or(1.0)));
+		}
+
+		// The image file of a material's base color texture, or an empty path if it has none. Only external images are
+		// supported: images in buffer views or data uris are skipped with a warning.
+		inline fs::path baseColorTexture(const json::Value& document, const json::Value& material, const fs::path& path)
+		{
+			const auto& textureInfo = material["pbrMetallicRoughness"]["baseColorTexture"];
+			if (!textureInfo.find("index")) { return {}; }
+			const auto& texture = document["textures"][static_cast<size_t>(textureInfo["index"].int_or(-1))];
+			const auto& image = document["images"][static_cast<size_t>(texture["source"].int_or(-1))];
+			const auto uri = image["uri"].string_or("");
+			if (uri.empty() || uri.starts_with("data:")) {
+				fmt::println("Warning: {}: skipping base color texture {}, only external images are supported", path.string(), textureInfo["index"].int_or(-1));
+				return {};
+			}
+			return (path.parent_path() / fs::path(uri)).lexically_normal();
+		}
+
+		inline Material convertMaterial(const json::Value& material)
+		{
+			const auto& pbr = material["pbrMetallicRoughness"];
+			const auto& baseColor = pbr["baseColorFactor"];
+			const auto& emissive = material["emissiveFactor"];
+			const auto& extensions = material["extensions"];
+
+			Material result{
+				.type			= DIFFUSE,
+				.albedo			= glm::vec3(baseColor[0].number_or(1.0), baseColor[1].number_or(1.0), baseColor[2].number_or(1.0)),
+				.phongExponent	= 0,
+				.emitted		= glm::vec3(emissive[0].number_or(0.0), emissive[1].number_or(0.0), emissive[2].number_or(0.0))
+			};
+
+			if (result.emitted != glm::vec3(0.f)) {
+				result.type = LIGHT;
+				result.emitted *= static_cast<float>(extensions["KHR_materials_emissive_strength"]["emissiveStrength"].number_or(1.0));
+			}
+			else if (extensions["KHR_materials_transmission"]["transmissionFactor"].number_or(0.0) > 0.0) {
+				result.type = DIELECTRIC;
+			}
+			else if (pbr["metallicFactor"].number_or(1.0) >= 0.99 && pbr["roughnessFactor"].number_or(1.0) <= 0.05) {
+				result.type = MIRROR;
+			}
+			return result;
+		}
+
+		// Fills a mesh asset from a triangle primitive. Returns an error message on failure.
+		inline std::string loadPrimitive(const json::Value& document, const std::vector<Buffer>& buffers, const json::Value& primitive, ObjMesh& mesh)
+		{
+			const auto& attributes = primitive["attributes"];
+			Accessor positions, normals, texcoords, indices;
+			if (auto error = getAccessor(document, buffers, attributes["POSITION"].int_or(-1), positions); !error.empty()) { return error; }
+			if (positions.components != 3 || positions.componentType != kFloat) { return "POSITION must be a float VEC3"; }
+			if (positions.count == 0) { return "primitive has no vertices"; }
+			if (attributes.find("NORMAL")) {
+				if (auto error = getAccessor(document, buffers, attributes["NORMAL"].int_or(-1), normals); !error.empty()) { return error; }
+				if (normals.components != 3 || normals.count != positions.count) { return "NORMAL does not match POSITION"; }
+			}
+			if (attributes.find("TEXCOORD_0")) {
+				if (auto error = getAccessor(document, buffers, attributes["TEXCOORD_0"].int_or(-1), texcoords); !error.empty()) { return error; }
+				if (texcoords.components != 2 || texcoords.count != positions.count) { return "TEXCOORD_0 does not match POSITION"; }
+			}
+
+			// Interleave the vertex attributes. glTF puts the uv origin at the top left, the renderer at the bottom left.
+			mesh.mVertices.resize(positions.count);
+			for (size_t i = 0; i < positions.count; ++i) {
+				Vertex& v = mesh.mVertices[i];
+				v.position	= glm::vec3(positions.read(i, 0), positions.read(i, 1), positions.read(i, 2));
+				v.normal	= normals.data ? glm::vec3(normals.read(i, 0), normals.read(i, 1), normals.read(i, 2)) : glm::vec3(0.f);
+				v.tex		= texcoords.data ? glm::vec2(texcoords.read(i, 0), 1.f - texcoords.read(i, 1)) : glm::vec2(0.f);
+			}
+
+			if (primitive.find("indices")) {
+				if (auto error = getAccessor(document, buffers, primitive["indices"].int_or(-1), indices); !error.empty()) { return error; }
+				if (indices.components != 1 || (indices.componentType != kUnsignedByte && indices.componentType != kUnsignedShort && indices.componentType != kUnsignedInt)) {
+					return "indices must be unsigned integer scalars";
+				}
+
+				// Tightly packed, aligned 32-bit indices are used in place.
+				if (indices.componentType == kUnsignedInt && indices.stride == sizeof(uint32_t) && reinterpret_cast<uintptr_t>(indices.data) % alignof(uint32_t) == 0) {
+					mesh.mSourceFile = indices.buffer->file;
+					mesh.mIndexView = { reinterpret_cast<const uint32_t*>(indices.data), indices.count - indices.count % 3 };
+				}
+				else {
+					mesh.mIndices.resize(indices.count - indices.count % 3);
+					for (size_t i = 0; i < mesh.mIndices.size(); ++i) { mesh.mIndices[i] = indices.readIndex(i); }
+				}
+			}
+			else {
+				mesh.mIndices.resize(positions.count - positions.count % 3);
+				for (uint32_t i = 0; i < mesh.mIndices.size(); ++i) { mesh.mIndices[i] = i; }
+			}
+			for (const uint32_t index : mesh.indices()) {
+				if (index >= positions.count) { return "index out of range"; }
+			}
+
+			// Generating normals may split vertices, which needs an owned index buffer.
+			if (!normals.data) {
+				if (mesh.mSourceFile) {
+					mesh.mIndices.assign(mesh.mIndexView.begin(), mesh.mIndexView.end());
+					mesh.mSourceFile.reset();
+					mesh.mIndexView = {};
+				}
+				::normals::generateNormals(mesh.mVertices, mesh.mIndices, ObjMesh::normalCreaseAngle);
+			}
+
+			mesh.mBounds = { .min = glm::vec3(std::numeric_limits<float>::max()), .max = glm::vec3(std::numeric_limits<float>::lowest()) };
+			for (const auto& v : mesh.mVertices) {
+				mesh.mBounds.min = glm::min(mesh.mBounds.min, v.position);
+				mesh.mBounds.max = glm::max(mesh.mBounds.max, v.position);
+			}
+			return {};
+		}
+	}
+
+	// Imports the meshes, materials, node hierarchy and (if bImportCamera) first camera of a glTF file into scene,
+	// with all nodes placed under rootTransform. Importing the same file again reuses its mesh assets.
+	// Returns false, after printing the error, on failure.
+	inline bool importFile(const fs::path& path, Scene& scene, const glm::mat4& rootTransform = glm::mat4(1.f), bool bImportCamera = false)
+	{
+		using namespace detail;
+
+		const auto fail = [&](std::string_view message) {
+			fmt::println("Error: {}: {}", path.string(), message);
+			return false;
+		};
+
+		auto file = std::make_shared<MappedFile>(path);
+		if (!*file) { return fail("could not open file"); }
+
+		// Split a binary container into its JSON and BIN chunks.
+		std::string_view jsonText(reinterpret_cast<const char*>(file->data()), file->size());
+		std::span<const std::byte> binChunk;
+		uint32_t magic = 0;
+		std::memcpy(&magic, file->data(), std::min<size_t>(sizeof(magic), file->size()));
+		if (magic == kGlbMagic) {
+			const auto bytes = file->bytes();
+			const auto readU32 = [&](size_t offset) { uint32_t v = 0; if (offset + 4 <= bytes.size()) { std::memcpy(&v, bytes.data() + offset, 4); } return v; };
+			if (readU32(4) != 2) { return fail("unsupported GLB version"); }
+
+			size_t offset = 12;
+			const size_t length = std::min<size_t>(readU32(8), bytes.size());
+			jsonText = {};
+			while (offset + 8 <= length) {
+				const size_t chunkLength = readU32(offset);
+				const uint32_t chunkType = readU32(offset + 4);
+				if (chunkLength > length - offset - 8) { return fail("truncated GLB chunk"); }
+				const auto chunk = bytes.subspan(offset + 8, chunkLength);
+				if (chunkType == kGlbChunkJson && jsonText.empty())	{ jsonText = { reinterpret_cast<const char*>(chunk.data()), chunk.size() }; }
+				else if (chunkType == kGlbChunkBin && binChunk.empty())	{ binChunk = chunk; }
+				offset += 8 + alignUp(chunkLength, 4);
+			}
+		}
+
+		json::Value document;
+		if (!json::parse(jsonText, document)) { return fail("malformed JSON"); }
+		if (!document["asset"]["version"].string_or("").starts_with("2")) { return fail("only glTF 2.0 is supported"); }
+
+		// Map the buffers. The first buffer of a GLB without a uri is its BIN chunk.
+		std::vector<Buffer> buffers;
+		for (size_t i = 0; i < document["buffers"].size(); ++i) {
+			const auto& buffer = document["buffers"][i];
+			if (!buffer.find("uri")) {
+				if (i != 0 || magic != kGlbMagic) { return fail(fmt::format("buffer {} has no data", i)); }
+				buffers.push_back({ file, binChunk });
+				continue;
+			}
+			const auto uri = buffer["uri"].string_or("");
+			if (uri.starts_with("data:")) { return fail("embedded data uris are not supported, use .glb or external buffers"); }
+			auto bufferFile = std::make_shared<MappedFile>(path.parent_path() / fs::path(uri));
+			if (!*bufferFile) { return fail(fmt::format("could not open buffer {}", uri)); }
+			const auto bytes = bufferFile->bytes();
+			buffers.push_back({ std::move(bufferFile), bytes });
+		}
+
+		// Materials are appended after the ones already in the scene.
+		const uint32_t materialBase = static_cast<uint32_t>(scene.mMaterials.size());
+		for (size_t i = 0; i < document["materials"].size(); ++i) {
+			Material& material = scene.mMaterials.emplace_back(convertMaterial(document["materials"][i]));
+			if (const auto texture = baseColorTexture(document, document["materials"][i], path); !texture.empty()) {
+				material.albedoTexture = scene.addTexture(texture);
+			}
+		}
+		uint32_t defaultMaterial = std::numeric_limits<uint32_t>::max();
+
+		// Register one mesh asset per triangle primitive, then load the new ones concurrently.
+		struct PrimitiveRef { uint32_t meshID; uint32_t materialID; };
+		std::vector<std::vector<PrimitiveRef>> meshPrimitives(document["meshes"].size());
+		std::vector<std::pair<uint32_t, const json::Value*>> newPrimitives;
+		const std::string fileKey = meshRegistryKey(path);
+		for (size_t m = 0; m < meshPrimitives.size(); ++m) {
+			const auto& primitives = document["meshes"][m]["primitives"];
+			for (size_t p = 0; p < primitives.size(); ++p) {
+				const auto& primitive = primitives[p];
+				if (primitive["mode"].int_or(kModeTriangles) != kModeTriangles) {
+					fmt::println("Warning: {}: skipping non-triangle primitive {} of mesh {}", path.string(), p, m);
+					continue;
+				}
+
+				const size_t meshCount = scene.mMeshes.size();
+				const std::string key = fmt::format("{}#{}/{}", fileKey, m, p);
+				const uint32_t meshID = scene.addMesh(path, key);
+				if (scene.mMeshes.size() != meshCount) {
+					scene.mMeshes[meshID].mSourceHash = hashBytes(std::as_bytes(std::span(key)));
+					newPrimitives.emplace_back(meshID, &primitive);
+				}
+
+				uint32_t materialID;
+				if (const int64_t material = primitive["material"].int_or(-1); material >= 0 && static_cast<size_t>(material) < document["materials"].size()) {
+					materialID = materialBase + static_cast<uint32_t>(material);
+				}
+				else {
+					if (defaultMaterial == std::numeric_limits<uint32_t>::max()) {
+						defaultMaterial = static_cast<uint32_t>(scene.mMaterials.size());
+						scene.mMaterials.push_back(Material{ .type = DIFFUSE, .albedo = glm::vec3(0.8f), .phongExponent = 0, .emitted = glm::vec3(0.f) });
+					}
+					materialID = defaultMaterial;
+				}
+				meshPrimitives[m].push_back({ meshID, materialID });
+			}
+		}
+
+		std::vector<std::string> errors(newPrimitives.size());
+		ThreadPool::global().parallelFor(newPrimitives.size(), [&](size_t i) {
+			const auto [meshID, primitive] = newPrimitives[i];
+			errors[i] = loadPrimitive(document, buffers, *primitive, scene.mMeshes[meshID]);
+			});
+		for (const auto& error : errors) {
+			if (!error.empty()) { return fail(error); }
+		}
+
+		// Walk the node hierarchy of the default scene.
+		const auto& sceneNodes = document["scenes"][static_cast<size_t>(document["scene"].int_or(0))]["nodes"];
+		std::vector<std::pair<size_t, glm::mat4>> stack;
+		for (size_t i = 0; i < sceneNodes.size(); ++i) { stack.emplace_back(static_cast<size_t>(sceneNodes[i].int_or(0)), rootTransform); }
+
+		bool bFoundCamera = false;
+		size_t visited = 0;
+		while (!stack.empty()) {
+			const auto [nodeIndex, parentTransform] = stack.back();
+			stack.pop_back();
+			const auto& node = document["nodes"][nodeIndex];
+			if (!node.isObject() || ++visited > document["nodes"].size()) { return fail("invalid node hierarchy"); }
+
+			const glm::mat4 transform = parentTransform * nodeTransform(node);
+			if (const int64_t mesh = node["mesh"].int_or(-1); mesh >= 0 && static_cast<size_t>(mesh) < meshPrimitives.size()) {
+				for (const auto& primitive : meshPrimitives[mesh]) { scene.addMeshInstance(primitive.meshID, primitive.materialID, transform); }
+			}
+
+			// glTF cameras look down their local -Z axis.
+			const auto& camera = document["cameras"][static_cast<size_t>(node["camera"].int_or(-1))];
+			if (bImportCamera && !bFoundCamera && camera["type"].string_or("") == "perspective") {
+				const glm::vec3 position(transform * glm::vec4(0.f, 0.f, 0.f, 1.f));
+				const glm::vec3 target(transform * glm::vec4(0.f, 0.f, -1.f, 1.f));
+				scene.mCamera.center = position;
+				scene.mCamera.eye = target;
+				scene.mCamera.fovY = glm::degrees(static_cast<float>(camera["perspective"]["yfov"].number_or(glm::radians(40.0))));
+				bFoundCamera = true;
+			}
+
+			const auto& children = node["children"];
+			for (size_t i = 0; i < children.size(); ++i) { stack.emplace_back(static_cast<size_t>(children[i].int_or(0)), transform); }
+		}
+
+		// Without a camera, look at the imported instances from the front.
+		if (bImportCamera && !bFoundCamera && !scene.mMeshInstances.empty()) {
+			AABB bounds{ .min = glm::vec3(std::numeric_limits<float>::max()), .max = glm::vec3(std::numeric_limits<float>::lowest()) };
+			for (const auto& instance : scene.mMeshInstances) {
+				const AABB& local = scene.mMeshes[instance.meshID].mBounds;
+				for (int corner = 0; corner < 8; ++corner) {
+					const glm::vec3 p((corner & 1) ? local.max.x : local.min.x, (corner & 2) ? local.max.y : local.min.y, (corner & 4) ? local.max.z : local.min.z);
+					const glm::vec3 world(instance.transform * glm::vec4(p, 1.f));
+					bounds.min = glm::min(bounds.min, world);
+					bounds.max = glm::max(bounds.max, world);
+				}
+			}
+			const glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+			const float radius = glm::length(bounds.max - bounds.min) * 0.5f;
+			scene.mCamera.fovY = 40.f;
+			scene.mCamera.eye = center;
+			scene.mCamera.center = center + glm::vec3(0.f, 0.f, radius / std::tan(glm::radians(scene.mCamera.fovY) * 0.5f));
+		}
+		return true;
+	}
+}
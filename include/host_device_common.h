@@ -14,10 +14,7 @@ using vec3 = glm::vec3;
 
 
 
-// TODO: (Hack) fix number of meshes a scene can contain.
-#define MAX_MESH_COUNT 64 
-#define SPHERE_CUSTOM_INDEX MAX_MESH_COUNT 
-#define MAX_TEXTURE_COUNT 500
+#define MAX_TEXTURE_COUNT 500	// Size of the texture descriptor array, including the default white texture.
 
 // Materials
 #define DIFFUSE		0
@@ -31,6 +28,18 @@ using vec3 = glm::vec3;
 #define NORMAL		1
 #define AO			2
 
+// Vertex buffer layouts
+#define VERTEX_LAYOUT_STANDARD	0	// Interleaved Vertex structs.
+#define VERTEX_LAYOUT_COMPACT	1	// Separate position and packed attribute streams.
+
+// Instance geometry types (InstanceRecord::geometryType)
+#define GEOMETRY_TRIANGLES	0
+#define GEOMETRY_SPHERE		1
+
+// InstanceRecord::flags
+#define INSTANCE_INDEX16_BIT	0x1u	// The mesh has 16-bit indices.
+#define INSTANCE_MATERIALS_BIT	0x2u	// Offset materialBase by the mesh's per-triangle material indices.
+
 // Samplers
 
 
@@ -53,6 +62,32 @@ struct Vertex
 	vec2 tex;
 };
 
+// Compact layout attributes: octahedral snorm16x2 normal and half2 uv.
+struct PackedVertexAttributes
+{
+	uint normal;
+	uint tex;
+};
+
+// Device addresses of a mesh's geometry streams, read through buffer references. Indexed by mesh ID.
+// vertexAddress holds Vertex structs, or only positions in the compact layout.
+struct MeshRecord
+{
+	uint64_t vertexAddress;
+	uint64_t indexAddress;
+	uint64_t attributeAddress;			// Compact layout only: PackedVertexAttributes.
+	uint64_t triangleMaterialAddress;	// 0 unless the mesh has per-triangle materials.
+};
+
+// Per-instance data, indexed by the TLAS instance index (rayQueryGetIntersectionInstanceIdEXT).
+struct InstanceRecord
+{
+	uint geometryType;
+	uint meshID;		// Index into the mesh table, for GEOMETRY_TRIANGLES.
+	uint materialBase;
+	uint flags;
+};
+
 struct AABB
 {
 	vec3 min;
@@ -74,7 +109,7 @@ struct Material
 {
 	uint	type;
 	vec3	albedo;
-	//uint    albdeoTextureID;
+	uint	albedoTexture;	// Index into the scene textures, multiplying albedo. Texture 0 is white.
 	int		phongExponent;	// Only used if type == PHONG
 	vec3	emitted;	// Only used if type == LIGHT
 	//float	ior;		// Only used if type == DIELECTRIC
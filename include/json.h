@@ -0,0 +1,182 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// Minimal JSON reader, sufficient for asset headers such as glTF. Parses a document into a tree of Values.
+namespace json
+{
+	struct Value
+	{
+		enum class Type { Null, Bool, Number, String, Array, Object };
+
+		Type						type = Type::Null;
+		bool						boolean = false;
+		double						number = 0.0;
+		std::string					string;
+		std::vector<Value>			elements;	// Array elements, or object member values.
+		std::vector<std::string>	keys;		// Object member names, parallel to elements.
+
+		bool isNull() const		{ return type == Type::Null; }
+		bool isNumber() const	{ return type == Type::Number; }
+		bool isString() const	{ return type == Type::String; }
+		bool isArray() const	{ return type == Type::Array; }
+		bool isObject() const	{ return type == Type::Object; }
+
+		// Returns the member with the given name, or nullptr.
+		const Value* find(std::string_view key) const
+		{
+			if (type != Type::Object) { return nullptr; }
+			for (size_t i = 0; i < keys.size(); ++i) {
+				if (keys[i] == key) { return &elements[i]; }
+			}
+			return nullptr;
+		}
+
+		// Missing members and out of range elements read as null.
+		const Value& operator[](std::string_view key) const { const Value* v = find(key); return v ? *v : null(); }
+		const Value& operator[](size_t index) const { return (type == Type::Array && index < elements.size()) ? elements[index] : null(); }
+		size_t size() const { return (type == Type::Array || type == Type::Object) ? elements.size() : 0; }
+
+		double number_or(double fallback) const { return type == Type::Number ? number : fallback; }
+		int64_t int_or(int64_t fallback) const { return type == Type::Number ? static_cast<int64_t>(number) : fallback; }
+		std::string_view string_or(std::string_view fallback) const { return type == Type::String ? std::string_view(string) : fallback; }
+
+		static const Value& null() { static const Value kNull; return kNull; }
+	};
+
+	namespace detail
+	{
+		struct Parser
+		{
+			const char* p;
+			const char* end;
+			int			depth = 0;
+
+			static constexpr int kMaxDepth = 256;
+
+			void skipSpaces() { while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) { ++p; } }
+
+			bool consume(char c)
+			{
+				skipSpaces();
+				if (p < end && *p == c) { ++p; return true; }
+				return false;
+			}
+
+			bool literal(std::string_view word)
+			{
+				if (static_cast<size_t>(end - p) < word.size() || std::string_view(p, word.size()) != word) { return false; }
+				p += word.size();
+				return true;
+			}
+
+			static void appendUtf8(std::string& out, uint32_t c)
+			{
+				if (c < 0x80) { out += static_cast<char>(c); }
+				else if (c < 0x800) { out += static_cast<char>(0xC0 | (c >> 6)); out += static_cast<char>(0x80 | (c & 0x3F)); }
+				else if (c < 0x10000) { out += static_cast<char>(0xE0 | (c >> 12)); out += static_cast<char>(0x80 | ((c >> 6) & 0x3F)); out += static_cast<char>(0x80 | (c & 0x3F)); }
+				else { out += static_cast<char>(0xF0 | (c >> 18)); out += static_cast<char>(0x80 | ((c >> 12) & 0x3F)); out += static_cast<char>(0x80 | ((c >> 6) & 0x3F)); out += static_cast<char>(0x80 | (c & 0x3F)); }
+			}
+
+			bool hex4(uint32_t& value)
+			{
+				if (end - p < 4) { return false; }
+				const auto [ptr, ec] = std::from_chars(p, p + 4, value, 16);
+				if (ec != std::errc() || ptr != p + 4) { return false; }
+				p += 4;
+				return true;
+			}
+
+			bool parseString(std::string& out)
+			{
+				if (!consume('"')) { return false; }
+				while (p < end && *p != '"') {
+					if (*p != '\\') { out += *p++; continue; }
+					if (++p == end) { return false; }
+					switch (*p++) {
+					case '"':	out += '"'; break;
+					case '\\':	out += '\\'; break;
+					case '/':	out += '/'; break;
+					case 'b':	out += '\b'; break;
+					case 'f':	out += '\f'; break;
+					case 'n':	out += '\n'; break;
+					case 'r':	out += '\r'; break;
+					case 't':	out += '\t'; break;
+					case 'u': {
+						uint32_t c;
+						if (!hex4(c)) { return false; }
+						if (c >= 0xD800 && c < 0xDC00) {	// Surrogate pair.
+							uint32_t low;
+							if (!literal("\\u") || !hex4(low) || low < 0xDC00 || low >= 0xE000) { return false; }
+							c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+						}
+						appendUtf8(out, c);
+						break;
+					}
+					default:	return false;
+					}
+				}
+				return consume('"');
+			}
+
+			bool parseValue(Value& value)
+			{
+				skipSpaces();
+				if (p == end || ++depth > kMaxDepth) { return false; }
+
+				bool bOk = true;
+				switch (*p) {
+				case '{':
+					++p;
+					value.type = Value::Type::Object;
+					if (!consume('}')) {
+						do {
+							skipSpaces();
+							bOk = parseString(value.keys.emplace_back()) && consume(':') && parseValue(value.elements.emplace_back());
+						} while (bOk && consume(','));
+						bOk = bOk && consume('}');
+					}
+					break;
+				case '[':
+					++p;
+					value.type = Value::Type::Array;
+					if (!consume(']')) {
+						do { bOk = parseValue(value.elements.emplace_back()); } while (bOk && consume(','));
+						bOk = bOk && consume(']');
+					}
+					break;
+				case '"':
+					value.type = Value::Type::String;
+					bOk = parseString(value.string);
+					break;
+				case 't': value.type = Value::Type::Bool; value.boolean = true;  bOk = literal("true");  break;
+				case 'f': value.type = Value::Type::Bool; value.boolean = false; bOk = literal("false"); break;
+				case 'n': value.type = Value::Type::Null; bOk = literal("null"); break;
+				default: {
+					value.type = Value::Type::Number;
+					const auto [ptr, ec] = std::from_chars(p, end, value.number);
+					bOk = (ec == std::errc());
+					p = ptr;
+				}
+				}
+				--depth;
+				return bOk;
+			}
+		};
+	}
+
+	// Parses a complete JSON document. Returns false on malformed input.
+	inline bool parse(std::string_view text, Value& out)
+	{
+		detail::Parser parser{ text.data(), text.data() + text.size() };
+		out = Value{};
+		if (!parser.parseValue(out)) { return false; }
+		parser.skipSpaces();
+		return parser.p == parser.end;
+	}
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <span>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// Read-only memory mapping of a whole file. The mapping is released when the object is destroyed.
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	explicit MappedFile(const std::filesystem::path& path) { open(path); }
+	~MappedFile() { close(); }
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	MappedFile(MappedFile&& other) noexcept { swap(other); }
+	MappedFile& operator=(MappedFile&& other) noexcept
+	{
+		if (this != &other) {
+			close();
+			swap(other);
+		}
+		return *this;
+	}
+
+	// Maps the file at the given path. Returns false if the file could not be opened or is empty.
+	bool open(const std::filesystem::path& path)
+	{
+		close();
+#ifdef _WIN32
+		mFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (mFile == INVALID_HANDLE_VALUE) { return false; }
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(mFile, &fileSize) || fileSize.QuadPart == 0) { close(); return false; }
+
+		mMapping = CreateFileMappingW(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mMapping) { close(); return false; }
+
+		mData = static_cast<const std::byte*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+		if (!mData) { close(); return false; }
+		mSize = static_cast<size_t>(fileSize.QuadPart);
+#else
+		const int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) { return false; }
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) { ::close(fd); return false; }
+
+		void* ptr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);    // The mapping keeps its own reference to the file.
+		if (ptr == MAP_FAILED) { return false; }
+
+		mData = static_cast<const std::byte*>(ptr);
+		mSize = static_cast<size_t>(st.st_size);
+#endif
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (mData)							{ UnmapViewOfFile(mData); }
+		if (mMapping)						{ CloseHandle(mMapping); }
+		if (mFile != INVALID_HANDLE_VALUE)	{ CloseHandle(mFile); }
+		mMapping = nullptr;
+		mFile = INVALID_HANDLE_VALUE;
+#else
+		if (mData) { munmap(const_cast<std::byte*>(mData), mSize); }
+#endif
+		mData = nullptr;
+		mSize = 0;
+	}
+
+	const std::byte*			data() const	{ return mData; }
+	size_t						size() const	{ return mSize; }
+	std::span<const std::byte>	bytes() const	{ return { mData, mSize }; }
+	explicit operator bool() const				{ return mData != nullptr; }
+
+private:
+	void swap(MappedFile& other) noexcept
+	{
+		std::swap(mData, other.mData);
+		std::swap(mSize, other.mSize);
+#ifdef _WIN32
+		std::swap(mFile, other.mFile);
+		std::swap(mMapping, other.mMapping);
+#endif
+	}
+
+	const std::byte*	mData = nullptr;
+	size_t				mSize = 0;
+#ifdef _WIN32
+	HANDLE				mFile = INVALID_HANDLE_VALUE;
+	HANDLE				mMapping = nullptr;
+#endif
+};
+
+
+// Fast non-cryptographic 64-bit hash, used to detect when the source of a cached asset has changed.
+inline uint64_t hashBytes(std::span<const std::byte> bytes, uint64_t seed = 0)
+{
+	constexpr uint64_t k1 = 0x87C37B91114253D5ull;
+	constexpr uint64_t k2 = 0x4CF5AD432745937Full;
+	const auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+
+	uint64_t h = seed ^ (bytes.size() * k1);
+	size_t i = 0;
+	for (; i + 8 <= bytes.size(); i += 8) {
+		uint64_t w;
+		std::memcpy(&w, bytes.data() + i, sizeof(w));
+		h ^= rotl(w * k1, 31) * k2;
+		h = rotl(h, 27) * 5 + 0x52DCE729;
+	}
+	if (i < bytes.size()) {
+		uint64_t tail = 0;
+		std::memcpy(&tail, bytes.data() + i, bytes.size() - i);
+		h ^= rotl(tail * k1, 31) * k2;
+	}
+
+	// Final avalanche.
+	h ^= h >> 33; h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33; h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
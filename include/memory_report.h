@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vk_types.h>
+
+#include <array>
+#include <atomic>
+#include <stdexcept>
+
+
+// Categories GPU allocations are tagged with, for the memory report (see VulkanApp::printMemoryReport).
+enum class MemoryCategory : uint32_t
+{
+	Geometry,	// Geometry arena blocks: vertex, index, attribute and triangle material streams.
+	Blas,
+	Tlas,		// TLAS storage and its instance buffer.
+	Scratch,	// Acceleration structure build scratch, freed after the builds.
+	Images,		// Render targets.
+	Textures,
+	Staging,
+	SceneData,	// Materials, mesh table, instance records and the AABB geometry.
+	Count
+};
+
+inline const char* memoryCategoryName(MemoryCategory category)
+{
+	static constexpr const char* kNames[] = { "geometry", "blas", "tlas", "scratch", "images", "textures", "staging", "scene data" };
+	static_assert(std::size(kNames) == static_cast<size_t>(MemoryCategory::Count));
+	return kNames[static_cast<uint32_t>(category)];
+}
+
+// Current and peak bytes allocated per category. Allocations may be made on several threads.
+class MemoryTracker
+{
+public:
+	void add(MemoryCategory category, VkDeviceSize size)
+	{
+		Counter& counter = mCounters[static_cast<uint32_t>(category)];
+		const uint64_t current = counter.current.fetch_add(size) + size;
+		uint64_t peak = counter.peak.load();
+		while (peak < current && !counter.peak.compare_exchange_weak(peak, current)) {}
+	}
+
+	void remove(MemoryCategory category, VkDeviceSize size) { mCounters[static_cast<uint32_t>(category)].current.fetch_sub(size); }
+
+	VkDeviceSize current(MemoryCategory category) const { return mCounters[static_cast<uint32_t>(category)].current.load(); }
+	VkDeviceSize peak(MemoryCategory category) const { return mCounters[static_cast<uint32_t>(category)].peak.load(); }
+
+private:
+	struct Counter
+	{
+		std::atomic<uint64_t> current{ 0 };
+		std::atomic<uint64_t> peak{ 0 };
+	};
+	std::array<Counter, static_cast<size_t>(MemoryCategory::Count)> mCounters;
+};
+
+// Fails early, with a clear error, if no device-local heap has size bytes left in its budget, rather than letting the
+// driver page memory out behind our back. Without VK_EXT_memory_budget VMA estimates the budgets from the heap sizes.
+inline void checkHeapBudget(VmaAllocator allocator, MemoryCategory category, VkDeviceSize size)
+{
+	const VkPhysicalDeviceMemoryProperties* memoryProperties;
+	vmaGetMemoryProperties(allocator, &memoryProperties);
+	std::array<VmaBudget, VK_MAX_MEMORY_HEAPS> budgets;
+	vmaGetHeapBudgets(allocator, budgets.data());
+
+	VkDeviceSize available = 0;
+	VkDeviceSize budget = 0;
+	for (uint32_t i = 0; i < memoryProperties->memoryHeapCount; ++i) {
+		if ((memoryProperties->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) == 0) { continue; }
+		const VkDeviceSize heapAvailable = budgets[i].budget > budgets[i].usage ? budgets[i].budget - budgets[i].usage : 0;
+		if (heapAvailable >= available) { available = heapAvailable; budget = budgets[i].budget; }
+	}
+	if (size > available) {
+		throw std::runtime_error(fmt::format("out of GPU memory: {} needs {:.1f} MB, but only {:.1f} MB of the {:.1f} MB budget is left",
+			memoryCategoryName(category), size / 1048576.0, available / 1048576.0, budget / 1048576.0));
+	}
+}
@@ -1,64 +1,276 @@
- #pragma once
+#pragma once
 
 #include <host_device_common.h>
+#include <mesh_cache.h>
+#include <mesh_normals.h>
+#include <mesh_reorder.h>
+#include <obj_parser.h>
 #include <vk_helpers.h>
 #include <vk_types.h>
 
-#include "tiny_obj_loader.h"
+#include <gtc/packing.hpp>
 
+#include <limits>
+
+
+// Compact vertex layout helpers (VERTEX_LAYOUT_COMPACT).
+//-----------------------------------------------
+inline uint32_t packOctahedralNormal(glm::vec3 n)
+{
+	// Project onto the octahedron, then fold the lower hemisphere over the diagonals.
+	const float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	if (l1 == 0.f) { return glm::packSnorm2x16(glm::vec2(0.f)); }	// Unreferenced vertex, decodes to +Z.
+	glm::vec2 e(n.x / l1, n.y / l1);
+	if (n.z < 0.f) {
+		e = glm::vec2((1.f - std::abs(e.y)) * (e.x >= 0.f ? 1.f : -1.f), (1.f - std::abs(e.x)) * (e.y >= 0.f ? 1.f : -1.f));
+	}
+	return glm::packSnorm2x16(e);
+}
+
+inline PackedVertexAttributes packVertexAttributes(const Vertex& v)
+{
+	return { .normal = packOctahedralNormal(v.normal), .tex = glm::packHalf2x16(v.tex) };
+}
 
 struct ObjMesh
 {
-	std::vector<Vertex>		mVertices; 
-	std::vector<uint32_t>   mIndices;
-	glm::mat4				mTransform = glm::mat4(1.f);
-	uint32_t				mMaterialID;
+	std::vector<Vertex>		mVertices;		// Only populated when the mesh was parsed from source.
+	std::vector<uint32_t>   mIndices;		// When loaded from the mesh cache, vertices()/indices() read the mapped file instead.
+	AABB					mBounds;
+	fs::path				mPath;
+	uint64_t				mSourceHash = 0;	// Content hash of the source file, used to share identical assets (see assetKey).
+
+	MappedFile				mCacheFile;
+	const MeshCacheHeader*	mCacheHeader = nullptr;	// Points into mCacheFile.
+
+	// Multi-material meshes (OBJ usemtl groups): a material index per triangle into mMaterialNames.
+	std::vector<uint32_t>		mTriangleMaterials;		// Only populated when parsed from source, see triangleMaterials().
+	std::vector<std::string>	mMaterialNames;
+	std::vector<std::string>	mMaterialLibraries;		// mtllib files, relative to mPath.
+	std::vector<Material>		mMaterials;				// Parsed from the libraries by loadMaterialLibraries, parallel to mMaterialNames.
+	std::vector<fs::path>		mMaterialTextures;		// Albedo texture of each of mMaterials, or empty. Registered by resolveMeshMaterials.
+	uint32_t					mMaterialBase = 0;		// Index of mMaterials[0] in the scene materials (see resolveMeshMaterials).
 
-    AllocatedBuffer			mVertexBuffer;
-	AllocatedBuffer			mIndexBuffer;
+	// Meshes imported from binary assets (glTF) can read their indices in place from the mapped asset file.
+	std::shared_ptr<const MappedFile>	mSourceFile;
+	std::span<const uint32_t>			mIndexView;		// Points into mSourceFile when set.
+
+	// Geometry streams, suballocated from the geometry arena (see GeometryArena).
+	BufferRange				mVertexRange;		// Vertex structs, or only positions in the compact layout.
+	BufferRange				mAttributeRange;	// Compact layout only: PackedVertexAttributes.
+	BufferRange				mIndexRange;
+	BufferRange				mTriangleMaterialRange;	// Only for meshes with per-triangle materials, empty otherwise.
+	VkIndexType				mIndexType = VK_INDEX_TYPE_UINT32;	// VK_INDEX_TYPE_UINT16 when compact and small enough.
 	
 	AccelerationStructure	mBlas;          // TODO: Should be a vector, one per primitive?
 
+	// Geometry counts, kept when the host copy of the geometry is released (see releaseHostData).
+	uint64_t				mVertexCount = 0;
+	uint64_t				mIndexCount = 0;
+	bool					bHostDataReleased = false;
+
+	std::span<const Vertex> vertices() const
+	{
+		if (mCacheHeader) { return { reinterpret_cast<const Vertex*>(mCacheFile.data() + mCacheHeader->vertexOffset), mCacheHeader->vertexCount }; }
+		return mVertices;
+	}
+
+	std::span<const uint32_t> indices() const
+	{
+		if (mCacheHeader) { return { reinterpret_cast<const uint32_t*>(mCacheFile.data() + mCacheHeader->indexOffset), mCacheHeader->indexCount }; }
+		if (mSourceFile) { return mIndexView; }
+		return mIndices;
+	}
+
+	std::span<const uint32_t> triangleMaterials() const
+	{
+		if (mCacheHeader) {
+			if (mCacheHeader->materialCount == 0) { return {}; }
+			return { reinterpret_cast<const uint32_t*>(mCacheFile.data() + mCacheHeader->triangleMaterialOffset), mCacheHeader->indexCount / 3 };
+		}
+		return mTriangleMaterials;
+	}
+
+	bool hasTriangleMaterials() const { return !triangleMaterials().empty(); }
+
+	size_t vertexCount() const { return bHostDataReleased ? mVertexCount : vertices().size(); }
+	size_t indexCount() const { return bHostDataReleased ? mIndexCount : indices().size(); }
+
+	// True once the geometry is available, from a file load or an importer.
+	bool isLoaded() const { return bHostDataReleased || !vertices().empty(); }
+
+	bool fitsIndex16() const { return vertexCount() <= 0x10000; }
+
+	// Release the host copy of the geometry once it is on the GPU (see VulkanApp::uploadScene).
+	inline static bool bReleaseHostData = true;
+
+	// Frees the host copy of the geometry, keeping only its counts: the parsed vectors, and the mapped cache or source
+	// file. Only meshes whose mesh cache holds the same geometry are released, e.g. not if the cache couldn't be written.
+	// Returns true if the mesh was released.
+	bool releaseHostData()
+	{
+		if (bHostDataReleased) { return true; }
+		if (mPath.empty()) { return false; }
+		const MappedFile cache(meshCachePath(mPath));
+		if (!cacheHoldsGeometry(validateMeshCache(cache, mPath))) { return false; }
+		mVertexCount = vertices().size();
+		mIndexCount = indices().size();
+		std::vector<Vertex>().swap(mVertices);
+		std::vector<uint32_t>().swap(mIndices);
+		std::vector<uint32_t>().swap(mTriangleMaterials);
+		mCacheHeader = nullptr;
+		mCacheFile.close();
+		mSourceFile.reset();
+		mIndexView = {};
+		bHostDataReleased = true;
+		return true;
+	}
+
+	// Maps the mesh cache again after releaseHostData, e.g. to rebuild the BLAS. The cache must still hold the geometry
+	// that was uploaded.
+	bool reloadHostData()
+	{
+		if (!bHostDataReleased) { return true; }
+		if (!mCacheFile.open(meshCachePath(mPath)) || !cacheHoldsGeometry(mCacheHeader = validateMeshCache(mCacheFile, mPath))) {
+			mCacheHeader = nullptr;
+			mCacheFile.close();
+			fmt::println("Error: could not reload mesh {} from its cache", mPath.string());
+			return false;
+		}
+		bHostDataReleased = false;
+		return true;
+	}
+
+	// True if a mesh cache holds the geometry of this mesh, as built with the current settings.
+	bool cacheHoldsGeometry(const MeshCacheHeader* header) const
+	{
+		const uint32_t reorderFlag = bReorderForLocality ? kMeshCacheReordered : 0;
+		return header && header->sourceHash == mSourceHash &&
+			header->vertexCount == vertexCount() && header->indexCount == indexCount() &&
+			(header->flags & kMeshCacheReordered) == reorderFlag &&
+			(!(header->flags & kMeshCacheGeneratedNormals) || header->normalCreaseAngle == normalCreaseAngle);
+	}
+
+	// Reorder triangles and vertices for memory locality when (re)building the cache. Off only to compare against file order.
+	inline static bool bReorderForLocality = true;
+
+	// Crease angle in degrees used to generate missing normals: 0 gives faceted shading, 180 fully smooth.
+	inline static float normalCreaseAngle = 0.f;
+
+	// Loads the mesh from its binary cache if it is up to date, otherwise parses the OBJ file and writes a new cache.
 	bool loadFromFile(const fs::path& path)
 	{
+		mPath = path;
+		const auto cachePath = meshCachePath(path);
+		const uint32_t reorderFlag = bReorderForLocality ? kMeshCacheReordered : 0;
+		if (mCacheFile.open(cachePath) && (mCacheHeader = validateMeshCache(mCacheFile, path)) &&
+			(mCacheHeader->flags & kMeshCacheReordered) == reorderFlag &&
+			(!(mCacheHeader->flags & kMeshCacheGeneratedNormals) || mCacheHeader->normalCreaseAngle == normalCreaseAngle)) {
+			mBounds = mCacheHeader->bounds;
+			mSourceHash = mCacheHeader->sourceHash;
+
+			// Material library and material names, one per line.
+			std::string_view names(reinterpret_cast<const char*>(mCacheFile.data() + mCacheHeader->materialNamesOffset), mCacheHeader->materialCount > 0 ? mCacheHeader->materialNamesSize : 0);
+			for (uint32_t i = 0; i < mCacheHeader->materialLibraryCount + mCacheHeader->materialCount && !names.empty(); ++i) {
+				const size_t eol = std::min(names.find('\n'), names.size());
+				(i < mCacheHeader->materialLibraryCount ? mMaterialLibraries : mMaterialNames).emplace_back(names.substr(0, eol));
+				names.remove_prefix(std::min(eol + 1, names.size()));
+			}
+			return true;
+		}
+		mCacheHeader = nullptr;
+		mCacheFile.close();
+
+		const MappedFile source(path);
+		if (!source) {
+			fmt::println("Error: could not open mesh {}", path.string());
+			return false;
+		}
+
+		obj::ParseResult result;
+		if (!obj::parse(source.bytes(), result)) {
+			fmt::println("Error: invalid face indices in {}", path.string());
+			return false;
+		}
+		mVertices			= std::move(result.vertices);
+		mIndices			= std::move(result.indices);
+		mTriangleMaterials	= std::move(result.triangleMaterials);
+		mMaterialNames		= std::move(result.materialNames);
+		mMaterialLibraries	= std::move(result.materialLibraries);
 
-        tinyobj::ObjReader       reader; 
+		mBounds = { .min = glm::vec3(std::numeric_limits<float>::max()), .max = glm::vec3(std::numeric_limits<float>::lowest()) };
+		for (const auto& v : mVertices) {
+			mBounds.min = glm::min(mBounds.min, v.position);
+			mBounds.max = glm::max(mBounds.max, v.position);
+		}
 
-        reader.ParseFromFile(path.string().c_str());
-        assert(reader.Valid());  
+		uint32_t cacheFlags = reorderFlag;
+		if (normals::hasMissingNormals(mVertices)) {
+			normals::generateNormals(mVertices, mIndices, normalCreaseAngle);
+			cacheFlags |= kMeshCacheGeneratedNormals;
+		}
 
-		auto& attrib = reader.GetAttrib();
-		auto& shapes = reader.GetShapes();
+		if (bReorderForLocality) {
+			reorder::sortTrianglesMorton(mVertices, mIndices, mBounds, mTriangleMaterials);
+			reorder::reorderVerticesForFetch(mVertices, mIndices);
+		}
 
-		// Parse all vertices, normals, and texture coordinates
-		for (const auto& shape : shapes) {
-			for (const auto& index : shape.mesh.indices) {
-				Vertex vertex;
+		mSourceHash = hashBytes(source.bytes());
+		const MeshCacheMaterials materials{ .triangleMaterials = mTriangleMaterials, .names = mMaterialNames, .libraries = mMaterialLibraries };
+		if (!writeMeshCache(cachePath, path, mSourceHash, mVertices, mIndices, mBounds, cacheFlags, normalCreaseAngle, materials)) {
+			fmt::println("Warning: could not write mesh cache {}", cachePath.string());
+		}
+		return true;
+	}
 
-				// Position
-				vertex.position.x = attrib.vertices[3 * index.vertex_index + 0];
-				vertex.position.y = attrib.vertices[3 * index.vertex_index + 1];
-				vertex.position.z = attrib.vertices[3 * index.vertex_index + 2];
+	// Parses the mesh's MTL libraries (concurrently) into mMaterials. Names not found in any library get a default material.
+	void loadMaterialLibraries(ThreadPool& pool = ThreadPool::global())
+	{
+		std::vector<std::unordered_map<std::string, obj::LibraryMaterial>> libraries(mMaterialLibraries.size());
+		pool.parallelFor(libraries.size(), [&](size_t i) {
+			const auto path = mPath.parent_path() / fs::path(mMaterialLibraries[i]);
+			const MappedFile file(path);
+			if (!file) {
+				fmt::println("Warning: could not open material library {}", path.string());
+				return;
+			}
+			obj::parseMaterialLibrary(file.bytes(), libraries[i]);
+		});
 
-				// Normal
-				if (index.normal_index >= 0) {
-					vertex.normal.x = attrib.normals[3 * index.normal_index + 0];
-					vertex.normal.y = attrib.normals[3 * index.normal_index + 1];
-					vertex.normal.z = attrib.normals[3 * index.normal_index + 2];
-				}
-				else { vertex.normal.x = vertex.normal.y = vertex.normal.z = 0.f; }
-				// Texture Coordinate
-				if (index.texcoord_index >= 0) { // Check if texture coordinate exists
-					vertex.tex.x = attrib.texcoords[2 * index.texcoord_index + 0];
-					vertex.tex.y = attrib.texcoords[2 * index.texcoord_index + 1];
+		mMaterials.clear();
+		mMaterialTextures.clear();
+		for (const auto& name : mMaterialNames) {
+			Material material{ .type = DIFFUSE, .albedo = glm::vec3(0.8f), .phongExponent = 0, .emitted = glm::vec3(0.f) };
+			fs::path texture;
+			const auto library = std::find_if(libraries.begin(), libraries.end(), [&](const auto& l) { return l.contains(name); });
+			if (library != libraries.end()) {
+				const auto& libraryMaterial = library->at(name);
+				material = libraryMaterial.material;
+				if (!libraryMaterial.albedoTexture.empty()) {
+					const auto libraryPath = fs::path(mMaterialLibraries[library - libraries.begin()]);
+					texture = (mPath.parent_path() / libraryPath.parent_path() / fs::path(libraryMaterial.albedoTexture)).lexically_normal();
 				}
-				else {vertex.tex.x = vertex.tex.y = 0.0f;}
-
-				mVertices.push_back(std::move(vertex));
-				mIndices.push_back(static_cast<uint32_t>(mVertices.size() - 1));
 			}
+			else if (!name.empty()) { fmt::println("Warning: material {} of {} not found", name, mPath.string()); }
+			mMaterials.push_back(material);
+			mMaterialTextures.push_back(std::move(texture));
 		}
+	}
 
-        return true;
+	// Key under which identical mesh assets are shared: the source content, whether its materials are loaded and how many
+	// there are, and once they are loaded the library files they resolve to. A mesh without loaded materials can't stand
+	// in for one whose triangle materials index them, and the same OBJ in two directories may pick up different
+	// libraries and textures.
+	uint64_t assetKey() const
+	{
+		const uint64_t materials[2] = { mMaterials.empty() ? 0u : 1u, mMaterialNames.size() };
+		uint64_t key = hashBytes(std::as_bytes(std::span(materials)), mSourceHash);
+		if (!mMaterials.empty()) {
+			for (const auto& library : mMaterialLibraries) {
+				const auto path = (mPath.parent_path() / fs::path(library)).lexically_normal().generic_string();
+				key = hashBytes(std::as_bytes(std::span(path)), key);
+			}
+		}
+		return key;
 	}
-};
\ No newline at end of file
+};
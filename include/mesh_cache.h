@@ -0,0 +1,164 @@
+#pragma once
+
+#include <host_device_common.h>
+#include <mapped_file.h>
+#include <vk_types.h>
+
+#include <string>
+#include <thread>
+
+
+// Binary mesh cache, written next to the source asset on first load (e.g. assets/buddha.obj -> assets/buddha.obj.vkmesh)
+// and memory-mapped on later runs. File layout:
+//		MeshCacheHeader | Vertex[vertexCount] | uint32_t[indexCount] | uint32_t[indexCount / 3] | char[materialNamesSize]
+// The last two sections hold the per-triangle material indices and the '\n'-separated material library and material
+// names, and are only present if the mesh has materials (materialCount > 0).
+// Each section starts on a kMeshCacheAlignment (page) boundary and the file is padded to a whole page, so the mapped
+// sections can be read in place, or imported as Vulkan buffers with VK_EXT_external_memory_host.
+constexpr uint32_t kMeshCacheMagic		= 0x48534D56;	// "VMSH"
+constexpr uint32_t kMeshCacheVersion	= 5;
+constexpr uint64_t kMeshCacheAlignment	= 4096;
+
+// MeshCacheHeader::flags
+constexpr uint32_t kMeshCacheReordered			= 1 << 0;	// Triangles and vertices were reordered for locality (see mesh_reorder.h).
+constexpr uint32_t kMeshCacheGeneratedNormals	= 1 << 1;	// Missing normals were generated with normalCreaseAngle (see mesh_normals.h).
+
+struct MeshCacheHeader
+{
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	sourceSize;			// Size in bytes of the source file.
+	int64_t		sourceWriteTime;	// Last write time of the source file. Used as a fast staleness check.
+	uint64_t	sourceHash;			// Content hash of the source file.
+	uint64_t	vertexCount;
+	uint64_t	vertexOffset;
+	uint64_t	indexCount;
+	uint64_t	indexOffset;
+	AABB		bounds;				// Model-space bounds of the mesh.
+	uint32_t	flags;
+	float		normalCreaseAngle;	// Crease angle in degrees, if kMeshCacheGeneratedNormals is set.
+	uint32_t	materialCount;			// Number of material names (usemtl groups).
+	uint32_t	materialLibraryCount;	// Number of mtllib names, stored before the material names.
+	uint64_t	triangleMaterialOffset;
+	uint64_t	materialNamesOffset;
+	uint64_t	materialNamesSize;
+};
+
+// Per-triangle materials of a mesh, as stored in the cache.
+struct MeshCacheMaterials
+{
+	std::span<const uint32_t>		triangleMaterials;
+	std::span<const std::string>	names;
+	std::span<const std::string>	libraries;
+};
+
+
+inline uint64_t alignUp(uint64_t value, uint64_t alignment) { return (value + alignment - 1) & ~(alignment - 1); }
+
+inline fs::path meshCachePath(const fs::path& source)
+{
+	auto path = source;
+	path += ".vkmesh";
+	return path;
+}
+
+inline int64_t fileWriteTime(const fs::path& path)
+{
+	std::error_code ec;
+	const auto time = fs::last_write_time(path, ec);
+	return ec ? 0 : static_cast<int64_t>(time.time_since_epoch().count());
+}
+
+// Returns true if a cache built from a source file of the given size, write time and content hash is up to date.
+// A missing source file is not an error: the cache alone is enough to load the asset.
+inline bool cacheMatchesSource(const fs::path& source, uint64_t sourceSize, int64_t sourceWriteTime, uint64_t sourceHash)
+{
+	std::error_code ec;
+	const auto size = fs::file_size(source, ec);
+	if (ec)										{ return true; }
+	if (size != sourceSize)						{ return false; }
+	if (fileWriteTime(source) == sourceWriteTime) { return true; }
+
+	// The source has been touched, but its contents may be unchanged (e.g. after a checkout).
+	const MappedFile sourceFile(source);
+	return sourceFile && hashBytes(sourceFile.bytes()) == sourceHash;
+}
+
+// Returns the header of a mapped cache file if it is well-formed and up to date with its source, or nullptr otherwise.
+inline const MeshCacheHeader* validateMeshCache(const MappedFile& cache, const fs::path& source)
+{
+	if (!cache || cache.size() < sizeof(MeshCacheHeader)) { return nullptr; }
+
+	const auto* header = reinterpret_cast<const MeshCacheHeader*>(cache.data());
+	if (header->magic != kMeshCacheMagic || header->version != kMeshCacheVersion) { return nullptr; }
+	if (header->vertexOffset > cache.size() || header->vertexCount > (cache.size() - header->vertexOffset) / sizeof(Vertex) ||
+		header->indexOffset  > cache.size() || header->indexCount  > (cache.size() - header->indexOffset) / sizeof(uint32_t)) {
+		return nullptr;
+	}
+	if (header->materialCount > 0 &&
+		(header->triangleMaterialOffset > cache.size() || header->indexCount / 3 > (cache.size() - header->triangleMaterialOffset) / sizeof(uint32_t) ||
+		 header->materialNamesOffset > cache.size() || header->materialNamesSize > cache.size() - header->materialNamesOffset)) {
+		return nullptr;
+	}
+
+	return cacheMatchesSource(source, header->sourceSize, header->sourceWriteTime, header->sourceHash) ? header : nullptr;
+}
+
+// Writes a mesh cache file. The data is written to a temporary file that is then renamed into place,
+// so a concurrent reader never observes a partially written cache.
+inline bool writeMeshCache(const fs::path& cachePath, const fs::path& source, uint64_t sourceHash,
+	std::span<const Vertex> vertices, std::span<const uint32_t> indices, const AABB& bounds, uint32_t flags = 0, float normalCreaseAngle = 0.f, const MeshCacheMaterials& materials = {})
+{
+	std::string materialNames;
+	for (const auto& library : materials.libraries) { materialNames += library + '\n'; }
+	for (const auto& name : materials.names) { materialNames += name + '\n'; }
+
+	std::error_code ec;
+	MeshCacheHeader header{
+		.magic				= kMeshCacheMagic,
+		.version			= kMeshCacheVersion,
+		.sourceSize			= fs::file_size(source, ec),
+		.sourceWriteTime	= fileWriteTime(source),
+		.sourceHash			= sourceHash,
+		.vertexCount		= vertices.size(),
+		.indexCount			= indices.size(),
+		.bounds				= bounds,
+		.flags				= flags,
+		.normalCreaseAngle	= normalCreaseAngle,
+		.materialCount			= static_cast<uint32_t>(materials.names.size()),
+		.materialLibraryCount	= static_cast<uint32_t>(materials.libraries.size()),
+		.materialNamesSize		= materialNames.size()
+	};
+	header.vertexOffset				= alignUp(sizeof(MeshCacheHeader), kMeshCacheAlignment);
+	header.indexOffset				= alignUp(header.vertexOffset + vertices.size_bytes(), kMeshCacheAlignment);
+	header.triangleMaterialOffset	= alignUp(header.indexOffset + indices.size_bytes(), kMeshCacheAlignment);
+	header.materialNamesOffset		= alignUp(header.triangleMaterialOffset + materials.triangleMaterials.size_bytes(), kMeshCacheAlignment);
+
+	auto tmpPath = cachePath;
+	tmpPath += fmt::format(".{}.tmp", std::hash<std::thread::id>{}(std::this_thread::get_id()));
+	{
+		std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!file) { return false; }
+
+		uint64_t position = 0;
+		const auto writeAt = [&](uint64_t offset, const void* data, size_t size) {
+			static constexpr char kPadding[kMeshCacheAlignment] = {};
+			file.write(kPadding, static_cast<std::streamsize>(offset - position));
+			if (size > 0) { file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size)); }
+			position = offset + size;
+		};
+		writeAt(0, &header, sizeof(header));
+		writeAt(header.vertexOffset, vertices.data(), vertices.size_bytes());
+		writeAt(header.indexOffset, indices.data(), indices.size_bytes());
+		if (header.materialCount > 0) {
+			writeAt(header.triangleMaterialOffset, materials.triangleMaterials.data(), materials.triangleMaterials.size_bytes());
+			writeAt(header.materialNamesOffset, materialNames.data(), materialNames.size());
+		}
+		writeAt(alignUp(position, kMeshCacheAlignment), nullptr, 0);
+		if (!file) { file.close(); fs::remove(tmpPath, ec); return false; }
+	}
+
+	fs::rename(tmpPath, cachePath, ec);
+	if (ec) { fs::remove(tmpPath, ec); return false; }
+	return true;
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <host_device_common.h>
+#include <thread_pool.h>
+
+#include <bit>
+#include <cmath>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+
+// Load-time shading normal generation for meshes that come without normals (or with some missing).
+// Each triangle corner gets the area-weighted average of the face normals around its position, taken over the faces
+// whose normal is within the crease angle of the corner's own face. A crease angle of 0 gives faceted normals,
+// 180 fully smooth ones. Vertices whose corners end up with different normals are split.
+namespace normals
+{
+	namespace detail
+	{
+		struct PositionKey
+		{
+			uint32_t x, y, z;
+			bool operator==(const PositionKey&) const = default;
+		};
+
+		struct PositionHash
+		{
+			size_t operator()(const PositionKey& k) const noexcept
+			{
+				uint64_t h = k.x;
+				h = h * 0x9E3779B97F4A7C15ull ^ k.y;
+				h = h * 0x9E3779B97F4A7C15ull ^ k.z;
+				return static_cast<size_t>(h ^ (h >> 32));
+			}
+		};
+
+		inline PositionKey positionKey(glm::vec3 p)
+		{
+			// +0.f folds -0 into 0, so both land on the same key.
+			return { std::bit_cast<uint32_t>(p.x + 0.f), std::bit_cast<uint32_t>(p.y + 0.f), std::bit_cast<uint32_t>(p.z + 0.f) };
+		}
+	}
+
+	// True if any referenced vertex lacks a normal.
+	inline bool hasMissingNormals(std::span<const Vertex> vertices)
+	{
+		for (const auto& v : vertices) {
+			if (v.normal == glm::vec3(0.f)) { return true; }
+		}
+		return false;
+	}
+
+	// Fills in the zero normals of vertices. Vertices that already have a normal are left untouched.
+	inline void generateNormals(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, float creaseAngleDegrees, ThreadPool& pool = ThreadPool::global())
+	{
+		using namespace detail;
+
+		const size_t triangleCount = indices.size() / 3;
+		if (triangleCount == 0) { return; }
+		constexpr size_t kBatchSize = 1 << 14;
+		const size_t batchCount = (triangleCount + kBatchSize - 1) / kBatchSize;
+
+		// Area-weighted face normals.
+		std::vector<glm::vec3> faceNormals(triangleCount);
+		pool.parallelFor(batchCount, [&](size_t batch) {
+			const size_t end = std::min(triangleCount, (batch + 1) * kBatchSize);
+			for (size_t t = batch * kBatchSize; t < end; ++t) {
+				const glm::vec3 p0 = vertices[indices[3 * t + 0]].position;
+				faceNormals[t] = glm::cross(vertices[indices[3 * t + 1]].position - p0, vertices[indices[3 * t + 2]].position - p0);
+			}
+		});
+
+		// Vertices split by texcoord (or by an existing normal) still share a position, so smoothing works on positions.
+		std::vector<uint32_t> positionIDs(vertices.size());
+		{
+			std::unordered_map<PositionKey, uint32_t, PositionHash> ids;
+			ids.reserve(vertices.size());
+			for (size_t i = 0; i < vertices.size(); ++i) {
+				positionIDs[i] = ids.try_emplace(positionKey(vertices[i].position), static_cast<uint32_t>(ids.size())).first->second;
+			}
+		}
+
+		// Faces around each position, in compressed rows.
+		const size_t positionCount = positionIDs.empty() ? 0 : *std::max_element(positionIDs.begin(), positionIDs.end()) + 1;
+		std::vector<uint32_t> faceOffsets(positionCount + 1, 0);
+		for (const uint32_t index : indices) { ++faceOffsets[positionIDs[index] + 1]; }
+		for (size_t i = 0; i < positionCount; ++i) { faceOffsets[i + 1] += faceOffsets[i]; }
+		std::vector<uint32_t> faces(indices.size());
+		{
+			std::vector<uint32_t> cursor(faceOffsets.begin(), faceOffsets.end() - 1);
+			for (size_t corner = 0; corner < indices.size(); ++corner) {
+				faces[cursor[positionIDs[indices[corner]]]++] = static_cast<uint32_t>(corner / 3);
+			}
+		}
+
+		// Normal of every triangle corner whose vertex has none. Faces are visited in the same order for every corner at
+		// a position, so fully smooth corners get bit-identical normals and are not split below.
+		const float cosCrease = std::cos(glm::radians(std::clamp(creaseAngleDegrees, 0.f, 180.f)));
+		std::vector<glm::vec3> cornerNormals(indices.size(), glm::vec3(0.f));
+		pool.parallelFor(batchCount, [&](size_t batch) {
+			const size_t end = std::min(triangleCount, (batch + 1) * kBatchSize);
+			for (size_t t = batch * kBatchSize; t < end; ++t) {
+				const float faceLength = glm::length(faceNormals[t]);
+				const glm::vec3 faceDirection = faceLength > 0.f ? faceNormals[t] / faceLength : glm::vec3(0.f, 0.f, 1.f);
+				for (size_t corner = 3 * t; corner < 3 * t + 3; ++corner) {
+					if (vertices[indices[corner]].normal != glm::vec3(0.f)) { continue; }
+
+					const uint32_t position = positionIDs[indices[corner]];
+					glm::vec3 sum(0.f);
+					for (uint32_t i = faceOffsets[position]; i < faceOffsets[position + 1]; ++i) {
+						const glm::vec3 n = faceNormals[faces[i]];
+						const float length = glm::length(n);
+						if (faces[i] == t || (length > 0.f && glm::dot(n, faceDirection) >= cosCrease * length)) { sum += n; }
+					}
+					const float sumLength = glm::length(sum);
+					cornerNormals[corner] = sumLength > 0.f ? sum / sumLength : faceDirection;
+				}
+			}
+		});
+
+		// Give each vertex the normal of its first corner, and split off a copy for each distinct normal after that.
+		struct SplitKey
+		{
+			uint32_t vertex;
+			PositionKey normal;
+			bool operator==(const SplitKey&) const = default;
+		};
+		struct SplitHash
+		{
+			size_t operator()(const SplitKey& k) const noexcept { return PositionHash{}(k.normal) * 31 + k.vertex; }
+		};
+		std::unordered_map<SplitKey, uint32_t, SplitHash> splits;
+		std::vector<bool> bAssigned(vertices.size(), false);
+		for (size_t corner = 0; corner < indices.size(); ++corner) {
+			const uint32_t vertex = indices[corner];
+			const glm::vec3 n = cornerNormals[corner];
+			if (n == glm::vec3(0.f)) { continue; }	// The vertex had a normal.
+
+			if (!bAssigned[vertex]) {
+				vertices[vertex].normal = n;
+				bAssigned[vertex] = true;
+				splits.try_emplace({ vertex, positionKey(n) }, vertex);
+				continue;
+			}
+			const auto [it, bInserted] = splits.try_emplace({ vertex, positionKey(n) }, static_cast<uint32_t>(vertices.size()));
+			if (bInserted) {
+				Vertex copy = vertices[vertex];
+				copy.normal = n;
+				vertices.push_back(copy);
+			}
+			indices[corner] = it->second;
+		}
+	}
+}
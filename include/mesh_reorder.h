@@ -0,0 +1,93 @@
+#pragma once
+
+#include <host_device_common.h>
+#include <thread_pool.h>
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <span>
+#include <vector>
+
+
+// Load-time reordering of indexed triangle meshes for memory locality.
+// Triangles are sorted along a Morton (Z-order) curve through their centroids, so triangles that are close in space
+// (and so are likely to be hit by neighbouring rays) are close in the index buffer. Vertices are then renumbered in the
+// order the triangles first reference them, so the vertex fetches of neighbouring triangles land in neighbouring memory.
+namespace reorder
+{
+	// Spreads the low 10 bits of v so that there are two zero bits between each of them.
+	inline uint32_t expandBits(uint32_t v)
+	{
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		return v;
+	}
+
+	// 30-bit Morton code of a point given in [0,1]^3.
+	inline uint32_t morton3D(glm::vec3 p)
+	{
+		const auto quantize = [](float x) { return static_cast<uint32_t>(std::clamp(x * 1024.f, 0.f, 1023.f)); };
+		return (expandBits(quantize(p.x)) << 2) | (expandBits(quantize(p.y)) << 1) | expandBits(quantize(p.z));
+	}
+
+	// Sorts the triangles of an index buffer by the Morton code of their centroids within bounds.
+	// Per-triangle data (e.g. material indices), if given, is permuted along with the triangles.
+	inline void sortTrianglesMorton(std::span<const Vertex> vertices, std::vector<uint32_t>& indices, const AABB& bounds,
+		std::span<uint32_t> triangleData = {}, ThreadPool& pool = ThreadPool::global())
+	{
+		const size_t triangleCount = indices.size() / 3;
+		if (triangleCount < 2) { return; }
+
+		const glm::vec3 extent = bounds.max - bounds.min;
+		const float scale = 1.f / std::max({ extent.x, extent.y, extent.z, std::numeric_limits<float>::min() });
+
+		// Key = (Morton code << 32) | original triangle index, so the sort is deterministic.
+		std::vector<uint64_t> keys(triangleCount);
+		constexpr size_t kBatchSize = 1 << 14;
+		pool.parallelFor((triangleCount + kBatchSize - 1) / kBatchSize, [&](size_t batch) {
+			const size_t end = std::min(triangleCount, (batch + 1) * kBatchSize);
+			for (size_t t = batch * kBatchSize; t < end; ++t) {
+				const glm::vec3 centroid = (vertices[indices[3 * t + 0]].position + vertices[indices[3 * t + 1]].position + vertices[indices[3 * t + 2]].position) / 3.f;
+				keys[t] = (static_cast<uint64_t>(morton3D((centroid - bounds.min) * scale)) << 32) | t;
+			}
+		});
+		std::sort(keys.begin(), keys.end());
+
+		std::vector<uint32_t> sorted(indices.size());
+		for (size_t t = 0; t < triangleCount; ++t) {
+			const size_t source = static_cast<uint32_t>(keys[t]);
+			sorted[3 * t + 0] = indices[3 * source + 0];
+			sorted[3 * t + 1] = indices[3 * source + 1];
+			sorted[3 * t + 2] = indices[3 * source + 2];
+		}
+		indices = std::move(sorted);
+
+		if (!triangleData.empty()) {
+			const std::vector<uint32_t> original(triangleData.begin(), triangleData.end());
+			for (size_t t = 0; t < triangleCount; ++t) { triangleData[t] = original[static_cast<uint32_t>(keys[t])]; }
+		}
+	}
+
+	// Renumbers vertices in the order they are first referenced by the index buffer.
+	// Unreferenced vertices are kept, after all referenced ones.
+	inline void reorderVerticesForFetch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+	{
+		constexpr uint32_t kUnassigned = std::numeric_limits<uint32_t>::max();
+		std::vector<uint32_t> remap(vertices.size(), kUnassigned);
+		uint32_t next = 0;
+		for (auto& index : indices) {
+			if (remap[index] == kUnassigned) { remap[index] = next++; }
+			index = remap[index];
+		}
+		for (auto& slot : remap) {
+			if (slot == kUnassigned) { slot = next++; }
+		}
+
+		std::vector<Vertex> reordered(vertices.size());
+		for (size_t i = 0; i < vertices.size(); ++i) { reordered[remap[i]] = vertices[i]; }
+		vertices = std::move(reordered);
+	}
+}
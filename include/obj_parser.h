@@ -0,0 +1,387 @@
+#pragma once
+
+#include <host_device_common.h>
+#include <thread_pool.h>
+#include <vk_types.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+
+// Multi-threaded Wavefront OBJ parser.
+//
+// The file is split into chunks at line boundaries. A first parallel pass counts the attributes and triangles in each
+// chunk, so every chunk knows where its data lands in the final arrays (and can resolve relative indices). A second
+// parallel pass parses the chunks with std::from_chars directly into those arrays. Finally, triangle corners that
+// reference the same (position, texcoord, normal) triple are welded into a single shared vertex.
+namespace obj
+{
+	// 0-based attribute indices of a triangle corner. Texcoord/normal are -1 when absent.
+	struct Corner
+	{
+		int32_t v;
+		int32_t t;
+		int32_t n;
+	};
+
+	struct CornerHash
+	{
+		size_t operator()(const Corner& c) const noexcept
+		{
+			uint64_t h = static_cast<uint32_t>(c.v);
+			h = h * 0x9E3779B97F4A7C15ull ^ static_cast<uint32_t>(c.t);
+			h = h * 0x9E3779B97F4A7C15ull ^ static_cast<uint32_t>(c.n);
+			return static_cast<size_t>(h ^ (h >> 32));
+		}
+	};
+
+	struct CornerEqual
+	{
+		bool operator()(const Corner& a, const Corner& b) const noexcept { return a.v == b.v && a.t == b.t && a.n == b.n; }
+	};
+
+	namespace detail
+	{
+		constexpr size_t kTargetChunkSize = 1 << 20;
+		constexpr uint32_t kNoMaterial = std::numeric_limits<uint32_t>::max();
+
+		struct Chunk
+		{
+			const char* begin;
+			const char* end;
+
+			// Element counts, filled in by the counting pass.
+			size_t positionCount	= 0;
+			size_t normalCount		= 0;
+			size_t texcoordCount	= 0;
+			size_t triangleCount	= 0;
+
+			// Offsets of this chunk's data in the global arrays.
+			size_t positionBase		= 0;
+			size_t normalBase		= 0;
+			size_t texcoordBase		= 0;
+			size_t triangleBase		= 0;
+
+			// Material statements, collected by the counting pass.
+			std::vector<std::string_view>	materialNames;		// usemtl names, in order.
+			std::vector<std::string_view>	materialLibraries;	// mtllib file names.
+			uint32_t						initialMaterial = kNoMaterial;	// Material in effect where the chunk begins.
+		};
+
+		inline bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+		inline const char* skipSpaces(const char* p, const char* end)
+		{
+			while (p < end && isSpace(*p)) { ++p; }
+			return p;
+		}
+
+		// Calls function(lineBegin, lineEnd) for every line in [begin, end), with leading whitespace removed.
+		template<typename F>
+		void forEachLine(const char* begin, const char* end, F&& function)
+		{
+			for (const char* p = begin; p < end;) {
+				const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+				if (!eol) { eol = end; }
+				function(skipSpaces(p, eol), eol);
+				p = eol + 1;
+			}
+		}
+
+		inline const char* parseFloat(const char* p, const char* end, float& value)
+		{
+			p = skipSpaces(p, end);
+			if (p < end && *p == '+') { ++p; }
+			const auto result = std::from_chars(p, end, value);
+			if (result.ec != std::errc()) { value = 0.f; }
+			return result.ptr;
+		}
+
+		// Number of vertices referenced by the face statement starting at p.
+		inline size_t countFaceVertices(const char* p, const char* end)
+		{
+			size_t count = 0;
+			while ((p = skipSpaces(p, end)) < end) {
+				++count;
+				while (p < end && !isSpace(*p)) { ++p; }
+			}
+			return count;
+		}
+
+		// If the line [p, eol) is the given statement, returns its argument with surrounding whitespace removed.
+		inline bool statementArgument(const char* p, const char* eol, std::string_view keyword, std::string_view& argument)
+		{
+			const std::string_view line(p, eol - p);
+			if (line.size() <= keyword.size() || !line.starts_with(keyword) || !isSpace(line[keyword.size()])) { return false; }
+			argument = line.substr(keyword.size());
+			while (!argument.empty() && isSpace(argument.front())) { argument.remove_prefix(1); }
+			while (!argument.empty() && isSpace(argument.back())) { argument.remove_suffix(1); }
+			return !argument.empty();
+		}
+
+		// Parses one OBJ index and converts it to a 0-based index into the global attribute array.
+		// `seen` is the number of elements of that attribute defined before this line, used for relative (negative) indices.
+		inline const char* parseIndex(const char* p, const char* end, size_t seen, size_t total, int32_t& index, bool& valid)
+		{
+			int64_t value = 0;
+			const auto result = std::from_chars(p, end, value);
+			if (result.ec != std::errc()) { index = -1; return p; }
+
+			const int64_t resolved = value > 0 ? value - 1 : static_cast<int64_t>(seen) + value;
+			if (value == 0 || resolved < 0 || resolved >= static_cast<int64_t>(total)) {
+				valid = false;
+				index = -1;
+			}
+			else { index = static_cast<int32_t>(resolved); }
+			return result.ptr;
+		}
+	}
+
+	struct ParseResult
+	{
+		std::vector<Vertex>			vertices;
+		std::vector<uint32_t>		indices;
+		std::vector<uint32_t>		triangleMaterials;	// Per triangle index into materialNames. Empty if the file has no usemtl.
+		std::vector<std::string>	materialNames;		// In order of first use. Faces before any usemtl use the name "".
+		std::vector<std::string>	materialLibraries;	// mtllib file names, relative to the OBJ file.
+	};
+
+	// Parses OBJ text into welded vertices and a triangle index buffer. Polygons are triangulated as fans.
+	// usemtl groups become per-triangle material indices, so multi-material files stay a single mesh.
+	// Returns false if the file references attributes that do not exist.
+	inline bool parse(std::span<const std::byte> bytes, ParseResult& out, ThreadPool& pool = ThreadPool::global())
+	{
+		using namespace detail;
+
+		const char* const text		= reinterpret_cast<const char*>(bytes.data());
+		const char* const textEnd	= text + bytes.size();
+
+		// Split the file into chunks that end on line boundaries.
+		const size_t chunkCount = std::clamp<size_t>(bytes.size() / kTargetChunkSize, 1, size_t(pool.threadCount()) * 8);
+		std::vector<Chunk> chunks;
+		chunks.reserve(chunkCount);
+		const char* chunkBegin = text;
+		for (size_t i = 1; i <= chunkCount && chunkBegin < textEnd; ++i) {
+			const char* chunkEnd = (i == chunkCount) ? textEnd : std::max(chunkBegin, text + bytes.size() * i / chunkCount);
+			if (chunkEnd < textEnd) {
+				const char* eol = static_cast<const char*>(std::memchr(chunkEnd, '\n', textEnd - chunkEnd));
+				chunkEnd = eol ? eol + 1 : textEnd;
+			}
+			chunks.push_back(Chunk{ .begin = chunkBegin, .end = chunkEnd });
+			chunkBegin = chunkEnd;
+		}
+
+		// Pass 1: count the elements in each chunk.
+		pool.parallelFor(chunks.size(), [&](size_t c) {
+			Chunk& chunk = chunks[c];
+			forEachLine(chunk.begin, chunk.end, [&](const char* p, const char* eol) {
+				std::string_view argument;
+				if (eol - p < 2) { return; }
+				if (p[0] == 'u' && statementArgument(p, eol, "usemtl", argument))		{ chunk.materialNames.push_back(argument); return; }
+				if (p[0] == 'm' && statementArgument(p, eol, "mtllib", argument))		{ chunk.materialLibraries.push_back(argument); return; }
+				if (!isSpace(p[1]) && p[1] != 'n' && p[1] != 't') { return; }
+				if (p[0] == 'v') {
+					if		(isSpace(p[1]))	{ ++chunk.positionCount; }
+					else if (p[1] == 'n')	{ ++chunk.normalCount; }
+					else if (p[1] == 't')	{ ++chunk.texcoordCount; }
+				}
+				else if (p[0] == 'f' && isSpace(p[1])) {
+					const size_t faceVertices = countFaceVertices(p + 2, eol);
+					chunk.triangleCount += faceVertices >= 3 ? faceVertices - 2 : 0;
+				}
+			});
+		});
+
+		size_t positionTotal = 0, normalTotal = 0, texcoordTotal = 0, triangleTotal = 0;
+		for (Chunk& chunk : chunks) {
+			chunk.positionBase = positionTotal;		positionTotal += chunk.positionCount;
+			chunk.normalBase = normalTotal;			normalTotal += chunk.normalCount;
+			chunk.texcoordBase = texcoordTotal;		texcoordTotal += chunk.texcoordCount;
+			chunk.triangleBase = triangleTotal;		triangleTotal += chunk.triangleCount;
+		}
+
+		// Number the material names in order of first use, and carry the current material across chunk boundaries.
+		out.materialNames.clear();
+		out.materialLibraries.clear();
+		std::unordered_map<std::string_view, uint32_t> materialIDs;
+		uint32_t currentMaterial = kNoMaterial;
+		for (Chunk& chunk : chunks) {
+			chunk.initialMaterial = currentMaterial;
+			for (const auto name : chunk.materialNames) {
+				const auto [it, inserted] = materialIDs.try_emplace(name, static_cast<uint32_t>(out.materialNames.size()));
+				if (inserted) { out.materialNames.emplace_back(name); }
+				currentMaterial = it->second;
+			}
+			for (const auto library : chunk.materialLibraries) {
+				if (std::find(out.materialLibraries.begin(), out.materialLibraries.end(), library) == out.materialLibraries.end()) { out.materialLibraries.emplace_back(library); }
+			}
+		}
+		out.triangleMaterials.assign(out.materialNames.empty() ? 0 : triangleTotal, kNoMaterial);
+
+		std::vector<glm::vec3>	positions(positionTotal);
+		std::vector<glm::vec3>	normals(normalTotal);
+		std::vector<glm::vec2>	texcoords(texcoordTotal);
+		std::vector<Corner>		corners(triangleTotal * 3);
+
+		// Pass 2: parse each chunk straight into its slice of the global arrays.
+		std::atomic<bool> valid{ true };
+		pool.parallelFor(chunks.size(), [&](size_t c) {
+			const Chunk& chunk = chunks[c];
+			size_t position = chunk.positionBase, normal = chunk.normalBase, texcoord = chunk.texcoordBase;
+			Corner* corner = corners.data() + 3 * chunk.triangleBase;
+			uint32_t* triangleMaterial = out.triangleMaterials.empty() ? nullptr : out.triangleMaterials.data() + chunk.triangleBase;
+			uint32_t material = chunk.initialMaterial;
+			bool chunkValid = true;
+
+			std::vector<Corner> polygon;
+			forEachLine(chunk.begin, chunk.end, [&](const char* p, const char* eol) {
+				std::string_view argument;
+				if (eol - p < 2) { return; }
+				if (p[0] == 'u' && statementArgument(p, eol, "usemtl", argument)) {
+					material = materialIDs.find(argument)->second;
+				}
+				else if (p[0] == 'v' && isSpace(p[1])) {
+					glm::vec3& v = positions[position++];
+					p = parseFloat(p + 2, eol, v.x);
+					p = parseFloat(p, eol, v.y);
+					parseFloat(p, eol, v.z);
+				}
+				else if (p[0] == 'v' && p[1] == 'n') {
+					glm::vec3& n = normals[normal++];
+					p = parseFloat(p + 2, eol, n.x);
+					p = parseFloat(p, eol, n.y);
+					parseFloat(p, eol, n.z);
+				}
+				else if (p[0] == 'v' && p[1] == 't') {
+					glm::vec2& t = texcoords[texcoord++];
+					p = parseFloat(p + 2, eol, t.x);
+					parseFloat(p, eol, t.y);
+				}
+				else if (p[0] == 'f' && isSpace(p[1])) {
+					// Face vertices are "v", "v/t", "v//n" or "v/t/n".
+					polygon.clear();
+					p += 2;
+					while ((p = skipSpaces(p, eol)) < eol) {
+						Corner c{ -1, -1, -1 };
+						p = parseIndex(p, eol, position, positionTotal, c.v, chunkValid);
+						if (p < eol && *p == '/') {
+							++p;
+							if (p < eol && *p != '/')	{ p = parseIndex(p, eol, texcoord, texcoordTotal, c.t, chunkValid); }
+							if (p < eol && *p == '/')	{ p = parseIndex(p + 1, eol, normal, normalTotal, c.n, chunkValid); }
+						}
+						if (c.v < 0) { chunkValid = false; }
+						while (p < eol && !isSpace(*p)) { ++p; }
+						polygon.push_back(c);
+					}
+					for (size_t i = 2; i < polygon.size(); ++i) {
+						*corner++ = polygon[0];
+						*corner++ = polygon[i - 1];
+						*corner++ = polygon[i];
+						if (triangleMaterial) { *triangleMaterial++ = material; }
+					}
+				}
+			});
+			if (!chunkValid) { valid = false; }
+		});
+		if (!valid) { return false; }
+
+		// Faces before the first usemtl get a material of their own.
+		if (std::find(out.triangleMaterials.begin(), out.triangleMaterials.end(), kNoMaterial) != out.triangleMaterials.end()) {
+			const uint32_t unnamed = static_cast<uint32_t>(out.materialNames.size());
+			out.materialNames.emplace_back();
+			std::replace(out.triangleMaterials.begin(), out.triangleMaterials.end(), kNoMaterial, unnamed);
+		}
+
+		// Weld corners into shared vertices, in order of first use.
+		out.vertices.clear();
+		out.indices.clear();
+		out.indices.reserve(corners.size());
+
+		std::unordered_map<Corner, uint32_t, CornerHash, CornerEqual> uniqueVertices;
+		uniqueVertices.reserve(positions.size());
+		for (const Corner& c : corners) {
+			const auto [it, inserted] = uniqueVertices.try_emplace(c, static_cast<uint32_t>(out.vertices.size()));
+			if (inserted) {
+				out.vertices.push_back(Vertex{
+					.position	= positions[c.v],
+					.normal		= c.n >= 0 ? normals[c.n] : glm::vec3(0.f),
+					.tex		= c.t >= 0 ? texcoords[c.t] : glm::vec2(0.f)
+					});
+			}
+			out.indices.push_back(it->second);
+		}
+		out.vertices.shrink_to_fit();
+		return true;
+	}
+
+	// A material of an MTL library, with its albedo texture (map_Kd), relative to the library, if it has one.
+	struct LibraryMaterial
+	{
+		Material	material;
+		std::string	albedoTexture;
+	};
+
+	// Parses a Wavefront MTL material library, adding its materials by name. The MTL illumination model is mapped onto
+	// the renderer's material types: emissive (Ke) materials become lights, transparent ones (illum 4/6/7/9, d < 1)
+	// dielectrics, reflective ones (illum 3/5) mirrors, and specular ones (Ks, Ns) Phong; everything else is diffuse.
+	inline void parseMaterialLibrary(std::span<const std::byte> bytes, std::unordered_map<std::string, LibraryMaterial>& materials)
+	{
+		using namespace detail;
+
+		struct MtlMaterial
+		{
+			std::string	name;
+			glm::vec3	kd = glm::vec3(0.8f);
+			glm::vec3	ks = glm::vec3(0.f);
+			glm::vec3	ke = glm::vec3(0.f);
+			float		ns = 0.f;
+			float		dissolve = 1.f;
+			int			illum = 2;
+			std::string	mapKd;
+		};
+
+		const auto finish = [&](const MtlMaterial& m) {
+			if (m.name.empty()) { return; }
+			Material material{ .type = DIFFUSE, .albedo = m.kd, .phongExponent = 0, .emitted = glm::vec3(0.f) };
+			if (m.ke != glm::vec3(0.f))															{ material.type = LIGHT; material.emitted = m.ke; }
+			else if (m.illum == 4 || m.illum == 6 || m.illum == 7 || m.illum == 9 || m.dissolve < 1.f)	{ material.type = DIELECTRIC; material.albedo = glm::vec3(1.f); }
+			else if (m.illum == 3 || m.illum == 5)												{ material.type = MIRROR; material.albedo = m.ks != glm::vec3(0.f) ? m.ks : m.kd; }
+			else if (m.ks != glm::vec3(0.f) && m.ns > 1.f)										{ material.type = PHONG; material.phongExponent = static_cast<int>(m.ns); }
+			materials.insert_or_assign(m.name, LibraryMaterial{ material, m.mapKd });
+		};
+
+		const char* const text = reinterpret_cast<const char*>(bytes.data());
+		MtlMaterial current;
+		forEachLine(text, text + bytes.size(), [&](const char* p, const char* eol) {
+			const auto readVector = [&](const char* q, glm::vec3& v) {
+				q = parseFloat(q, eol, v.x);
+				q = parseFloat(q, eol, v.y);
+				parseFloat(q, eol, v.z);
+			};
+
+			std::string_view argument;
+			if (statementArgument(p, eol, "newmtl", argument)) {
+				finish(current);
+				current = MtlMaterial{ .name = std::string(argument) };
+			}
+			else if (statementArgument(p, eol, "Kd", argument))	{ readVector(argument.data(), current.kd); }
+			else if (statementArgument(p, eol, "Ks", argument))	{ readVector(argument.data(), current.ks); }
+			else if (statementArgument(p, eol, "Ke", argument))	{ readVector(argument.data(), current.ke); }
+			else if (statementArgument(p, eol, "Ns", argument))	{ parseFloat(argument.data(), eol, current.ns); }
+			else if (statementArgument(p, eol, "d", argument))	{ parseFloat(argument.data(), eol, current.dissolve); }
+			else if (statementArgument(p, eol, "illum", argument)) { std::from_chars(argument.data(), eol, current.illum); }
+			else if (statementArgument(p, eol, "map_Kd", argument)) {
+				// The file name is the last token, after any options. Some exporters write Windows separators.
+				const size_t separator = argument.find_last_of(" \t");
+				current.mapKd = std::string(separator == std::string_view::npos ? argument : argument.substr(separator + 1));
+				std::replace(current.mapKd.begin(), current.mapKd.end(), '\\', '/');
+			}
+		});
+		finish(current);
+	}
+}
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <memory_report.h>
+#include <vk_helpers.h>
+#include <vk_types.h>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+
+// A small frame graph for the GPU work of a submission: acceleration structure builds, tracing, readback. Passes declare
+// the resources they access, and execute() records them in order, each preceded by the synchronization2 barriers derived
+// from those declarations. A resource only gets a barrier when its previous access conflicts: a write before or after,
+// or a layout change. Reads after reads need none, and the buffer barriers of a pass are merged into one memory barrier.
+// Imported resources (persistent buffers and images) keep their ResourceState with their owner, so barriers also cover
+// the accesses of earlier graphs. Transient resources (build scratch, intermediate images) live from their first to their
+// last pass. They are placed in one memory allocation, where resources with disjoint lifetimes share memory, and the
+// allocation is kept across graphs so that repeated builds don't allocate.
+class RenderGraph
+{
+public:
+	using ResourceID = uint32_t;
+
+	// Synchronization state of a resource after its last access.
+	struct ResourceState
+	{
+		VkPipelineStageFlags2	writeStages = VK_PIPELINE_STAGE_2_NONE;		// Last write or layout transition.
+		VkAccessFlags2			writeAccesses = VK_ACCESS_2_NONE;
+		VkPipelineStageFlags2	readStages = VK_PIPELINE_STAGE_2_NONE;		// Reads since, the last write is visible to them.
+		VkAccessFlags2			readAccesses = VK_ACCESS_2_NONE;
+		VkImageLayout			layout = VK_IMAGE_LAYOUT_UNDEFINED;
+	};
+
+	struct Access
+	{
+		ResourceID				resource;
+		VkPipelineStageFlags2	stages;
+		VkAccessFlags2			accesses;
+		VkImageLayout			layout = VK_IMAGE_LAYOUT_UNDEFINED;	// Images only.
+	};
+
+	// Transient memory is counted as MemoryCategory::Scratch in tracker, if given. Transient resources are placed at
+	// multiples of minAlignment, which must be at least bufferImageGranularity for buffers and images to share memory.
+	void init(VkDevice device, VmaAllocator allocator, VkDeviceSize minAlignment, MemoryTracker* tracker = nullptr)
+	{
+		mDevice = device;
+		mAllocator = allocator;
+		mMinAlignment = std::max<VkDeviceSize>(minAlignment, 1);
+		mTracker = tracker;
+	}
+
+	void destroy()
+	{
+		reset();
+		freeMemory();
+	}
+
+	// Starts a new graph. The previous one must have finished executing.
+	void reset()
+	{
+		for (const auto& resource : mResources) {
+			if (!resource.bTransient) { continue; }
+			if (resource.buffer) { vkDestroyBuffer(mDevice, resource.buffer, nullptr); }
+			if (resource.image) { vkDestroyImage(mDevice, resource.image, nullptr); }
+		}
+		mResources.clear();
+		mPasses.clear();
+	}
+
+	ResourceID importBuffer(VkBuffer buffer, ResourceState& state)
+	{
+		return addResource({ .buffer = buffer, .pImported = &state });
+	}
+
+	ResourceID importImage(VkImage image, const VkImageSubresourceRange& range, ResourceState& state)
+	{
+		return addResource({ .image = image, .range = range, .pImported = &state });
+	}
+
+	// Transient buffer, with memory from the first pass using it. alignment adds to the buffer's own requirement (e.g.
+	// minAccelerationStructureScratchOffsetAlignment for build scratch).
+	ResourceID createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkDeviceSize alignment = 1)
+	{
+		const VkBufferCreateInfo createInfo{
+			.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+			.size = size,
+			.usage = usage,
+			.sharingMode = VK_SHARING_MODE_EXCLUSIVE
+		};
+		Resource resource{ .bTransient = true };
+		VK_CHECK(vkCreateBuffer(mDevice, &createInfo, nullptr, &resource.buffer));
+		vkGetBufferMemoryRequirements(mDevice, resource.buffer, &resource.requirements);
+		resource.requirements.alignment = std::max(resource.requirements.alignment, alignment);
+		return addResource(resource);
+	}
+
+	// Transient image. Its contents are undefined at its first pass.
+	ResourceID createImage(const VkImageCreateInfo& createInfo, const VkImageSubresourceRange& range)
+	{
+		Resource resource{ .range = range, .bTransient = true };
+		VK_CHECK(vkCreateImage(mDevice, &createInfo, nullptr, &resource.image));
+		vkGetImageMemoryRequirements(mDevice, resource.image, &resource.requirements);
+		return addResource(resource);
+	}
+
+	// record may be empty, for a pass that only declares accesses (e.g. host reads after the submission).
+	void addPass(std::vector<Access> accesses, std::function<void(VkCommandBuffer cmd)> record = {})
+	{
+		mPasses.push_back({ std::move(accesses), std::move(record) });
+	}
+
+	VkBuffer buffer(ResourceID id) const { return mResources[id].buffer; }
+	VkImage image(ResourceID id) const { return mResources[id].image; }
+
+	// Transient buffers are bound to memory by execute(), so only take their address in the pass record functions.
+	VkDeviceAddress address(ResourceID id) const { return GetBufferDeviceAddress(mDevice, mResources[id].buffer); }
+
+	// Size of the transient memory.
+	VkDeviceSize memorySize() const { return mMemorySize; }
+
+	void execute(VkCommandBuffer cmd)
+	{
+		allocateTransients();
+		for (uint32_t i = 0; i < mPasses.size(); ++i) {
+			recordBarriers(cmd, i);
+			if (mPasses[i].record) { mPasses[i].record(cmd); }
+		}
+
+		// Transients of the next graph may reuse the memory of this one.
+		mTransientStages = VK_PIPELINE_STAGE_2_NONE;
+		mTransientWrites = VK_ACCESS_2_NONE;
+		for (const auto& resource : mResources) {
+			if (!resource.bTransient) { continue; }
+			mTransientStages |= resource.state.writeStages | resource.state.readStages;
+			mTransientWrites |= resource.state.writeAccesses;
+		}
+	}
+
+private:
+	static constexpr VkAccessFlags2 kWriteAccesses = VK_ACCESS_2_SHADER_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+		VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT |
+		VK_ACCESS_2_HOST_WRITE_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+
+	struct Resource
+	{
+		VkBuffer				buffer = VK_NULL_HANDLE;
+		VkImage					image = VK_NULL_HANDLE;
+		VkImageSubresourceRange	range{};
+		ResourceState*			pImported = nullptr;
+		bool					bTransient = false;
+		ResourceState			state;				// Of transient resources.
+		VkMemoryRequirements	requirements{};
+		VkDeviceSize			offset = 0;
+		VkDeviceSize			size = 0;			// Taken in the transient memory.
+		uint32_t				firstPass = UINT32_MAX;
+		uint32_t				lastPass = 0;
+		std::vector<ResourceID>	aliased;			// Transients placed in the same memory before this one.
+	};
+
+	struct Pass
+	{
+		std::vector<Access>						accesses;
+		std::function<void(VkCommandBuffer cmd)>	record;
+	};
+
+	ResourceID addResource(Resource resource)
+	{
+		mResources.push_back(std::move(resource));
+		return static_cast<ResourceID>(mResources.size() - 1);
+	}
+
+	static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) { return (value + alignment - 1) / alignment * alignment; }
+
+	// Places the transient resources used by the passes, the largest first, each at the lowest offset not taken by a
+	// resource alive at the same time. Then binds them to the transient memory, reallocated if it is too small.
+	void allocateTransients()
+	{
+		for (uint32_t i = 0; i < mPasses.size(); ++i) {
+			for (const auto& access : mPasses[i].accesses) {
+				Resource& resource = mResources[access.resource];
+				resource.firstPass = std::min(resource.firstPass, i);
+				resource.lastPass = std::max(resource.lastPass, i);
+			}
+		}
+
+		std::vector<ResourceID> order;
+		uint32_t memoryTypeBits = ~0u;
+		VkDeviceSize alignment = mMinAlignment;
+		for (ResourceID id = 0; id < mResources.size(); ++id) {
+			const Resource& resource = mResources[id];
+			if (!resource.bTransient || resource.firstPass == UINT32_MAX) { continue; }
+			order.push_back(id);
+			memoryTypeBits &= resource.requirements.memoryTypeBits;
+			alignment = std::max(alignment, resource.requirements.alignment);
+		}
+		if (order.empty()) { return; }
+		std::sort(order.begin(), order.end(), [&](ResourceID a, ResourceID b) { return mResources[a].requirements.size > mResources[b].requirements.size; });
+
+		VkDeviceSize memorySize = 0;
+		std::vector<ResourceID> placed;
+		for (const ResourceID id : order) {
+			Resource& resource = mResources[id];
+			const auto overlaps = [&](const Resource& other) { return other.firstPass <= resource.lastPass && resource.firstPass <= other.lastPass; };
+
+			std::vector<std::pair<VkDeviceSize, VkDeviceSize>> taken;
+			for (const ResourceID other : placed) {
+				if (overlaps(mResources[other])) { taken.emplace_back(mResources[other].offset, mResources[other].offset + mResources[other].size); }
+			}
+			std::sort(taken.begin(), taken.end());
+
+			const VkDeviceSize resourceAlignment = std::max(resource.requirements.alignment, mMinAlignment);
+			resource.size = alignUp(resource.requirements.size, mMinAlignment);
+			VkDeviceSize offset = 0;
+			for (const auto& [begin, end] : taken) {
+				if (alignUp(offset, resourceAlignment) + resource.size <= begin) { break; }
+				offset = std::max(offset, end);
+			}
+			resource.offset = alignUp(offset, resourceAlignment);
+			memorySize = std::max(memorySize, resource.offset + resource.size);
+
+			// Resources sharing memory with this one, before or after it.
+			for (const ResourceID other : placed) {
+				Resource& otherResource = mResources[other];
+				if (overlaps(otherResource) || otherResource.offset >= resource.offset + resource.size || resource.offset >= otherResource.offset + otherResource.size) { continue; }
+				if (otherResource.lastPass < resource.firstPass) { resource.aliased.push_back(other); }
+				else { otherResource.aliased.push_back(id); }
+			}
+			placed.push_back(id);
+		}
+
+		if (!mMemory || memorySize > mMemorySize || alignment > mMemoryAlignment || !(memoryTypeBits & (1u << mMemoryInfo.memoryType))) {
+			freeMemory();
+			const VkMemoryRequirements requirements{ .size = memorySize, .alignment = alignment, .memoryTypeBits = memoryTypeBits };
+			const VmaAllocationCreateInfo allocInfo{ .preferredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT };
+			VK_CHECK(vmaAllocateMemory(mAllocator, &requirements, &allocInfo, &mMemory, &mMemoryInfo));
+			vmaSetAllocationName(mAllocator, mMemory, memoryCategoryName(MemoryCategory::Scratch));
+			if (mTracker) { mTracker->add(MemoryCategory::Scratch, mMemoryInfo.size); }
+			mMemorySize = memorySize;
+			mMemoryAlignment = alignment;
+		}
+
+		for (const ResourceID id : order) {
+			const Resource& resource = mResources[id];
+			if (resource.buffer) { VK_CHECK(vmaBindBufferMemory2(mAllocator, mMemory, resource.offset, resource.buffer, nullptr)); }
+			else { VK_CHECK(vmaBindImageMemory2(mAllocator, mMemory, resource.offset, resource.image, nullptr)); }
+		}
+	}
+
+	void freeMemory()
+	{
+		if (!mMemory) { return; }
+		if (mTracker) { mTracker->remove(MemoryCategory::Scratch, mMemoryInfo.size); }
+		vmaFreeMemory(mAllocator, mMemory);
+		mMemory = VK_NULL_HANDLE;
+		mMemorySize = 0;
+		mMemoryAlignment = 0;
+	}
+
+	void recordBarriers(VkCommandBuffer cmd, uint32_t passIndex)
+	{
+		VkMemoryBarrier2 memoryBarrier{ .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+		std::vector<VkImageMemoryBarrier2> imageBarriers;
+		for (const auto& access : mPasses[passIndex].accesses)
+		{
+			Resource& resource = mResources[access.resource];
+			if (resource.bTransient && passIndex == resource.firstPass) {
+				// Wait for the earlier users of the memory: in this graph, and in the previous one.
+				resource.state = { .writeStages = mTransientStages, .writeAccesses = mTransientWrites };
+				for (const ResourceID id : resource.aliased) {
+					const ResourceState& aliasedState = mResources[id].state;
+					resource.state.writeStages |= aliasedState.writeStages | aliasedState.readStages;
+					resource.state.writeAccesses |= aliasedState.writeAccesses;
+				}
+			}
+			ResourceState& state = resource.pImported ? *resource.pImported : resource.state;
+
+			const VkAccessFlags2 writes = access.accesses & kWriteAccesses;
+			const bool bLayoutChange = resource.image && access.layout != state.layout;
+			VkPipelineStageFlags2 srcStages = VK_PIPELINE_STAGE_2_NONE;
+			VkAccessFlags2 srcAccesses = VK_ACCESS_2_NONE;
+			if (bLayoutChange || writes) {
+				srcStages = state.writeStages | state.readStages;
+				srcAccesses = state.writeAccesses;
+			}
+			else if ((access.stages & ~state.readStages) || (access.accesses & ~state.readAccesses)) {
+				srcStages = state.writeStages;
+				srcAccesses = state.writeAccesses;
+			}
+
+			if (bLayoutChange) {
+				imageBarriers.push_back({
+					.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+					.srcStageMask = srcStages,
+					.srcAccessMask = srcAccesses,
+					.dstStageMask = access.stages,
+					.dstAccessMask = access.accesses,
+					.oldLayout = state.layout,
+					.newLayout = access.layout,
+					.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+					.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+					.image = resource.image,
+					.subresourceRange = resource.range });
+			}
+			else if (srcStages != VK_PIPELINE_STAGE_2_NONE) {
+				memoryBarrier.srcStageMask |= srcStages;
+				memoryBarrier.srcAccessMask |= srcAccesses;
+				memoryBarrier.dstStageMask |= access.stages;
+				memoryBarrier.dstAccessMask |= access.accesses;
+			}
+
+			if (bLayoutChange || writes) {
+				state = {
+					.writeStages = access.stages,
+					.writeAccesses = writes,
+					.readStages = writes ? VK_PIPELINE_STAGE_2_NONE : access.stages,
+					.readAccesses = writes ? VK_ACCESS_2_NONE : access.accesses,
+					.layout = resource.image ? access.layout : state.layout };
+			}
+			else {
+				state.readStages |= access.stages;
+				state.readAccesses |= access.accesses;
+			}
+		}
+
+		const bool bMemoryBarrier = memoryBarrier.srcStageMask != VK_PIPELINE_STAGE_2_NONE;
+		if (!bMemoryBarrier && imageBarriers.empty()) { return; }
+		const VkDependencyInfo dependency{
+			.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+			.memoryBarrierCount = bMemoryBarrier ? 1u : 0u,
+			.pMemoryBarriers = &memoryBarrier,
+			.imageMemoryBarrierCount = static_cast<uint32_t>(imageBarriers.size()),
+			.pImageMemoryBarriers = imageBarriers.data()
+		};
+		vkCmdPipelineBarrier2(cmd, &dependency);
+	}
+
+	VkDevice				mDevice = VK_NULL_HANDLE;
+	VmaAllocator			mAllocator = VK_NULL_HANDLE;
+	VkDeviceSize			mMinAlignment = 1;
+	MemoryTracker*			mTracker = nullptr;
+
+	std::vector<Resource>	mResources;
+	std::vector<Pass>		mPasses;
+
+	// Transient memory, and the accesses to it by the previous graph.
+	VmaAllocation			mMemory = VK_NULL_HANDLE;
+	VmaAllocationInfo		mMemoryInfo{};
+	VkDeviceSize			mMemorySize = 0;
+	VkDeviceSize			mMemoryAlignment = 0;
+	VkPipelineStageFlags2	mTransientStages = VK_PIPELINE_STAGE_2_NONE;
+	VkAccessFlags2			mTransientWrites = VK_ACCESS_2_NONE;
+};
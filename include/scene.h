@@ -1,9 +1,13 @@
 #pragma once
 
 #include <host_device_common.h>
+#include <mesh.h>
+#include <thread_pool.h>
 #include <vk_helpers.h>
 
 #include <cstdlib>
+#include <limits>
+#include <unordered_map>
 
 inline float random_double() {
     // Returns a random real in [0,1).
@@ -21,31 +25,128 @@ struct Sphere
     uint	materialID;
 };
 
+// A scene texture on the GPU, with a full mip chain (see VulkanApp::uploadScene).
 struct Texture
 {
-    VkImage     mImage;
+    Image       mImage;
     VkImageView mImageView;
     VkExtent3D  mExtents;       // Width, height, depth
     VkFormat    mFormat;        // e.g. R32G32B32A32.
+    uint32_t    mMipLevels;
 };
 
+// MeshInstance::materialID that selects the mesh's own per-triangle (OBJ usemtl / MTL) materials.
+constexpr uint32_t kMeshMaterials = std::numeric_limits<uint32_t>::max();
+
+// A placement of a mesh asset in the scene. Instances of the same mesh share its GPU buffers and BLAS.
+struct MeshInstance
+{
+    uint32_t    meshID;                         // Index into Scene::mMeshes.
+    uint32_t    materialID;                     // Overrides every triangle of the mesh, unless kMeshMaterials.
+    glm::mat4   transform = glm::mat4(1.f);
+};
+
+// Normalized form of an asset path, so different spellings of the same file map to one mesh or texture asset.
+inline std::string meshRegistryKey(const fs::path& path)
+{
+    std::error_code ec;
+    const auto normalized = fs::weakly_canonical(path, ec);
+    return (ec ? path : normalized).generic_string();
+}
+
 struct Scene
 {
     std::string                         mName;
     Camera				                mCamera;
 
 	std::vector<Sphere>                 mSpheres;
-    std::vector<ObjMesh>                mMeshes;
+    std::vector<ObjMesh>                mMeshes;            // Unique mesh assets. Each is uploaded and built into a BLAS once.
+    std::vector<MeshInstance>           mMeshInstances;
+    std::unordered_map<std::string, uint32_t> mMeshRegistry;  // Normalized asset path -> index into mMeshes.
 
-    //std::vector<Texture>                mTextures;
+    std::vector<fs::path>               mTextures;          // Albedo textures: Material::albedoTexture i > 0 is mTextures[i - 1].
+    std::unordered_map<std::string, uint32_t> mTextureRegistry; // Normalized path -> Material::albedoTexture.
 
     std::vector<Material>               mMaterials;
     AllocatedBuffer                     mMaterialsBuffer;
 
     //Integrator                        mIntegrator;
 
+    // Registers a mesh asset and returns its ID. Repeated paths return the ID of the existing asset.
+    // The mesh is only loaded from mPath later, when the scene is streamed to the GPU (see VulkanApp::uploadScene).
+    uint32_t addMesh(const fs::path& path) { return addMesh(path, meshRegistryKey(path)); }
+
+    // As above, with a registry key already computed by meshRegistryKey (e.g. on another thread).
+    uint32_t addMesh(const fs::path& path, const std::string& key)
+    {
+        const auto [it, inserted] = mMeshRegistry.try_emplace(key, static_cast<uint32_t>(mMeshes.size()));
+        if (inserted) {
+            mMeshes.emplace_back().mPath = path;
+        }
+        return it->second;
+    }
+
+    // Registers an albedo texture and returns its Material::albedoTexture index. Repeated paths return the same index.
+    // The image is only loaded later, when the scene is streamed to the GPU.
+    uint32_t addTexture(const fs::path& path)
+    {
+        const auto [it, inserted] = mTextureRegistry.try_emplace(meshRegistryKey(path), static_cast<uint32_t>(mTextures.size() + 1));
+        if (inserted) { mTextures.push_back(path); }
+        return it->second;
+    }
+
+    void addMeshInstance(uint32_t meshID, uint32_t materialID, const glm::mat4& transform = glm::mat4(1.f))
+    {
+        mMeshInstances.push_back(MeshInstance{ .meshID = meshID, .materialID = materialID, .transform = transform });
+    }
 };
 
+// Merges mesh assets with identical source content (e.g. the same file under two names) and material libraries,
+// remapping their instances.
+inline void deduplicateMeshes(Scene& scene)
+{
+    std::unordered_map<uint64_t, uint32_t> firstByHash;
+    std::vector<uint32_t> remap(scene.mMeshes.size());
+    std::vector<ObjMesh> unique;
+    for (uint32_t i = 0; i < scene.mMeshes.size(); ++i) {
+        const auto [it, inserted] = firstByHash.try_emplace(scene.mMeshes[i].assetKey(), static_cast<uint32_t>(unique.size()));
+        if (inserted) { unique.push_back(std::move(scene.mMeshes[i])); }
+        remap[i] = it->second;
+    }
+    if (unique.size() == scene.mMeshes.size()) {
+        scene.mMeshes = std::move(unique);
+        return;
+    }
+
+    scene.mMeshes = std::move(unique);
+    for (auto& instance : scene.mMeshInstances) { instance.meshID = remap[instance.meshID]; }
+    for (auto& [path, id] : scene.mMeshRegistry) { id = remap[id]; }
+}
+
+// Appends the materials of meshes that have kMeshMaterials instances to the scene, and sets their mMaterialBase.
+// Their albedo textures are registered with the scene. Call once the meshes are loaded (and their material libraries parsed).
+inline void resolveMeshMaterials(Scene& scene)
+{
+    std::vector<bool> bUsesMeshMaterials(scene.mMeshes.size(), false);
+    for (const auto& instance : scene.mMeshInstances) {
+        if (instance.materialID == kMeshMaterials) { bUsesMeshMaterials[instance.meshID] = true; }
+    }
+
+    for (uint32_t i = 0; i < scene.mMeshes.size(); ++i) {
+        if (!bUsesMeshMaterials[i]) { continue; }
+        ObjMesh& mesh = scene.mMeshes[i];
+        mesh.mMaterialBase = static_cast<uint32_t>(scene.mMaterials.size());
+        if (mesh.mMaterials.empty()) {
+            scene.mMaterials.push_back(Material{ .type = DIFFUSE, .albedo = glm::vec3(0.8f), .phongExponent = 0, .emitted = glm::vec3(0.f) });
+        }
+        for (size_t m = 0; m < mesh.mMaterials.size(); ++m) {
+            Material& material = scene.mMaterials.emplace_back(mesh.mMaterials[m]);
+            if (m < mesh.mMaterialTextures.size() && !mesh.mMaterialTextures[m].empty()) {
+                material.albedoTexture = scene.addTexture(mesh.mMaterialTextures[m]);
+            }
+        }
+    }
+}
 
 inline Scene createShirleyBook1Scene()
 {
@@ -63,13 +164,11 @@ inline Scene createShirleyBook1Scene()
 
     scene.mMaterials.emplace_back(Material{ .type = DIFFUSE, .albedo = glm::vec3(0.5f), .emitted = glm::vec3(0.f) });
 
-    scene.mMeshes.resize(1);
-    scene.mMeshes[0].loadFromFile("assets/xy_quad.obj");
+    const uint32_t quad = scene.addMesh("assets/xy_quad.obj");
     auto transform = glm::translate(glm::mat4(1.f), { 0.f,0,0.f });
     transform = glm::rotate(transform, glm::radians(-90.f), glm::vec3(1.f, 0.f, 0.f));
     transform = glm::scale(transform, glm::vec3(1000));
-    scene.mMeshes[0].mTransform = transform;
-    scene.mMeshes[0].mMaterialID = scene.mMaterials.size()-1;
+    scene.addMeshInstance(quad, scene.mMaterials.size()-1, transform);
 
 
     for (int a = -11; a < 11; a++) {
@@ -120,11 +219,8 @@ inline Scene createSponzaBuddhaScene()
         .focalDistance = 1.f
     };
 
-    scene.mMaterials.emplace_back(Material{ .type = DIFFUSE,  .albedo = glm::vec3(0.5f), .emitted = glm::vec3(0.f) });
-
-    scene.mMeshes.resize(1);
-    scene.mMeshes[0].loadFromFile("assets/sponza.obj");
-    scene.mMeshes[0].mMaterialID = 0;
+    const uint32_t sponza = scene.addMesh("assets/sponza.obj");
+    scene.addMeshInstance(sponza, kMeshMaterials);
 
     return scene;
 }
@@ -144,17 +240,14 @@ inline Scene createAjaxScene()
 
     scene.mMaterials.emplace_back(Material{ .type = DIFFUSE,  .albedo = glm::vec3(0.2f), .emitted = glm::vec3(0.f) });
 
-
-    scene.mMeshes.resize(2);
-    scene.mMeshes[0].loadFromFile("assets/xy_quad.obj");
+    const uint32_t quad = scene.addMesh("assets/xy_quad.obj");
     auto transform = glm::translate(glm::mat4(1.f), { 0.f,0,0.f });
     transform = glm::rotate(transform, glm::radians(-90.f), glm::vec3(1.f, 0.f, 0.f));
     transform = glm::scale(transform, glm::vec3(1000));
-    scene.mMeshes[0].mTransform = transform;
-    scene.mMeshes[0].mMaterialID = 0;
+    scene.addMeshInstance(quad, 0, transform);
 
-    scene.mMeshes[1].loadFromFile("assets/ajax.obj");
-    scene.mMeshes[1].mMaterialID = 0;
+    const uint32_t ajax = scene.addMesh("assets/ajax.obj");
+    scene.addMeshInstance(ajax, 0);
 
     return scene;
 }
@@ -182,55 +275,40 @@ inline Scene createSphereCornellBoxScene()
     scene.mMaterials.emplace_back(Material{ .type = DIFFUSE, .albedo = glm::vec3(0.75, 0.25, 0.25), .emitted = glm::vec3(0.f) }); // red sphere
     scene.mMaterials.emplace_back(Material{ .type = DIFFUSE, .albedo = glm::vec3(0.25, 0.75, 0.25), .emitted = glm::vec3(0.f) }); // green sphere
 
-
-
-    scene.mMeshes.resize(6);
-
-    scene.mMeshes[0].loadFromFile("assets/xy_quad.obj");
+    const uint32_t quad = scene.addMesh("assets/xy_quad.obj");
     auto transform  = glm::translate(glm::mat4(1.f), glm::vec3(0, 0, -277.5));
     transform       = glm::scale(transform, glm::vec3(555));
-    scene.mMeshes[0].mTransform = transform;
-    scene.mMeshes[0].mMaterialID = 0;
+    scene.addMeshInstance(quad, 0, transform);
 
 
-    scene.mMeshes[1].loadFromFile("assets/xy_quad.obj");
     transform   = glm::translate(glm::mat4(1.f),  glm::vec3(0, 277.5, 0));
     transform   = glm::rotate(transform, glm::radians(90.f), glm::vec3(1.f, 0.f, 0.f));
     transform   = glm::scale(transform, glm::vec3(555));
-    scene.mMeshes[1].mTransform = transform;
-    scene.mMeshes[1].mMaterialID = 0;
+    scene.addMeshInstance(quad, 0, transform);
 
 
-    scene.mMeshes[2].loadFromFile("assets/xy_quad.obj");
     transform = glm::translate(glm::mat4(1.f), glm::vec3(0, -277.5, 0));
     transform = glm::rotate(transform, glm::radians(-90.f), glm::vec3(1.f, 0.f, 0.f));
     transform = glm::scale(transform, glm::vec3(555));
-    scene.mMeshes[2].mTransform = transform;
-    scene.mMeshes[2].mMaterialID = 0;
+    scene.addMeshInstance(quad, 0, transform);
 
 
-    scene.mMeshes[3].loadFromFile("assets/xy_quad.obj");
     transform = glm::translate(glm::mat4(1.f), glm::vec3(-277.5, 0, 0));
     transform = glm::rotate(transform, glm::radians(90.f), glm::vec3(0.f, 1.f, 0.f));
     transform = glm::scale(transform, glm::vec3(555));
-    scene.mMeshes[3].mTransform = transform;
-    scene.mMeshes[3].mMaterialID = 2;
+    scene.addMeshInstance(quad, 2, transform);
 
-    scene.mMeshes[4].loadFromFile("assets/xy_quad.obj");
     transform = glm::translate(glm::mat4(1.f), glm::vec3(277.5, 0, 0));
     transform = glm::rotate(transform, glm::radians(-90.f), glm::vec3(0.f, 1.f, 0.f));
     transform = glm::scale(transform, glm::vec3(555));
-    scene.mMeshes[4].mTransform = transform;
-    scene.mMeshes[4].mMaterialID = 1;
+    scene.addMeshInstance(quad, 1, transform);
 
 
     // Light Source
-    scene.mMeshes[5].loadFromFile("assets/xy_quad.obj");
     transform = glm::translate(glm::mat4(1.f), glm::vec3(0, 277, 0));
     transform = glm::rotate(transform, glm::radians(90.f), glm::vec3(1.f, 0.f, 0.f));
     transform = glm::scale(transform, glm::vec3(130));
-    scene.mMeshes[5].mTransform = transform;
-    scene.mMeshes[5].mMaterialID = 3;
+    scene.addMeshInstance(quad, 3, transform);
 
     
 
@@ -259,72 +337,56 @@ inline Scene createBuddhaCornellBox()
     scene.mMaterials.emplace_back(Material{ .type = LIGHT, .albedo = glm::vec3(1.f), .emitted = glm::vec3(15) }); // light
     scene.mMaterials.emplace_back(Material{ .type = DIELECTRIC, .albedo = glm::vec3(1.f), .emitted = glm::vec3(0) }); // light
 
-    scene.mMeshes.resize(8);
-
-    scene.mMeshes[0].loadFromFile("assets/xy_quad.obj");
+    const uint32_t quad = scene.addMesh("assets/xy_quad.obj");
     auto transform = glm::translate(glm::mat4(1.f), glm::vec3(0, 0, -277.5));
     transform = glm::scale(transform, glm::vec3(555));
-    scene.mMeshes[0].mTransform = transform;
-    scene.mMeshes[0].mMaterialID = 0;
+    scene.addMeshInstance(quad, 0, transform);
 
 
-    scene.mMeshes[1].loadFromFile("assets/xy_quad.obj");
     transform = glm::translate(glm::mat4(1.f), glm::vec3(0, 277.5, 0));
     transform = glm::rotate(transform, glm::radians(90.f), glm::vec3(1.f, 0.f, 0.f));
     transform = glm::scale(transform, glm::vec3(555));
-    scene.mMeshes[1].mTransform = transform;
-    scene.mMeshes[1].mMaterialID = 0;
+    scene.addMeshInstance(quad, 0, transform);
 
 
-    scene.mMeshes[2].loadFromFile("assets/xy_quad.obj");
     transform = glm::translate(glm::mat4(1.f), glm::vec3(0, -277.5, 0));
     transform = glm::rotate(transform, glm::radians(-90.f), glm::vec3(1.f, 0.f, 0.f));
     transform = glm::scale(transform, glm::vec3(555));
-    scene.mMeshes[2].mTransform = transform;
-    scene.mMeshes[2].mMaterialID = 0;
+    scene.addMeshInstance(quad, 0, transform);
 
 
-    scene.mMeshes[3].loadFromFile("assets/xy_quad.obj");
     transform = glm::translate(glm::mat4(1.f), glm::vec3(-277.5, 0, 0));
     transform = glm::rotate(transform, glm::radians(90.f), glm::vec3(0.f, 1.f, 0.f));
     transform = glm::scale(transform, glm::vec3(555));
-    scene.mMeshes[3].mTransform = transform;
-    scene.mMeshes[3].mMaterialID = 2;
+    scene.addMeshInstance(quad, 2, transform);
 
-    scene.mMeshes[4].loadFromFile("assets/xy_quad.obj");
     transform = glm::translate(glm::mat4(1.f), glm::vec3(277.5, 0, 0));
     transform = glm::rotate(transform, glm::radians(-90.f), glm::vec3(0.f, 1.f, 0.f));
     transform = glm::scale(transform, glm::vec3(555));
-    scene.mMeshes[4].mTransform = transform;
-    scene.mMeshes[4].mMaterialID = 1;
+    scene.addMeshInstance(quad, 1, transform);
 
 
     // Light Source
-    scene.mMeshes[5].loadFromFile("assets/xy_quad.obj");
     transform = glm::translate(glm::mat4(1.f), glm::vec3(0, 277, 0));
     transform = glm::rotate(transform, glm::radians(90.f), glm::vec3(1.f, 0.f, 0.f));
     transform = glm::scale(transform, glm::vec3(130));
-    scene.mMeshes[5].mTransform = transform;
-    scene.mMeshes[5].mMaterialID = 3;
+    scene.addMeshInstance(quad, 3, transform);
 
 
     // Diffuse Buddha
-    scene.mMeshes[6].loadFromFile("assets/buddha.obj");
+    const uint32_t buddha = scene.addMesh("assets/buddha.obj");
     transform = glm::translate(glm::mat4(1.f), glm::vec3(-140, -277.5, -100));
     transform = glm::rotate(transform, glm::radians(90.f), glm::vec3(0.f, 1.f, 0.f));
     transform = glm::scale(transform, glm::vec3(500));
     transform = glm::translate(transform, glm::vec3(-1.02949, 0.006185, -0.03784));
-    scene.mMeshes[6].mTransform = transform;
-    scene.mMeshes[6].mMaterialID = 0;
+    scene.addMeshInstance(buddha, 0, transform);
 
     // Dielectric Buddha
-    scene.mMeshes[7].loadFromFile("assets/buddha.obj");
     transform = glm::translate(glm::mat4(1.f), glm::vec3(140, -277.5, 100));
     transform = glm::rotate(transform, glm::radians(90.f), glm::vec3(0.f, 1.f, 0.f));
     transform = glm::scale(transform, glm::vec3(500));
     transform = glm::translate(transform, glm::vec3(-1.02949, 0.006185, -0.03784));
-    scene.mMeshes[7].mTransform = transform;
-    scene.mMeshes[7].mMaterialID = 4;
+    scene.addMeshInstance(buddha, 4, transform);
 
     return scene;
 }
@@ -362,23 +424,20 @@ inline Scene createVeachMatsScene()
     scene.mMaterials.emplace_back(Material{ .type = PHONG, .albedo = glm::vec3(0.2), .phongExponent = 100 });
     scene.mMaterials.emplace_back(Material{ .type = DIFFUSE, .albedo = glm::vec3(0.2) });
 
+    const uint32_t plate1 = scene.addMesh("assets/veach/plate1.obj");
+    scene.addMeshInstance(plate1, 4);
 
-    scene.mMeshes.resize(5);
-    scene.mMeshes[0].loadFromFile("assets/veach/plate1.obj");
-    scene.mMeshes[0].mMaterialID = 4;
-
-    scene.mMeshes[1].loadFromFile("assets/veach/plate2.obj");
-    scene.mMeshes[1].mMaterialID = 5;
-
-    scene.mMeshes[2].loadFromFile("assets/veach/plate3.obj");
-    scene.mMeshes[2].mMaterialID = 6;
+    const uint32_t plate2 = scene.addMesh("assets/veach/plate2.obj");
+    scene.addMeshInstance(plate2, 5);
 
-    scene.mMeshes[3].loadFromFile("assets/veach/plate4.obj");
-    scene.mMeshes[3].mMaterialID = 7;
+    const uint32_t plate3 = scene.addMesh("assets/veach/plate3.obj");
+    scene.addMeshInstance(plate3, 6);
 
+    const uint32_t plate4 = scene.addMesh("assets/veach/plate4.obj");
+    scene.addMeshInstance(plate4, 7);
 
-    scene.mMeshes[4].loadFromFile("assets/veach/floor.obj");
-    scene.mMeshes[4].mMaterialID = 8;
+    const uint32_t floor = scene.addMesh("assets/veach/floor.obj");
+    scene.addMeshInstance(floor, 8);
 
     return scene;
 }
@@ -398,13 +457,11 @@ inline Scene createMaterialTestScene()
 
     // Floor
 
-    scene.mMeshes.resize(1);
-    scene.mMeshes[0].loadFromFile("assets/xy_quad.obj");
+    const uint32_t quad = scene.addMesh("assets/xy_quad.obj");
     auto transform = glm::translate(glm::mat4(1.f), { 0.f,-50000,0.f });
     transform = glm::rotate(transform, glm::radians(-90.f), glm::vec3(1.f, 0.f, 0.f));
     transform = glm::scale(transform, glm::vec3(1));
-    scene.mMeshes[0].mTransform = transform;
-    scene.mMeshes[0].mMaterialID = 0;
+    scene.addMeshInstance(quad, 0, transform);
 
     scene.mMaterials.emplace_back(Material{ .type = DIFFUSE, .albedo = glm::vec3(0.5f), .emitted = glm::vec3(0.f) });
     scene.mMaterials.emplace_back(Material{ .type = DIFFUSE, .albedo = glm::vec3(0.8,0.8,0) });
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <gltf.h>
+#include <scene.h>
+#include <thread_pool.h>
+
+#include <charconv>
+#include <unordered_map>
+
+
+// Text scene description format (*.scene), one statement per line. '#' starts a comment, and tokens containing
+// spaces may be double-quoted. Relative asset paths are resolved against the directory of the scene file.
+//
+//		name		<scene name>
+//		camera		center x y z  eye x y z  [background r g b]  [fov degrees]  [focus distance]
+//		material	<name> diffuse|mirror|dielectric|phong|light  [albedo r g b]  [texture path]  [exponent n]  [emitted r g b]
+//		mesh		<name> <path.obj>
+//		instance	<mesh> <material|mtl>  [translate x y z]  [rotate degrees ax ay az]  [scale s | scale x y z] ...
+//		sphere		<material> x y z <radius>
+//		gltf		<path.gltf|path.glb>  [translate x y z]  [rotate degrees ax ay az]  [scale s | scale x y z] ...
+//
+// Instance and gltf transforms are composed in the order written, like successive glm::translate/rotate/scale calls.
+// Materials and meshes must be declared before they are referenced. The material name "mtl" gives an instance the
+// mesh's own per-triangle materials, from the usemtl groups and .mtl libraries of its OBJ file. A material's texture
+// (an image file, as for map_Kd in .mtl libraries) multiplies its albedo.
+namespace scene_file
+{
+	namespace detail
+	{
+		// Splits a line into whitespace-separated tokens, honouring double quotes and stopping at comments.
+		inline std::vector<std::string_view> tokenize(std::string_view line)
+		{
+			std::vector<std::string_view> tokens;
+			size_t i = 0;
+			while (i < line.size()) {
+				while (i < line.size() && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r')) { ++i; }
+				if (i == line.size() || line[i] == '#') { break; }
+
+				if (line[i] == '"') {
+					const size_t close = line.find('"', i + 1);
+					const size_t end = (close == std::string_view::npos) ? line.size() : close;
+					tokens.push_back(line.substr(i + 1, end - i - 1));
+					i = end + 1;
+				}
+				else {
+					const size_t start = i;
+					while (i < line.size() && line[i] != ' ' && line[i] != '\t' && line[i] != '\r') { ++i; }
+					tokens.push_back(line.substr(start, i - start));
+				}
+			}
+			return tokens;
+		}
+
+		inline bool parseFloat(std::string_view token, float& value)
+		{
+			if (!token.empty() && token.front() == '+') { token.remove_prefix(1); }
+			const auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+			return ec == std::errc() && ptr == token.data() + token.size();
+		}
+
+		// Reads the tokens of a statement in order, recording the first error.
+		struct Cursor
+		{
+			const std::vector<std::string_view>&	tokens;
+			size_t									next = 1;	// Token 0 is the statement keyword.
+			std::string								error;
+
+			bool done() const { return next >= tokens.size(); }
+			bool fail(std::string message) { if (error.empty()) { error = std::move(message); } return false; }
+
+			bool word(std::string_view& out)
+			{
+				if (done()) { return fail("unexpected end of line"); }
+				out = tokens[next++];
+				return true;
+			}
+
+			bool number(float& out)
+			{
+				if (done()) { return fail("expected a number"); }
+				if (!parseFloat(tokens[next], out)) { return fail(fmt::format("expected a number, got '{}'", tokens[next])); }
+				++next;
+				return true;
+			}
+
+			bool vector(glm::vec3& out) { return number(out.x) && number(out.y) && number(out.z); }
+
+			// Number of consecutive numeric tokens from the cursor, up to max.
+			size_t numbersAhead(size_t max) const
+			{
+				float unused;
+				size_t count = 0;
+				while (count < max && next + count < tokens.size() && parseFloat(tokens[next + count], unused)) { ++count; }
+				return count;
+			}
+		};
+
+		// Applies the remaining [translate|rotate|scale] operations of a statement to transform, in order.
+		inline void parseTransform(Cursor& cursor, glm::mat4& transform)
+		{
+			while (!cursor.done() && cursor.error.empty()) {
+				std::string_view op;
+				cursor.word(op);
+				if (op == "translate") {
+					glm::vec3 t;
+					if (cursor.vector(t)) { transform = glm::translate(transform, t); }
+				}
+				else if (op == "rotate") {
+					float degrees;
+					glm::vec3 axis;
+					if (cursor.number(degrees) && cursor.vector(axis)) { transform = glm::rotate(transform, glm::radians(degrees), axis); }
+				}
+				else if (op == "scale") {
+					glm::vec3 s;
+					if (cursor.numbersAhead(3) == 3)	{ cursor.vector(s); }
+					else if (cursor.number(s.x))		{ s = glm::vec3(s.x); }
+					transform = glm::scale(transform, s);
+				}
+				else { cursor.fail(fmt::format("unknown transform '{}'", op)); }
+			}
+		}
+
+		inline bool parseMaterialType(std::string_view name, uint32_t& type)
+		{
+			static const std::unordered_map<std::string_view, uint32_t> kTypes = {
+				{ "diffuse", DIFFUSE }, { "mirror", MIRROR }, { "dielectric", DIELECTRIC }, { "phong", PHONG }, { "light", LIGHT }
+			};
+			const auto it = kTypes.find(name);
+			if (it == kTypes.end()) { return false; }
+			type = it->second;
+			return true;
+		}
+
+		struct MeshDeclaration
+		{
+			std::string		name;
+			fs::path		path;
+			std::string		registryKey;	// Filled in by the resolve pass.
+			bool			bFound = false;
+			size_t			line;
+		};
+
+		struct InstanceDeclaration
+		{
+			std::string		mesh;
+			uint32_t		materialID;
+			glm::mat4		transform;
+			size_t			line;
+		};
+
+		struct GltfDeclaration
+		{
+			fs::path		path;
+			glm::mat4		transform;
+			size_t			line;
+		};
+	}
+
+	// Parses a scene file into scene. Referenced mesh files are resolved concurrently and registered once per unique
+	// file; they are loaded later by VulkanApp::uploadScene. Returns false, after printing every error found, on failure.
+	inline bool loadSceneFile(const fs::path& path, Scene& scene)
+	{
+		using namespace detail;
+
+		const MappedFile file(path);
+		if (!file) {
+			fmt::println("Error: could not open scene file {}", path.string());
+			return false;
+		}
+		const std::string_view text(reinterpret_cast<const char*>(file.data()), file.size());
+		const fs::path baseDirectory = path.parent_path();
+
+		scene = Scene{};
+		scene.mName = path.stem().string();
+
+		std::unordered_map<std::string, uint32_t> materialIDs;
+		std::vector<MeshDeclaration> meshes;
+		std::unordered_map<std::string, size_t> meshIDs;
+		std::vector<InstanceDeclaration> instances;
+		std::vector<GltfDeclaration> gltfFiles;
+		bool bHasCamera = false;
+		bool bValid = true;
+
+		const auto report = [&](size_t line, std::string_view message) {
+			fmt::println("Error: {}:{}: {}", path.string(), line, message);
+			bValid = false;
+		};
+
+		size_t lineNumber = 0;
+		for (size_t begin = 0; begin < text.size();) {
+			const size_t eol = std::min(text.find('\n', begin), text.size());
+			const auto tokens = tokenize(text.substr(begin, eol - begin));
+			begin = eol + 1;
+			++lineNumber;
+			if (tokens.empty()) { continue; }
+
+			Cursor cursor{ tokens };
+			const std::string_view keyword = tokens[0];
+
+			if (keyword == "name") {
+				std::string_view name;
+				if (cursor.word(name)) { scene.mName = name; }
+			}
+			else if (keyword == "camera") {
+				Camera camera{ .center = glm::vec3(0.f), .eye = glm::vec3(0.f, 0.f, -1.f), .backgroundColor = glm::vec3(0.f), .fovY = 40.f, .focalDistance = 1.f };
+				while (!cursor.done() && cursor.error.empty()) {
+					std::string_view field;
+					cursor.word(field);
+					if		(field == "center")		{ cursor.vector(camera.center); }
+					else if (field == "eye")		{ cursor.vector(camera.eye); }
+					else if (field == "background")	{ cursor.vector(camera.backgroundColor); }
+					else if (field == "fov")		{ cursor.number(camera.fovY); }
+					else if (field == "focus")		{ cursor.number(camera.focalDistance); }
+					else							{ cursor.fail(fmt::format("unknown camera field '{}'", field)); }
+				}
+				scene.mCamera = camera;
+				bHasCamera = true;
+			}
+			else if (keyword == "material") {
+				std::string_view name, typeName;
+				Material material{ .type = DIFFUSE, .albedo = glm::vec3(1.f), .phongExponent = 0, .emitted = glm::vec3(0.f) };
+				if (cursor.word(name) && cursor.word(typeName) && !parseMaterialType(typeName, material.type)) {
+					cursor.fail(fmt::format("unknown material type '{}'", typeName));
+				}
+				while (!cursor.done() && cursor.error.empty()) {
+					std::string_view field;
+					cursor.word(field);
+					if		(field == "albedo")		{ cursor.vector(material.albedo); }
+					else if (field == "texture")	{ std::string_view texturePath; if (cursor.word(texturePath)) { material.albedoTexture = scene.addTexture((baseDirectory / fs::path(texturePath)).lexically_normal()); } }
+					else if (field == "emitted")	{ cursor.vector(material.emitted); }
+					else if (field == "exponent")	{ float e = 0.f; cursor.number(e); material.phongExponent = static_cast<int>(e); }
+					else							{ cursor.fail(fmt::format("unknown material field '{}'", field)); }
+				}
+				if (cursor.error.empty() && name == "mtl") {
+					cursor.fail("'mtl' is reserved for mesh materials");
+				}
+				if (cursor.error.empty() && !materialIDs.try_emplace(std::string(name), static_cast<uint32_t>(scene.mMaterials.size())).second) {
+					cursor.fail(fmt::format("material '{}' is already defined", name));
+				}
+				if (cursor.error.empty()) { scene.mMaterials.push_back(material); }
+			}
+			else if (keyword == "mesh") {
+				std::string_view name, meshPath;
+				if (cursor.word(name) && cursor.word(meshPath)) {
+					if (!meshIDs.try_emplace(std::string(name), meshes.size()).second) {
+						cursor.fail(fmt::format("mesh '{}' is already defined", name));
+					}
+					else {
+						meshes.push_back({ .name = std::string(name), .path = (baseDirectory / fs::path(meshPath)).lexically_normal(), .line = lineNumber });
+					}
+				}
+			}
+			else if (keyword == "instance") {
+				std::string_view meshName, materialName;
+				InstanceDeclaration instance{ .transform = glm::mat4(1.f), .line = lineNumber };
+				if (cursor.word(meshName) && cursor.word(materialName)) {
+					const auto material = materialIDs.find(std::string(materialName));
+					if (!meshIDs.contains(std::string(meshName)))	{ cursor.fail(fmt::format("unknown mesh '{}'", meshName)); }
+					else if (materialName == "mtl")					{ instance.mesh = meshName; instance.materialID = kMeshMaterials; }
+					else if (material == materialIDs.end())			{ cursor.fail(fmt::format("unknown material '{}'", materialName)); }
+					else {
+						instance.mesh = meshName;
+						instance.materialID = material->second;
+					}
+				}
+				parseTransform(cursor, instance.transform);
+				if (cursor.error.empty()) { instances.push_back(std::move(instance)); }
+			}
+			else if (keyword == "gltf") {
+				std::string_view gltfPath;
+				GltfDeclaration gltf{ .transform = glm::mat4(1.f), .line = lineNumber };
+				if (cursor.word(gltfPath)) { gltf.path = (baseDirectory / fs::path(gltfPath)).lexically_normal(); }
+				parseTransform(cursor, gltf.transform);
+				if (cursor.error.empty()) { gltfFiles.push_back(std::move(gltf)); }
+			}
+			else if (keyword == "sphere") {
+				std::string_view materialName;
+				Sphere sphere;
+				if (cursor.word(materialName) && cursor.vector(sphere.center) && cursor.number(sphere.radius)) {
+					const auto material = materialIDs.find(std::string(materialName));
+					if (material == materialIDs.end()) { cursor.fail(fmt::format("unknown material '{}'", materialName)); }
+					else {
+						sphere.materialID = material->second;
+						scene.mSpheres.push_back(sphere);
+					}
+				}
+			}
+			else {
+				cursor.fail(fmt::format("unknown statement '{}'", keyword));
+			}
+
+			if (cursor.error.empty() && !cursor.done()) { cursor.fail(fmt::format("unexpected '{}'", tokens[cursor.next])); }
+			if (!cursor.error.empty()) { report(lineNumber, cursor.error); }
+		}
+
+		if (!bHasCamera) { report(lineNumber, "missing camera statement"); }
+		if (scene.mMaterials.empty() && std::none_of(instances.begin(), instances.end(), [](const auto& i) { return i.materialID == kMeshMaterials; })) {
+			report(lineNumber, "scene has no materials");
+		}
+
+		// Resolve the referenced mesh files concurrently (file system queries dominate for large scene sets).
+		// A mesh only needs its source or its binary cache to be present.
+		ThreadPool::global().parallelFor(meshes.size(), [&](size_t i) {
+			auto& mesh = meshes[i];
+			std::error_code ec;
+			mesh.bFound = fs::exists(mesh.path, ec) || fs::exists(meshCachePath(mesh.path), ec);
+			mesh.registryKey = meshRegistryKey(mesh.path);
+			});
+		for (const auto& mesh : meshes) {
+			if (!mesh.bFound) { report(mesh.line, fmt::format("mesh file {} not found", mesh.path.string())); }
+		}
+		if (!bValid) { return false; }
+
+		// Register unique mesh files up front; meshes declared under several names share one asset.
+		std::vector<uint32_t> meshAssetIDs(meshes.size());
+		for (size_t i = 0; i < meshes.size(); ++i) {
+			meshAssetIDs[i] = scene.addMesh(meshes[i].path, meshes[i].registryKey);
+		}
+		for (const auto& instance : instances) {
+			scene.addMeshInstance(meshAssetIDs[meshIDs[instance.mesh]], instance.materialID, instance.transform);
+		}
+
+		// glTF files bring their own materials and are loaded here, since their primitives are not separate files.
+		for (const auto& gltf : gltfFiles) {
+			if (!gltf::importFile(gltf.path, scene, gltf.transform)) { return false; }
+		}
+		return true;
+	}
+}
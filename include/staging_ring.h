@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vk_helpers.h>
+#include <vk_types.h>
+
+#include <algorithm>
+
+
+// A persistently mapped staging buffer used as a ring. Uploads are packed one after another, and their space is reclaimed
+// once the submission that reads it has completed: record head() when submitting, and release() it after the fence.
+// Positions are monotonic byte counts, the buffer offset of a position is position % size. The size must be a multiple
+// of the alignments requested.
+class StagingRing
+{
+public:
+	struct Allocation
+	{
+		VkBuffer		buffer;
+		VkDeviceSize	offset;
+		void*			data;		// Mapped pointer to offset.
+	};
+
+	void init(VmaAllocator allocator, VkDeviceSize size)
+	{
+		mBuffer = createHostVisibleStagingBuffer(allocator, size, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+		mData = static_cast<uint8_t*>(mBuffer.mAllocInfo.pMappedData);
+		mSize = size;
+		mHead = mTail = 0;
+	}
+
+	void destroy(VmaAllocator allocator) { vmaDestroyBuffer(allocator, mBuffer.mBuffer, mBuffer.mAllocation); }
+
+	VkDeviceSize size() const { return mSize; }
+
+	// Position just after the last allocation.
+	uint64_t head() const { return mHead; }
+
+	// Allocates size contiguous bytes. Returns false if the ring hasn't got that much free space until more is released.
+	bool allocate(VkDeviceSize size, VkDeviceSize alignment, Allocation& allocation)
+	{
+		if (mTail == mHead) { mHead = mTail = (mHead + mSize - 1) / mSize * mSize; }	// Empty: restart at the beginning of the buffer.
+
+		uint64_t begin = (mHead + alignment - 1) / alignment * alignment;
+		if (begin % mSize + size > mSize) { begin = (begin / mSize + 1) * mSize; }	// Don't straddle the end of the buffer.
+		if (begin + size - mTail > mSize) { return false; }
+
+		allocation = { mBuffer.mBuffer, begin % mSize, mData + begin % mSize };
+		mHead = begin + size;
+		return true;
+	}
+
+	// Frees everything allocated before position.
+	void release(uint64_t position) { mTail = std::max(mTail, position); }
+
+private:
+	AllocatedBuffer	mBuffer{};
+	uint8_t*		mData = nullptr;
+	VkDeviceSize	mSize = 0;
+	uint64_t		mHead = 0;
+	uint64_t		mTail = 0;
+};
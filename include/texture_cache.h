@@ -0,0 +1,177 @@
+#pragma once
+
+#include <mapped_file.h>
+#include <mesh_cache.h>
+#include <texture_compression.h>
+#include <vk_types.h>
+
+#include <stb_image.h>
+
+#include <atomic>
+#include <thread>
+
+
+// Block-compressed texture cache, written next to the source image on first load (e.g. assets/wood.png ->
+// assets/wood.png.vktex) and memory-mapped on later runs, which upload its blocks without decoding the image. File layout:
+//		TextureCacheHeader | level 0 | level 1 | ... | level mipLevels - 1
+// The levels are tightly packed, as vkCmdCopyBufferToImage reads them with a zero bufferRowLength.
+constexpr uint32_t kTextureCacheMagic	= 0x58455456;	// "VTEX"
+constexpr uint32_t kTextureCacheVersion	= 1;
+
+struct TextureCacheHeader
+{
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	sourceSize;			// Size in bytes of the source image.
+	int64_t		sourceWriteTime;	// Last write time of the source image. Used as a fast staleness check.
+	uint64_t	sourceHash;			// Content hash of the source image.
+	uint32_t	format;				// VkFormat of the levels.
+	uint32_t	width;
+	uint32_t	height;
+	uint32_t	mipLevels;
+	uint64_t	dataOffset;
+	uint64_t	dataSize;
+};
+
+// A texture's levels in host memory, tightly packed one after the other: the whole BC1 mip chain, or only the RGBA8
+// top level, whose chain is then generated on the GPU (see VulkanApp::generateMipmaps).
+struct TextureData
+{
+	VkFormat					format{ VK_FORMAT_UNDEFINED };
+	uint32_t					width{ 0 };
+	uint32_t					height{ 0 };
+	uint32_t					mipLevels{ 0 };
+	std::span<const std::byte>	bytes;		// Into cacheFile or pixels.
+	MappedFile					cacheFile;
+	std::vector<std::byte>		pixels;
+
+	explicit operator bool() const { return !bytes.empty(); }
+
+	// Block-compress textures and cache them. Off to compare against uncompressed textures, and on devices without
+	// textureCompressionBC, where it is cleared while the first loads may already be running.
+	inline static std::atomic<bool> bCompress = true;
+};
+
+
+inline fs::path textureCachePath(const fs::path& source)
+{
+	auto path = source;
+	path += ".vktex";
+	return path;
+}
+
+inline VkDeviceSize textureLevelSize(VkFormat format, uint32_t width, uint32_t height, uint32_t level)
+{
+	width = std::max(width >> level, 1u);
+	height = std::max(height >> level, 1u);
+	return format == VK_FORMAT_BC1_RGB_SRGB_BLOCK ? bc::bc1LevelSize(width, height) : VkDeviceSize(width) * height * 4;
+}
+
+// Returns the header of a mapped cache file if it is well-formed and up to date with its source, or nullptr otherwise.
+inline const TextureCacheHeader* validateTextureCache(const MappedFile& cache, const fs::path& source)
+{
+	if (!cache || cache.size() < sizeof(TextureCacheHeader)) { return nullptr; }
+
+	const auto* header = reinterpret_cast<const TextureCacheHeader*>(cache.data());
+	if (header->magic != kTextureCacheMagic || header->version != kTextureCacheVersion) { return nullptr; }
+	if (header->format != VK_FORMAT_BC1_RGB_SRGB_BLOCK || header->width == 0 || header->height == 0 ||
+		header->mipLevels != static_cast<uint32_t>(std::bit_width(std::max(header->width, header->height)))) {
+		return nullptr;
+	}
+	uint64_t dataSize = 0;
+	for (uint32_t level = 0; level < header->mipLevels; ++level) {
+		dataSize += textureLevelSize(VkFormat(header->format), header->width, header->height, level);
+	}
+	if (header->dataSize != dataSize || header->dataOffset > cache.size() || header->dataSize > cache.size() - header->dataOffset) {
+		return nullptr;
+	}
+
+	return cacheMatchesSource(source, header->sourceSize, header->sourceWriteTime, header->sourceHash) ? header : nullptr;
+}
+
+// Writes a texture cache file, through a temporary file renamed into place like writeMeshCache.
+inline bool writeTextureCache(const fs::path& cachePath, const fs::path& source, uint64_t sourceHash, const TextureData& texture)
+{
+	std::error_code ec;
+	const TextureCacheHeader header{
+		.magic				= kTextureCacheMagic,
+		.version			= kTextureCacheVersion,
+		.sourceSize			= fs::file_size(source, ec),
+		.sourceWriteTime	= fileWriteTime(source),
+		.sourceHash			= sourceHash,
+		.format				= static_cast<uint32_t>(texture.format),
+		.width				= texture.width,
+		.height				= texture.height,
+		.mipLevels			= texture.mipLevels,
+		.dataOffset			= sizeof(TextureCacheHeader),
+		.dataSize			= texture.bytes.size()
+	};
+
+	auto tmpPath = cachePath;
+	tmpPath += fmt::format(".{}.tmp", std::hash<std::thread::id>{}(std::this_thread::get_id()));
+	{
+		std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!file) { return false; }
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(texture.bytes.data()), static_cast<std::streamsize>(texture.bytes.size()));
+		if (!file) { file.close(); fs::remove(tmpPath, ec); return false; }
+	}
+
+	fs::rename(tmpPath, cachePath, ec);
+	if (ec) { fs::remove(tmpPath, ec); return false; }
+	return true;
+}
+
+// Loads a texture from its cache if it is up to date. Otherwise decodes the image, and with TextureData::bCompress
+// encodes its mip chain into BC1 and writes a new cache. Returns an empty TextureData if the image can't be loaded.
+inline TextureData loadTexture(const fs::path& path)
+{
+	TextureData texture;
+	const bool bCompress = TextureData::bCompress;
+	const auto cachePath = textureCachePath(path);
+	if (bCompress && texture.cacheFile.open(cachePath)) {
+		if (const auto* header = validateTextureCache(texture.cacheFile, path)) {
+			texture.format = VkFormat(header->format);
+			texture.width = header->width;
+			texture.height = header->height;
+			texture.mipLevels = header->mipLevels;
+			texture.bytes = texture.cacheFile.bytes().subspan(header->dataOffset, header->dataSize);
+			return texture;
+		}
+		texture.cacheFile.close();
+	}
+
+	// Decode from the mapped file, which is hashed for the cache as well.
+	const MappedFile source(path);
+	if (!source) {
+		fmt::println("Warning: could not open texture {}", path.string());
+		return {};
+	}
+	int width, height;
+	stbi_set_flip_vertically_on_load_thread(true);	// The global setting isn't safe to change from the loading threads.
+	stbi_uc* pixels = stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(source.data()), static_cast<int>(source.size()), &width, &height, nullptr, STBI_rgb_alpha);
+	if (!pixels) {
+		fmt::println("Warning: could not load texture {}: {}", path.string(), stbi_failure_reason());
+		return {};
+	}
+	texture.width = static_cast<uint32_t>(width);
+	texture.height = static_cast<uint32_t>(height);
+	const std::span<const uint8_t> rgba(pixels, size_t(texture.width) * texture.height * 4);
+	if (bCompress) {
+		texture.format = VK_FORMAT_BC1_RGB_SRGB_BLOCK;
+		texture.mipLevels = bc::encodeBc1MipChain(rgba, texture.width, texture.height, texture.pixels);
+	}
+	else {
+		texture.format = VK_FORMAT_R8G8B8A8_SRGB;
+		texture.mipLevels = 1;
+		texture.pixels.resize(rgba.size());
+		std::memcpy(texture.pixels.data(), rgba.data(), rgba.size());
+	}
+	stbi_image_free(pixels);
+	texture.bytes = texture.pixels;
+
+	if (bCompress && !writeTextureCache(cachePath, path, hashBytes(source.bytes()), texture)) {
+		fmt::println("Warning: could not write texture cache {}", cachePath.string());
+	}
+	return texture;
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <thread_pool.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+
+// CPU encoding of RGBA8 sRGB images into BC1 blocks, and the mip chain filtering that precedes it (see texture_cache.h).
+// BC1 stores each 4x4 texel block in 8 bytes: two RGB565 endpoints and a 2-bit index per texel into the four colors
+// interpolated between them. Alpha is dropped: the shader only reads the albedo's color.
+namespace bc
+{
+	constexpr size_t kBc1BlockBytes = 8;
+
+	inline uint32_t blockCount(uint32_t texels) { return (texels + 3) / 4; }
+
+	inline size_t bc1LevelSize(uint32_t width, uint32_t height) { return size_t(blockCount(width)) * blockCount(height) * kBc1BlockBytes; }
+
+	inline float srgbToLinear(uint8_t value)
+	{
+		static const auto kTable = []() {
+			std::array<float, 256> table;
+			for (uint32_t i = 0; i < 256; ++i) {
+				const float c = i / 255.f;
+				table[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+			}
+			return table;
+		}();
+		return kTable[value];
+	}
+
+	inline uint8_t linearToSrgb(float value)
+	{
+		const float c = std::clamp(value, 0.f, 1.f);
+		const float s = c <= 0.0031308f ? 12.92f * c : 1.055f * std::pow(c, 1.f / 2.4f) - 0.055f;
+		return static_cast<uint8_t>(s * 255.f + 0.5f);
+	}
+
+	// Filters the next mip level of an RGBA8 sRGB image. Each texel averages its 2x2 footprint in linear space, like
+	// shaders/mipmap.comp.glsl; the footprint is clamped to the image for odd sizes.
+	inline std::vector<uint8_t> downsampleSrgb(std::span<const uint8_t> src, uint32_t width, uint32_t height)
+	{
+		const uint32_t dstWidth = std::max(width / 2, 1u);
+		const uint32_t dstHeight = std::max(height / 2, 1u);
+		std::vector<uint8_t> dst(size_t(dstWidth) * dstHeight * 4);
+		ThreadPool::global().parallelFor(dstHeight, [&](size_t y) {
+			const size_t rows[2] = { std::min<size_t>(2 * y, height - 1), std::min<size_t>(2 * y + 1, height - 1) };
+			for (uint32_t x = 0; x < dstWidth; ++x) {
+				const size_t columns[2] = { std::min<size_t>(2 * x, width - 1), std::min<size_t>(2 * x + 1, width - 1) };
+				float color[4] = {};
+				for (const size_t row : rows) {
+					for (const size_t column : columns) {
+						const uint8_t* texel = &src[(row * width + column) * 4];
+						for (uint32_t c = 0; c < 3; ++c) { color[c] += srgbToLinear(texel[c]); }
+						color[3] += texel[3];
+					}
+				}
+				uint8_t* out = &dst[(y * dstWidth + x) * 4];
+				for (uint32_t c = 0; c < 3; ++c) { out[c] = linearToSrgb(color[c] * 0.25f); }
+				out[3] = static_cast<uint8_t>(color[3] * 0.25f + 0.5f);
+			}
+			});
+		return dst;
+	}
+
+	inline uint16_t packRgb565(const float color[3])
+	{
+		const auto quantize = [](float c, uint32_t max) { return static_cast<uint32_t>(std::clamp(c * max / 255.f + 0.5f, 0.f, float(max))); };
+		return static_cast<uint16_t>((quantize(color[0], 31) << 11) | (quantize(color[1], 63) << 5) | quantize(color[2], 31));
+	}
+
+	inline void unpackRgb565(uint16_t packed, float color[3])
+	{
+		const uint32_t r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+		color[0] = float((r << 3) | (r >> 2));
+		color[1] = float((g << 2) | (g >> 4));
+		color[2] = float((b << 3) | (b >> 2));
+	}
+
+	// Encodes a block of 16 RGBA8 texels, in rows, with a range fit: the endpoints are the extremes of the colors along
+	// their principal axis, inset by 1/16 of the range to reduce the error of the interpolated colors. The endpoints are
+	// ordered so that the block is in 4-color mode.
+	inline void encodeBc1Block(const uint8_t texels[16 * 4], std::byte* out)
+	{
+		float mean[3] = {};
+		for (uint32_t i = 0; i < 16; ++i) {
+			for (uint32_t c = 0; c < 3; ++c) { mean[c] += texels[i * 4 + c] / 16.f; }
+		}
+		float covariance[6] = {};	// xx, xy, xz, yy, yz, zz
+		for (uint32_t i = 0; i < 16; ++i) {
+			const float d[3] = { texels[i * 4] - mean[0], texels[i * 4 + 1] - mean[1], texels[i * 4 + 2] - mean[2] };
+			covariance[0] += d[0] * d[0]; covariance[1] += d[0] * d[1]; covariance[2] += d[0] * d[2];
+			covariance[3] += d[1] * d[1]; covariance[4] += d[1] * d[2]; covariance[5] += d[2] * d[2];
+		}
+
+		// Principal axis by power iteration.
+		float axis[3] = { 1.f, 1.f, 1.f };
+		for (uint32_t iteration = 0; iteration < 8; ++iteration) {
+			const float next[3] = {
+				covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+				covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+				covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2] };
+			const float length = std::max({ std::abs(next[0]), std::abs(next[1]), std::abs(next[2]) });
+			if (length < 1e-6f) { break; }	// Flat block: any axis will do.
+			for (uint32_t c = 0; c < 3; ++c) { axis[c] = next[c] / length; }
+		}
+		const float axisLength2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+
+		float minT = 0.f, maxT = 0.f;
+		for (uint32_t i = 0; i < 16; ++i) {
+			const float t = ((texels[i * 4] - mean[0]) * axis[0] + (texels[i * 4 + 1] - mean[1]) * axis[1] + (texels[i * 4 + 2] - mean[2]) * axis[2]) / axisLength2;
+			minT = std::min(minT, t);
+			maxT = std::max(maxT, t);
+		}
+		const float inset = (maxT - minT) / 16.f;
+		minT += inset;
+		maxT -= inset;
+
+		float endpoints[2][3];
+		for (uint32_t c = 0; c < 3; ++c) {
+			endpoints[0][c] = mean[c] + axis[c] * maxT;
+			endpoints[1][c] = mean[c] + axis[c] * minT;
+		}
+		uint16_t color0 = packRgb565(endpoints[0]);
+		uint16_t color1 = packRgb565(endpoints[1]);
+		if (color0 < color1) { std::swap(color0, color1); }
+
+		// Equal endpoints select 3-color mode, where index 0 is still color0: the indices are all 0.
+		uint32_t indices = 0;
+		if (color0 != color1) {
+			float palette[4][3];
+			unpackRgb565(color0, palette[0]);
+			unpackRgb565(color1, palette[1]);
+			for (uint32_t c = 0; c < 3; ++c) {
+				palette[2][c] = (2.f * palette[0][c] + palette[1][c]) / 3.f;
+				palette[3][c] = (palette[0][c] + 2.f * palette[1][c]) / 3.f;
+			}
+			for (uint32_t i = 0; i < 16; ++i) {
+				uint32_t best = 0;
+				float bestDistance = INFINITY;
+				for (uint32_t p = 0; p < 4; ++p) {
+					const float d[3] = { texels[i * 4] - palette[p][0], texels[i * 4 + 1] - palette[p][1], texels[i * 4 + 2] - palette[p][2] };
+					const float distance = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+					if (distance < bestDistance) { best = p; bestDistance = distance; }
+				}
+				indices |= best << (2 * i);
+			}
+		}
+
+		std::memcpy(out, &color0, 2);
+		std::memcpy(out + 2, &color1, 2);
+		std::memcpy(out + 4, &indices, 4);
+	}
+
+	// Encodes an RGBA8 image into rows of BC1 blocks, in parallel over the rows. Blocks past the edge of an image whose size
+	// isn't a multiple of 4 repeat its last column and row.
+	inline void encodeBc1(std::span<const uint8_t> rgba, uint32_t width, uint32_t height, std::byte* out)
+	{
+		const uint32_t blocksX = blockCount(width);
+		ThreadPool::global().parallelFor(blockCount(height), [&](size_t blockY) {
+			uint8_t texels[16 * 4];
+			for (uint32_t blockX = 0; blockX < blocksX; ++blockX) {
+				for (uint32_t i = 0; i < 16; ++i) {
+					const size_t x = std::min<size_t>(blockX * 4 + i % 4, width - 1);
+					const size_t y = std::min<size_t>(blockY * 4 + i / 4, height - 1);
+					std::memcpy(&texels[i * 4], &rgba[(y * width + x) * 4], 4);
+				}
+				encodeBc1Block(texels, out + (blockY * blocksX + blockX) * kBc1BlockBytes);
+			}
+			});
+	}
+
+	// Builds the full mip chain of an RGBA8 sRGB image and encodes it into BC1, level after level, into out.
+	// Returns the number of levels.
+	inline uint32_t encodeBc1MipChain(std::span<const uint8_t> rgba, uint32_t width, uint32_t height, std::vector<std::byte>& out)
+	{
+		const uint32_t mipLevels = static_cast<uint32_t>(std::bit_width(std::max(width, height)));
+		size_t size = 0;
+		for (uint32_t level = 0; level < mipLevels; ++level) {
+			size += bc1LevelSize(std::max(width >> level, 1u), std::max(height >> level, 1u));
+		}
+		out.resize(size);
+
+		std::vector<uint8_t> mip;
+		std::span<const uint8_t> level = rgba;
+		size_t offset = 0;
+		for (uint32_t i = 0; i < mipLevels; ++i) {
+			const uint32_t levelWidth = std::max(width >> i, 1u);
+			const uint32_t levelHeight = std::max(height >> i, 1u);
+			encodeBc1(level, levelWidth, levelHeight, out.data() + offset);
+			offset += bc1LevelSize(levelWidth, levelHeight);
+			if (i + 1 < mipLevels) {
+				mip = downsampleSrgb(level, levelWidth, levelHeight);
+				level = mip;
+			}
+		}
+		return mipLevels;
+	}
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+// A fixed-size pool of worker threads with a shared FIFO task queue.
+// Threads that wait on pool work (wait(), parallelFor()) execute queued tasks in the meantime,
+// so tasks may themselves submit and wait on nested work without deadlocking the pool.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency()))
+	{
+		for (uint32_t i = 0; i < threadCount; ++i) {
+			mThreads.emplace_back([this]() { workerLoop(); });
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::scoped_lock lock(mMutex);
+			bStopping = true;
+		}
+		mCondition.notify_all();
+		for (auto& thread : mThreads) { thread.join(); }
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// The pool shared by all asset loading code.
+	static ThreadPool& global()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
+
+	uint32_t threadCount() const { return static_cast<uint32_t>(mThreads.size()); }
+
+	// Queues a callable and returns a future for its result.
+	template<typename F>
+	auto submit(F&& function) -> std::future<std::invoke_result_t<std::decay_t<F>>>
+	{
+		using Result = std::invoke_result_t<std::decay_t<F>>;
+		auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(function));
+		auto future = task->get_future();
+		{
+			std::scoped_lock lock(mMutex);
+			mTasks.emplace_back([task]() { (*task)(); });
+		}
+		mCondition.notify_one();
+		return future;
+	}
+
+	// Runs one queued task on the calling thread. Returns false if the queue was empty.
+	bool runPendingTask()
+	{
+		std::function<void()> task;
+		{
+			std::scoped_lock lock(mMutex);
+			if (mTasks.empty()) { return false; }
+			task = std::move(mTasks.front());
+			mTasks.pop_front();
+		}
+		task();
+		return true;
+	}
+
+	// Waits for a future produced by this pool, executing queued tasks while it is not ready.
+	template<typename T>
+	T wait(std::future<T>& future)
+	{
+		using namespace std::chrono_literals;
+		while (future.wait_for(0s) != std::future_status::ready) {
+			if (!runPendingTask()) { future.wait_for(100us); }
+		}
+		return future.get();
+	}
+
+	// Calls function(i) for every i in [0, count), spreading the iterations over the pool and the calling thread.
+	template<typename F>
+	void parallelFor(size_t count, F&& function)
+	{
+		if (count == 0) { return; }
+		if (count == 1 || mThreads.empty()) {
+			for (size_t i = 0; i < count; ++i) { function(i); }
+			return;
+		}
+
+		std::atomic<size_t> next{ 0 };
+		const auto worker = [&]() {
+			for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1)) { function(i); }
+		};
+
+		const size_t helperCount = std::min<size_t>(count, mThreads.size() + 1) - 1;
+		std::vector<std::future<void>> helpers;
+		helpers.reserve(helperCount);
+		for (size_t i = 0; i < helperCount; ++i) { helpers.push_back(submit(worker)); }
+
+		// Helpers reference this stack frame, so they must all finish before an exception can propagate.
+		std::exception_ptr error;
+		try { worker(); }
+		catch (...) { error = std::current_exception(); next = count; }
+		for (auto& helper : helpers) {
+			try { wait(helper); }
+			catch (...) { if (!error) { error = std::current_exception(); } }
+		}
+		if (error) { std::rethrow_exception(error); }
+	}
+
+private:
+	void workerLoop()
+	{
+		while (true) {
+			std::function<void()> task;
+			{
+				std::unique_lock lock(mMutex);
+				mCondition.wait(lock, [this]() { return bStopping || !mTasks.empty(); });
+				if (mTasks.empty()) { return; }
+				task = std::move(mTasks.front());
+				mTasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::vector<std::thread>			mThreads;
+	std::deque<std::function<void()>>	mTasks;
+	std::mutex							mMutex;
+	std::condition_variable				mCondition;
+	bool								bStopping{ false };
+};
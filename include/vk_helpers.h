@@ -15,8 +15,8 @@ inline VkDeviceAddress getBlasDeviceAddress(VkDevice device, VkAccelerationStruc
 }
 
 
-// TODO: Add additional usage, flags?
-inline AllocatedBuffer createHostVisibleStagingBuffer(VmaAllocator allocator, uint32_t size_bytes)
+// TODO: Add additional usage?
+inline AllocatedBuffer createHostVisibleStagingBuffer(VmaAllocator allocator, VkDeviceSize size_bytes, VmaAllocationCreateFlags flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT)
 {
     AllocatedBuffer buf;
     VkBufferCreateInfo createInfo{
@@ -26,7 +26,7 @@ inline AllocatedBuffer createHostVisibleStagingBuffer(VmaAllocator allocator, ui
         .sharingMode = VK_SHARING_MODE_EXCLUSIVE
     };
     const VmaAllocationCreateInfo allocCreateInfo{
-            .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
+            .flags = flags,
             .usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
             .requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
     };
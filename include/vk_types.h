@@ -45,6 +45,25 @@ struct AllocatedBuffer
     VmaAllocationInfo	mAllocInfo;
 };
 
+// A range suballocated from a larger buffer (see GeometryArena).
+struct BufferRange
+{
+    VkBuffer                mBuffer = VK_NULL_HANDLE;
+    VkDeviceSize            mOffset = 0;
+    VkDeviceSize            mSize = 0;
+    VkDeviceAddress         mAddress = 0;
+    void*                   mMapped = nullptr;  // Set if the buffer is host-visible.
+    VmaVirtualAllocation    mAllocation = VK_NULL_HANDLE;
+    uint32_t                mBlock = 0;
+};
+
+// Host memory imported with VK_EXT_external_memory_host, wrapped in a buffer.
+struct ImportedHostBuffer
+{
+    VkBuffer            mBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory      mMemory = VK_NULL_HANDLE;
+};
+
 struct Image
 {
     VkImage         mImage;
@@ -55,4 +74,5 @@ struct AccelerationStructure
 {
     VkAccelerationStructureKHR	        mHandle;
     AllocatedBuffer						mData; // Stores the Acceleration structure data.
+    VkDeviceSize                        mSize; // accelerationStructureSize, the size of the structure in mData.
 };
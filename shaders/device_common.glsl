@@ -14,12 +14,57 @@ struct HitInfo
 
 	uint materialType;
 	vec3 albedo; 
-	// vec3 albedoTextureID;
 	vec3 emitted;
 	int	phongExponent;
 
 };
 
+// Decodes an octahedral-mapped unit vector.
+vec3 decodeOctahedral(vec2 e)
+{
+	vec3 n = vec3(e, 1.f - abs(e.x) - abs(e.y));
+	if (n.z < 0.f) {
+		n.xy = (1.f - abs(n.yx)) * vec2(n.x >= 0.f ? 1.f : -1.f, n.y >= 0.f ? 1.f : -1.f);
+	}
+	return normalize(n);
+}
+
+// Expands a compact layout vertex.
+Vertex unpackVertex(vec3 position, PackedVertexAttributes attributes)
+{
+	Vertex v;
+	v.position = position;
+	v.normal = decodeOctahedral(unpackSnorm2x16(attributes.normal));
+	v.tex = unpackHalf2x16(attributes.tex);
+	return v;
+}
+
+// Texture level of detail for a ray cone of the given width at a triangle hit (ray cones, Akenine-Moller et al. 2021).
+// The cone's footprint on the triangle, which widens as the ray grazes it, is scaled by the triangle's texel density:
+// the ratio of its uv area in texels to its world-space area, from its edges.
+float rayConeTextureLod(float coneWidth, vec3 direction, vec3 normal, vec3 edge1, vec3 edge2, vec2 uvEdge1, vec2 uvEdge2, vec2 textureSize)
+{
+	const float worldArea	= length(cross(edge1, edge2));
+	const float texelArea	= abs(uvEdge1.x * uvEdge2.y - uvEdge2.x * uvEdge1.y) * textureSize.x * textureSize.y;
+	const float cosine		= max(abs(dot(normalize(direction), normal)), 1e-4f);
+	return 0.5f * log2(max(texelArea, 1e-20f) / max(worldArea, 1e-20f)) + log2(max(coneWidth, 1e-20f) / cosine);
+}
+
+// Spread angle of a ray cone after scattering. Specular surfaces keep it (their curvature is ignored); glossy and
+// diffuse ones widen it to about the width of their lobe, so the hits of later bounces read coarse texture levels.
+float scatteredConeSpread(float spread, uint materialType, int phongExponent)
+{
+	switch (materialType) {
+	case MIRROR:
+	case DIELECTRIC:
+		return spread;
+	case PHONG:
+		return max(spread, sqrt(2.f / (float(max(phongExponent, 0)) + 2.f)));
+	default:
+		return max(spread, 1.f);
+	}
+}
+
 void generateRay(Camera cam, vec2 pixel, uvec2 resolution, out vec3 origin, out vec3 direction)
 {
 	const float image_plane_height = 2.f * cam.focalDistance * tan(radians(cam.fovY) / 2.f);
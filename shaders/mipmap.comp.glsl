@@ -0,0 +1,26 @@
+#version 460
+
+// Generates a mip level of an sRGB texture from the level above it (see VulkanApp::generateMipmaps). Each texel is the
+// average of its 2x2 footprint in the level above, taken with a bilinear sample at the footprint's center. The sampled
+// view is sRGB, so the average is of linear values; the result is encoded back to sRGB by hand, as it is written
+// through a UNORM view of the level (sRGB formats don't support storage).
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+layout(binding = 0, set = 0) uniform sampler2D srcLevel;
+layout(binding = 1, set = 0, rgba8) uniform writeonly image2D dstLevel;
+
+vec3 linearToSrgb(vec3 c)
+{
+	return mix(12.92f * c, 1.055f * pow(c, vec3(1.f / 2.4f)) - 0.055f, greaterThan(c, vec3(0.0031308f)));
+}
+
+void main()
+{
+	const ivec2 size = imageSize(dstLevel);
+	const ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+	if (texel.x >= size.x || texel.y >= size.y) { return; }
+
+	const vec4 color = textureLod(srcLevel, (vec2(texel) + 0.5f) / vec2(size), 0.f);
+	imageStore(dstLevel, texel, vec4(linearToSrgb(color.rgb), color.a));
+}
@@ -1,6 +1,9 @@
 #version 460
 #extension GL_EXT_ray_query : require
 #extension GL_EXT_scalar_block_layout : require
+#extension GL_EXT_buffer_reference : require
+#extension GL_EXT_shader_explicit_arithmetic_types_int64 : require
+#extension GL_EXT_nonuniform_qualifier : require
 #extension GL_GOOGLE_include_directive : require
 
 #include "host_device_common.h"
@@ -12,11 +15,17 @@ layout(local_size_x = 16, local_size_y = 16, local_size_z = 1) in;
 layout(binding = 0, set = 0, rgba32f) uniform image2D storageImage;
 
 layout(binding = 1, set = 0) uniform accelerationStructureEXT tlas;
-layout(binding = 2, set = 0, scalar) buffer Vertices { Vertex vertices[]; } meshVertices[MAX_MESH_COUNT];	// Contains vertex buffers for meshes in the scene
-layout(binding = 3, set = 0, scalar) buffer Indices { uint indices[]; }		meshIndices[MAX_MESH_COUNT];	// Contains index buffers of meshes in the scene.
+layout(binding = 2, set = 0, scalar) readonly buffer MeshTable { MeshRecord meshes[]; };						// Geometry addresses of the meshes in the scene, indexed by mesh ID.
+layout(binding = 3, set = 0, scalar) readonly buffer InstanceTable { InstanceRecord instances[]; };			// Geometry and material of each TLAS instance, indexed by instance ID.
 layout(binding = 4, set = 0, scalar) buffer Materials { Material materials[]; };							// Contains all materials for the scene
-layout(binding = 5, set = 0) uniform sampler2D testTexture;
+layout(binding = 5, set = 0) uniform sampler2D textures[];																// Indexed by Material::albedoTexture. textures[0] is white.
 
+// Mesh geometry streams, suballocated from the geometry arena and addressed through the mesh table.
+layout(buffer_reference, scalar) readonly buffer Vertices { Vertex vertices[]; };
+layout(buffer_reference, scalar) readonly buffer Indices { uint indices[]; };
+layout(buffer_reference, scalar) readonly buffer Positions { vec3 positions[]; };								// Compact layout: vertex positions.
+layout(buffer_reference, scalar) readonly buffer Attributes { PackedVertexAttributes attributes[]; };			// Compact layout: packed normals and uvs.
+layout(buffer_reference, scalar) readonly buffer TriangleMaterials { uint materialIDs[]; };					// Per-triangle material indices of multi-material meshes.
 
 layout(push_constant, scalar) uniform PushConstants
 {
@@ -28,6 +37,54 @@ layout(push_constant, scalar) uniform PushConstants
 
 // Use a specialization constant to control which integrator to use. 
 layout(constant_id = 0) const int INTEGRATOR = PATH;
+// Use a specialization constant to select the layout of the mesh vertex buffers.
+layout(constant_id = 1) const int VERTEX_LAYOUT = VERTEX_LAYOUT_STANDARD;
+
+// Material of a triangle: the instance's material, offset by the triangle's own material index for multi-material meshes.
+uint triangleMaterialID(InstanceRecord instance, uint triangleID)
+{
+	if ((instance.flags & INSTANCE_MATERIALS_BIT) == 0) {
+		return instance.materialBase;
+	}
+	return instance.materialBase + TriangleMaterials(meshes[instance.meshID].triangleMaterialAddress).materialIDs[triangleID];
+}
+
+// Fetches the vertices of a triangle of the mesh referenced by a triangle instance.
+void loadTriangleVertices(InstanceRecord instance, uint triangleID, out Vertex v0, out Vertex v1, out Vertex v2)
+{
+	const MeshRecord mesh = meshes[instance.meshID];
+	Indices meshIndices = Indices(mesh.indexAddress);
+
+	// Get the indices of the vertices of the triangle
+	uvec3 indices;
+	if ((instance.flags & INSTANCE_INDEX16_BIT) != 0) {
+		// 16-bit indices are packed in pairs, low half first.
+		for (uint i = 0; i < 3; ++i) {
+			const uint k = 3 * triangleID + i;
+			indices[i] = (meshIndices.indices[k >> 1] >> (16 * (k & 1))) & 0xFFFF;
+		}
+	}
+	else {
+		indices = uvec3(
+			meshIndices.indices[3 * triangleID + 0],
+			meshIndices.indices[3 * triangleID + 1],
+			meshIndices.indices[3 * triangleID + 2]);
+	}
+
+	if (VERTEX_LAYOUT == VERTEX_LAYOUT_COMPACT) {
+		Positions meshPositions = Positions(mesh.vertexAddress);
+		Attributes meshAttributes = Attributes(mesh.attributeAddress);
+		v0 = unpackVertex(meshPositions.positions[indices.x], meshAttributes.attributes[indices.x]);
+		v1 = unpackVertex(meshPositions.positions[indices.y], meshAttributes.attributes[indices.y]);
+		v2 = unpackVertex(meshPositions.positions[indices.z], meshAttributes.attributes[indices.z]);
+	}
+	else {
+		Vertices meshVertices = Vertices(mesh.vertexAddress);
+		v0 = meshVertices.vertices[indices.x];
+		v1 = meshVertices.vertices[indices.y];
+		v2 = meshVertices.vertices[indices.z];
+	}
+}
 
 vec3 normalLi(vec3 worldO, vec3 worldD, inout uint rngState)
 {
@@ -45,9 +102,9 @@ vec3 normalLi(vec3 worldO, vec3 worldD, inout uint rngState)
 			// For procedural geometry (i.e. geometry defined by AABBs), we must handle intersection routines ourselves.
 			if (rayQueryGetIntersectionTypeEXT(rayQuery, false) == gl_RayQueryCandidateIntersectionAABBEXT)
 			{
-				// For procedural geometry, we use the custom index to determine the type of the geometry.
-				const uint geometryType	= rayQueryGetIntersectionInstanceCustomIndexEXT(rayQuery, false);
-				const uint materialID	= rayQueryGetIntersectionInstanceShaderBindingTableRecordOffsetEXT(rayQuery, false);
+				// For procedural geometry, the instance record holds the type of the geometry.
+				const InstanceRecord instance	= instances[rayQueryGetIntersectionInstanceIdEXT(rayQuery, false)];
+				const uint materialID	= instance.materialBase;
 
 				// TODO: perform intersection tests in object space to simplify intersecion routines.
 				// (For spheres it isn't significantly easier but it might be for other types of procedural geometry.)
@@ -57,7 +114,7 @@ vec3 normalLi(vec3 worldO, vec3 worldD, inout uint rngState)
 				const vec3 localO = rayQueryGetIntersectionObjectRayOriginEXT(rayQuery, false);
 				const vec3 localD = rayQueryGetIntersectionObjectRayDirectionEXT(rayQuery, false);
 
-				if ( geometryType == SPHERE_CUSTOM_INDEX && hitSphere(localO, localD,  worldToObject, objectToWorld, hitInfo)) {
+				if ( instance.geometryType == GEOMETRY_SPHERE && hitSphere(localO, localD,  worldToObject, objectToWorld, hitInfo)) {
 					
 					// Fill in material properties
 					Material material		= materials[materialID];
@@ -80,20 +137,14 @@ vec3 normalLi(vec3 worldO, vec3 worldD, inout uint rngState)
 			
 			//HitInfo info = closestHitTriangle(rayQuery, ...)
 
-			// Get the ID of the triangle
-			const uint meshID		= rayQueryGetIntersectionInstanceCustomIndexEXT(rayQuery, true);
+			// Get the instance and the ID of the triangle
+			const InstanceRecord instance	= instances[rayQueryGetIntersectionInstanceIdEXT(rayQuery, true)];
 			const uint triangleID	= rayQueryGetIntersectionPrimitiveIndexEXT(rayQuery, true);
-			const uint materialID	= rayQueryGetIntersectionInstanceShaderBindingTableRecordOffsetEXT(rayQuery, true);
-
-			// Get the indices of the vertices of the triangle
-			const uint i0 = meshIndices[meshID].indices[3 * triangleID + 0];
-			const uint i1 = meshIndices[meshID].indices[3 * triangleID + 1];
-			const uint i2 = meshIndices[meshID].indices[3 * triangleID + 2];
+			const uint materialID	= triangleMaterialID(instance, triangleID);
 
 			// Get the vertices of the triangle
-			const Vertex v0 = meshVertices[meshID].vertices[i0];
-			const Vertex v1 = meshVertices[meshID].vertices[i1];
-			const Vertex v2 = meshVertices[meshID].vertices[i2];
+			Vertex v0, v1, v2;
+			loadTriangleVertices(instance, triangleID, v0, v1, v2);
 
 			// Get the barycentric coordinates of the intersection
 			vec3 barycentrics	= vec3(0.f, rayQueryGetIntersectionBarycentricsEXT(rayQuery, true));
@@ -108,9 +159,7 @@ vec3 normalLi(vec3 worldO, vec3 worldD, inout uint rngState)
 			hitInfo.t	= rayQueryGetIntersectionTEXT(rayQuery, true);
 			hitInfo.p	= rayQueryGetIntersectionObjectToWorldEXT(rayQuery, true) * vec4(objectPos, 1.0f);
 			hitInfo.gn	= normalize((objectGN * rayQueryGetIntersectionWorldToObjectEXT(rayQuery, true)).xyz);
-			hitInfo.sn = (v0.normal == vec3(0.f) && v1.normal == vec3(0.f) && v2.normal == vec3(0.f)) ?
-				hitInfo.gn :
-				normalize((objectSN *rayQueryGetIntersectionWorldToObjectEXT(rayQuery, true)).xyz);
+			hitInfo.sn = normalize((objectSN * rayQueryGetIntersectionWorldToObjectEXT(rayQuery, true)).xyz);
 			hitInfo.uv	= objectUV;
 
 			// Fill in material properties
@@ -144,9 +193,9 @@ vec3 ambientOcclusionLi(vec3 worldO, vec3 worldD, inout uint rngState)
 		// For procedural geometry (i.e. geometry defined by AABBs), we must handle intersection routines ourselves.
 		if (rayQueryGetIntersectionTypeEXT(cameraRayQuery, false) == gl_RayQueryCandidateIntersectionAABBEXT)
 		{
-			// For procedural geometry, we use the custom index to determine the type of the geometry.
-			const uint geometryType = rayQueryGetIntersectionInstanceCustomIndexEXT(cameraRayQuery, false);
-			const uint materialID = rayQueryGetIntersectionInstanceShaderBindingTableRecordOffsetEXT(cameraRayQuery, false);
+			// For procedural geometry, the instance record holds the type of the geometry.
+			const InstanceRecord instance = instances[rayQueryGetIntersectionInstanceIdEXT(cameraRayQuery, false)];
+			const uint materialID = instance.materialBase;
 
 			// TODO: perform intersection tests in object space to simplify intersecion routines.
 			// (For spheres it isn't significantly easier but it might be for other types of procedural geometry.)
@@ -156,7 +205,7 @@ vec3 ambientOcclusionLi(vec3 worldO, vec3 worldD, inout uint rngState)
 			const vec3 localO = rayQueryGetIntersectionObjectRayOriginEXT(cameraRayQuery, false);
 			const vec3 localD = rayQueryGetIntersectionObjectRayDirectionEXT(cameraRayQuery, false);
 
-			if (geometryType == SPHERE_CUSTOM_INDEX && hitSphere(localO, localD, worldToObject, objectToWorld, hitInfo)) {
+			if (instance.geometryType == GEOMETRY_SPHERE && hitSphere(localO, localD, worldToObject, objectToWorld, hitInfo)) {
 
 				// Fill in material properties (technically we only care about the material type here...)
 				Material material = materials[materialID];
@@ -177,20 +226,14 @@ vec3 ambientOcclusionLi(vec3 worldO, vec3 worldD, inout uint rngState)
 	}
 	else if (rayQueryGetIntersectionTypeEXT(cameraRayQuery, true) == gl_RayQueryCommittedIntersectionTriangleEXT) {
 
-		// Get the ID of the triangle
-		const uint meshID = rayQueryGetIntersectionInstanceCustomIndexEXT(cameraRayQuery, true);
+		// Get the instance and the ID of the triangle
+		const InstanceRecord instance = instances[rayQueryGetIntersectionInstanceIdEXT(cameraRayQuery, true)];
 		const uint triangleID = rayQueryGetIntersectionPrimitiveIndexEXT(cameraRayQuery, true);
-		const uint materialID = rayQueryGetIntersectionInstanceShaderBindingTableRecordOffsetEXT(cameraRayQuery, true);
-
-		// Get the indices of the vertices of the triangle
-		const uint i0 = meshIndices[meshID].indices[3 * triangleID + 0];
-		const uint i1 = meshIndices[meshID].indices[3 * triangleID + 1];
-		const uint i2 = meshIndices[meshID].indices[3 * triangleID + 2];
+		const uint materialID = triangleMaterialID(instance, triangleID);
 
 		// Get the vertices of the triangle
-		const Vertex v0 = meshVertices[meshID].vertices[i0];
-		const Vertex v1 = meshVertices[meshID].vertices[i1];
-		const Vertex v2 = meshVertices[meshID].vertices[i2];
+		Vertex v0, v1, v2;
+		loadTriangleVertices(instance, triangleID, v0, v1, v2);
 
 		// Get the barycentric coordinates of the intersection
 		vec3 barycentrics = vec3(0.f, rayQueryGetIntersectionBarycentricsEXT(cameraRayQuery, true));
@@ -205,9 +248,7 @@ vec3 ambientOcclusionLi(vec3 worldO, vec3 worldD, inout uint rngState)
 		hitInfo.t = rayQueryGetIntersectionTEXT(cameraRayQuery, true);
 		hitInfo.p = rayQueryGetIntersectionObjectToWorldEXT(cameraRayQuery, true) * vec4(objectPos, 1.0f);
 		hitInfo.gn = normalize((objectGN * rayQueryGetIntersectionWorldToObjectEXT(cameraRayQuery, true)).xyz);
-		hitInfo.sn = (v0.normal == vec3(0.f) && v1.normal == vec3(0.f) && v2.normal == vec3(0.f)) ?
-			hitInfo.gn :
-			normalize((objectSN * rayQueryGetIntersectionWorldToObjectEXT(cameraRayQuery, true)).xyz);
+		hitInfo.sn = normalize((objectSN * rayQueryGetIntersectionWorldToObjectEXT(cameraRayQuery, true)).xyz);
 		hitInfo.uv = objectUV;
 
 		// Fill in material properties
@@ -239,14 +280,14 @@ vec3 ambientOcclusionLi(vec3 worldO, vec3 worldD, inout uint rngState)
 	{
 		if (rayQueryGetIntersectionTypeEXT(shadowRayQuery, false) == gl_RayQueryCandidateIntersectionAABBEXT)
 		{
-			const uint geometryType = rayQueryGetIntersectionInstanceCustomIndexEXT(shadowRayQuery, false);
+			const InstanceRecord instance = instances[rayQueryGetIntersectionInstanceIdEXT(shadowRayQuery, false)];
 			
 			const mat4x3 objectToWorld = rayQueryGetIntersectionObjectToWorldEXT(shadowRayQuery, false);
 			const mat4x3 worldToObject = rayQueryGetIntersectionWorldToObjectEXT(shadowRayQuery, false);
 			const vec3 localO	= rayQueryGetIntersectionObjectRayOriginEXT(shadowRayQuery, false);
 			const vec3 localD	= rayQueryGetIntersectionObjectRayDirectionEXT(shadowRayQuery, false);
 
-			if (geometryType == SPHERE_CUSTOM_INDEX && hitSphere(localO, localD, worldToObject, objectToWorld, shadowHitInfo)) {
+			if (instance.geometryType == GEOMETRY_SPHERE && hitSphere(localO, localD, worldToObject, objectToWorld, shadowHitInfo)) {
 				// We can return early here.
 				return vec3(0.f);
 			}
@@ -261,7 +302,7 @@ vec3 ambientOcclusionLi(vec3 worldO, vec3 worldD, inout uint rngState)
 }
 
 
-vec3 pathBasicLi(vec3 origin, vec3 direction, inout uint rngState);
+vec3 pathBasicLi(vec3 origin, vec3 direction, float pixelSpreadAngle, inout uint rngState);
 
 void main()
 {
@@ -275,6 +316,9 @@ void main()
 	// Use the linear index of the pixel as the initial seed for the RNG.
 	uint rngState =  resolution.x * (batchID * resolution.y + pixel.y)  + pixel.x;  
 
+	// Angle subtended by a pixel: the spread of the camera rays' cones, for texture filtering.
+	const float pixelSpreadAngle = atan(2.f * tan(radians(camera.fovY) / 2.f) / float(resolution.y));
+
 	vec3 pixelColor = vec3(0.f);
 	for (int sampleID = 0; sampleID < numSamples; ++sampleID)
 	{
@@ -287,7 +331,7 @@ void main()
 		{
 			case PATH:
 			{
-				pixelColor += pathBasicLi(origin, direction, rngState);
+				pixelColor += pathBasicLi(origin, direction, pixelSpreadAngle, rngState);
 				break;
 			}
 			case NORMAL:
@@ -313,10 +357,13 @@ void main()
 	imageStore(storageImage, ivec2(pixel), vec4(pixelColor, 0.f));
 }
 
-vec3 pathBasicLi(vec3 origin, vec3 direction, inout uint rngState)
+vec3 pathBasicLi(vec3 origin, vec3 direction, float pixelSpreadAngle, inout uint rngState)
 {
 	vec3 curAttenuation = vec3(1.0);
 	vec3 result			= vec3(0.f);
+	// Ray cone selecting the texture levels: its width at the origin of the ray, and its spread angle.
+	float coneWidth		= 0.f;
+	float coneSpread	= pixelSpreadAngle;
 	for (int depth = 0; depth <= numBounces; ++depth)
 	{
 
@@ -334,9 +381,9 @@ vec3 pathBasicLi(vec3 origin, vec3 direction, inout uint rngState)
 			// For procedural geometry (i.e. geometry defined by AABBs), we must handle intersection routines ourselves.
 			if (rayQueryGetIntersectionTypeEXT(rayQuery, false) == gl_RayQueryCandidateIntersectionAABBEXT)
 			{
-				// For procedural geometry, we use the custom index to determine the type of the geometry.
-				const uint geometryType	= rayQueryGetIntersectionInstanceCustomIndexEXT(rayQuery, false);
-				const uint materialID	= rayQueryGetIntersectionInstanceShaderBindingTableRecordOffsetEXT(rayQuery, false);
+				// For procedural geometry, the instance record holds the type of the geometry.
+				const InstanceRecord instance	= instances[rayQueryGetIntersectionInstanceIdEXT(rayQuery, false)];
+				const uint materialID	= instance.materialBase;
 
 				// TODO: perform intersection tests in object space to simplify intersecion routines.
 				// (For spheres it isn't significantly easier but it might be for other types of procedural geometry.)
@@ -346,7 +393,7 @@ vec3 pathBasicLi(vec3 origin, vec3 direction, inout uint rngState)
 				const vec3 localO = rayQueryGetIntersectionObjectRayOriginEXT(rayQuery, false);
 				const vec3 localD = rayQueryGetIntersectionObjectRayDirectionEXT(rayQuery, false);
 
-				if ( geometryType == SPHERE_CUSTOM_INDEX && hitSphere(localO, localD,  worldToObject, objectToWorld, hitInfo)) {
+				if ( instance.geometryType == GEOMETRY_SPHERE && hitSphere(localO, localD,  worldToObject, objectToWorld, hitInfo)) {
 					
 					// Fill in material properties
 					Material material		= materials[materialID];
@@ -367,20 +414,14 @@ vec3 pathBasicLi(vec3 origin, vec3 direction, inout uint rngState)
 		}
 		else if (rayQueryGetIntersectionTypeEXT(rayQuery, true) == gl_RayQueryCommittedIntersectionTriangleEXT) {
 			
-			// Get the ID of the triangle
-			const uint meshID		= rayQueryGetIntersectionInstanceCustomIndexEXT(rayQuery, true);
+			// Get the instance and the ID of the triangle
+			const InstanceRecord instance	= instances[rayQueryGetIntersectionInstanceIdEXT(rayQuery, true)];
 			const uint triangleID	= rayQueryGetIntersectionPrimitiveIndexEXT(rayQuery, true);
-			const uint materialID	= rayQueryGetIntersectionInstanceShaderBindingTableRecordOffsetEXT(rayQuery, true);
-
-			// Get the indices of the vertices of the triangle
-			const uint i0 = meshIndices[meshID].indices[3 * triangleID + 0];
-			const uint i1 = meshIndices[meshID].indices[3 * triangleID + 1];
-			const uint i2 = meshIndices[meshID].indices[3 * triangleID + 2];
+			const uint materialID	= triangleMaterialID(instance, triangleID);
 
 			// Get the vertices of the triangle
-			const Vertex v0 = meshVertices[meshID].vertices[i0];
-			const Vertex v1 = meshVertices[meshID].vertices[i1];
-			const Vertex v2 = meshVertices[meshID].vertices[i2];
+			Vertex v0, v1, v2;
+			loadTriangleVertices(instance, triangleID, v0, v1, v2);
 
 			// Get the barycentric coordinates of the intersection
 			vec3 barycentrics	= vec3(0.f, rayQueryGetIntersectionBarycentricsEXT(rayQuery, true));
@@ -396,9 +437,7 @@ vec3 pathBasicLi(vec3 origin, vec3 direction, inout uint rngState)
 			hitInfo.t	= rayQueryGetIntersectionTEXT(rayQuery, true);
 			hitInfo.p	= rayQueryGetIntersectionObjectToWorldEXT(rayQuery, true) * vec4(objectPos, 1.0f);
 			hitInfo.gn	= normalize((objectGN * rayQueryGetIntersectionWorldToObjectEXT(rayQuery, true)).xyz);
-			hitInfo.sn = (v0.normal == vec3(0.f) && v1.normal == vec3(0.f) && v2.normal == vec3(0.f)) ?
-				hitInfo.gn :
-				normalize((objectSN * rayQueryGetIntersectionWorldToObjectEXT(rayQuery, true)).xyz);
+			hitInfo.sn = normalize((objectSN * rayQueryGetIntersectionWorldToObjectEXT(rayQuery, true)).xyz);
 			hitInfo.uv	= objectUV;
 
 			// Fill in material properties
@@ -408,11 +447,19 @@ vec3 pathBasicLi(vec3 origin, vec3 direction, inout uint rngState)
 			hitInfo.emitted			= material.emitted;
 			hitInfo.phongExponent	= material.phongExponent;
 
+			// Filter the albedo texture over the footprint of the ray cone at the hit.
+			const mat3 objectToWorld	= mat3(rayQueryGetIntersectionObjectToWorldEXT(rayQuery, true));
+			const vec2 texSize			= vec2(textureSize(textures[nonuniformEXT(material.albedoTexture)], 0));
+			const float lod				= rayConeTextureLod(coneWidth + coneSpread * hitInfo.t, direction, hitInfo.gn,
+				objectToWorld * (v1.position - v0.position), objectToWorld * (v2.position - v0.position), v1.tex - v0.tex, v2.tex - v0.tex, texSize);
+			hitInfo.albedo			*= textureLod(textures[nonuniformEXT(material.albedoTexture)], hitInfo.uv, lod).rgb;
+
 
 		}
 		else {
 			// We already computed hit info for procedural geometry in the traversal loop.
 		}
+		coneWidth += coneSpread * hitInfo.t;
 
 
 		// Now use material to determine scatter properties.
@@ -460,6 +507,7 @@ vec3 pathBasicLi(vec3 origin, vec3 direction, inout uint rngState)
 			curAttenuation *= bsdf_term;
 			origin 			= scatteredOrigin;
 			direction		= scatteredDir;
+			coneSpread		= scatteredConeSpread(coneSpread, hitInfo.materialType, hitInfo.phongExponent);
 		}
 		else {
 			// Ray was absorbed by the surface.
@@ -491,9 +539,9 @@ vec3 pathNEELi(vec3 origin, vec3 direction, inout uint rngState)
 		// For procedural geometry (i.e. geometry defined by AABBs), we must handle intersection routines ourselves.
 		if (rayQueryGetIntersectionTypeEXT(rayQuery, false) == gl_RayQueryCandidateIntersectionAABBEXT)
 		{
-			// For procedural geometry, we use the custom index to determine the type of the geometry.
-			const uint geometryType = rayQueryGetIntersectionInstanceCustomIndexEXT(rayQuery, false);
-			const uint materialID = rayQueryGetIntersectionInstanceShaderBindingTableRecordOffsetEXT(rayQuery, false);
+			// For procedural geometry, the instance record holds the type of the geometry.
+			const InstanceRecord instance = instances[rayQueryGetIntersectionInstanceIdEXT(rayQuery, false)];
+			const uint materialID = instance.materialBase;
 
 			// TODO: perform intersection tests in object space to simplify intersecion routines.
 			// (For spheres it isn't significantly easier but it might be for other types of procedural geometry.)
@@ -503,7 +551,7 @@ vec3 pathNEELi(vec3 origin, vec3 direction, inout uint rngState)
 			const vec3 localO = rayQueryGetIntersectionObjectRayOriginEXT(rayQuery, false);
 			const vec3 localD = rayQueryGetIntersectionObjectRayDirectionEXT(rayQuery, false);
 
-			if (geometryType == SPHERE_CUSTOM_INDEX && hitSphere(localO, localD, worldToObject, objectToWorld, hitInfo)) {
+			if (instance.geometryType == GEOMETRY_SPHERE && hitSphere(localO, localD, worldToObject, objectToWorld, hitInfo)) {
 
 				// Fill in material properties
 				Material material = materials[materialID];
@@ -524,20 +572,14 @@ vec3 pathNEELi(vec3 origin, vec3 direction, inout uint rngState)
 	}
 	else if (rayQueryGetIntersectionTypeEXT(rayQuery, true) == gl_RayQueryCommittedIntersectionTriangleEXT) {
 
-		// Get the ID of the triangle
-		const uint meshID = rayQueryGetIntersectionInstanceCustomIndexEXT(rayQuery, true);
+		// Get the instance and the ID of the triangle
+		const InstanceRecord instance = instances[rayQueryGetIntersectionInstanceIdEXT(rayQuery, true)];
 		const uint triangleID = rayQueryGetIntersectionPrimitiveIndexEXT(rayQuery, true);
-		const uint materialID = rayQueryGetIntersectionInstanceShaderBindingTableRecordOffsetEXT(rayQuery, true);
-
-		// Get the indices of the vertices of the triangle
-		const uint i0 = meshIndices[meshID].indices[3 * triangleID + 0];
-		const uint i1 = meshIndices[meshID].indices[3 * triangleID + 1];
-		const uint i2 = meshIndices[meshID].indices[3 * triangleID + 2];
+		const uint materialID = triangleMaterialID(instance, triangleID);
 
 		// Get the vertices of the triangle
-		const Vertex v0 = meshVertices[meshID].vertices[i0];
-		const Vertex v1 = meshVertices[meshID].vertices[i1];
-		const Vertex v2 = meshVertices[meshID].vertices[i2];
+		Vertex v0, v1, v2;
+		loadTriangleVertices(instance, triangleID, v0, v1, v2);
 
 		// Get the barycentric coordinates of the intersection
 		vec3 barycentrics = vec3(0.f, rayQueryGetIntersectionBarycentricsEXT(rayQuery, true));
@@ -553,9 +595,7 @@ vec3 pathNEELi(vec3 origin, vec3 direction, inout uint rngState)
 		hitInfo.t = rayQueryGetIntersectionTEXT(rayQuery, true);
 		hitInfo.p = rayQueryGetIntersectionObjectToWorldEXT(rayQuery, true) * vec4(objectPos, 1.0f);
 		hitInfo.gn = normalize((objectGN * rayQueryGetIntersectionWorldToObjectEXT(rayQuery, true)).xyz);
-		hitInfo.sn = (v0.normal == vec3(0.f) && v1.normal == vec3(0.f) && v2.normal == vec3(0.f)) ?
-			hitInfo.gn :
-			normalize((objectSN * rayQueryGetIntersectionWorldToObjectEXT(rayQuery, true)).xyz);
+		hitInfo.sn = normalize((objectSN * rayQueryGetIntersectionWorldToObjectEXT(rayQuery, true)).xyz);
 		hitInfo.uv = objectUV;
 
 		// Fill in material properties
@@ -1,5 +1,9 @@
 
+#include <algorithm>
+#include <bit>
+#include <chrono>
 #include <iostream>
+#include <numeric>
 
 #include <volk.h>
 
@@ -77,8 +81,14 @@ void VulkanApp::initVulkanContext(bool validation)
     VkPhysicalDeviceVulkan12Features features12{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
     features12.bufferDeviceAddress = true;
     features12.descriptorIndexing = true;
+    features12.runtimeDescriptorArray = true;                       // The scene texture array.
+    features12.shaderSampledImageArrayNonUniformIndexing = true;
+    features12.descriptorBindingVariableDescriptorCount = true;
     features12.scalarBlockLayout = true;
 
+    // Core features: 64-bit mesh table addresses in the shader.
+    VkPhysicalDeviceFeatures features{};
+    features.shaderInt64 = true;
 
     // features from Vulkan 1.3.
     VkPhysicalDeviceVulkan13Features features13{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES };
@@ -98,6 +108,7 @@ void VulkanApp::initVulkanContext(bool validation)
     const auto physDevice_ret = physDeviceSelector
         .set_minimum_version(1, 3)
         .defer_surface_initialization()
+        .set_required_features(features)
         .set_required_features_12(features12)
         .set_required_features_13(features13)
 
@@ -113,6 +124,33 @@ void VulkanApp::initVulkanContext(bool validation)
     vkb::PhysicalDevice physicalDevice = physDevice_ret.value();
     mPhysicalDevice = physicalDevice.physical_device;
 
+    // Optional: lets uploads copy straight out of memory-mapped mesh caches (see importHostMemory).
+    if (physicalDevice.enable_extension_if_present(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME)) {
+        VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostMemoryProperties{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT };
+        VkPhysicalDeviceProperties2 properties{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, .pNext = &hostMemoryProperties };
+        vkGetPhysicalDeviceProperties2(mPhysicalDevice, &properties);
+        mHostImportAlignment = hostMemoryProperties.minImportedHostPointerAlignment;
+    }
+
+    // Limits for the transient memory of the render graph: AS build scratch offsets, and buffers next to images.
+    {
+        VkPhysicalDeviceAccelerationStructurePropertiesKHR asProperties{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR };
+        VkPhysicalDeviceProperties2 properties{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, .pNext = &asProperties };
+        vkGetPhysicalDeviceProperties2(mPhysicalDevice, &properties);
+        mScratchAlignment = asProperties.minAccelerationStructureScratchOffsetAlignment;
+        mBufferImageGranularity = properties.properties.limits.bufferImageGranularity;
+    }
+
+    // Optional: BC1 textures (see texture_cache.h). Without it, textures are uploaded as RGBA8 with mip chains generated
+    // on the GPU.
+    VkPhysicalDeviceFeatures bcFeatures{};
+    bcFeatures.textureCompressionBC = true;
+    bTextureCompressionBC = physicalDevice.enable_features_if_present(bcFeatures);
+    if (!bTextureCompressionBC) { TextureData::bCompress = false; }
+
+    // Optional: lets VMA report the driver's memory budgets rather than estimate them (see checkHeapBudget).
+    bMemoryBudget = physicalDevice.enable_extension_if_present(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
     //create the final vulkan device
     vkb::DeviceBuilder deviceBuilder{ physicalDevice };
     const auto dev_ret = deviceBuilder.build();
@@ -135,6 +173,13 @@ void VulkanApp::initVulkanContext(bool validation)
     VkQueue compute_queue = queue_ret.value();
     const auto compute_queue_index = vkbDevice.get_queue_index(vkb::QueueType::compute).value();
 
+    // Uploads go to a dedicated transfer queue when there is one, so they can run alongside compute work.
+    const auto transfer_queue_ret = vkbDevice.get_dedicated_queue(vkb::QueueType::transfer);
+    if (transfer_queue_ret) {
+        mTransferQueue = transfer_queue_ret.value();
+        mTransferQueueFamily = vkbDevice.get_dedicated_queue_index(vkb::QueueType::transfer).value();
+    }
+
     // Add destroy functions to deletion queue.
     mDeletionQueue.push_function([&]() {    vkDestroyInstance(mInstance, nullptr);});
     mDeletionQueue.push_function([&]() {    vkb::destroy_debug_utils_messenger(mInstance, mDebugMessenger);});
@@ -146,7 +191,7 @@ void VulkanApp::initVulkanContext(bool validation)
         .vkGetDeviceProcAddr = vkGetDeviceProcAddr
     };
     VmaAllocatorCreateInfo allocatorInfo{
-        .flags = VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT,
+        .flags = VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT | (bMemoryBudget ? VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT : 0u),
         .physicalDevice = mPhysicalDevice,
         .device = mDevice,
         .pVulkanFunctions = &f,
@@ -180,322 +225,1304 @@ void VulkanApp::initVulkanResources()
     cmdInfo.level                       = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
     VK_CHECK(vkAllocateCommandBuffers(mDevice, &cmdInfo, &mImmediateCmdBuf));
 
+    // Command pool for the dedicated transfer queue.
+    if (mTransferQueue != VK_NULL_HANDLE) {
+        commandPoolCreateInfo.queueFamilyIndex = mTransferQueueFamily;
+        VK_CHECK(vkCreateCommandPool(mDevice, &commandPoolCreateInfo, nullptr, &mTransferCommandPool));
+        mDeletionQueue.push_function([&]() { vkDestroyCommandPool(mDevice, mTransferCommandPool, nullptr);});
+    }
+
+    // Command buffers, fences and semaphores for the streaming scene upload (see uploadScene).
+    // Without a dedicated transfer queue, the copies are recorded into the compute command buffer.
+    for (auto& frame : mUploadFrames)
+    {
+        VK_CHECK(vkAllocateCommandBuffers(mDevice, &cmdInfo, &frame.mCmd));
+        VK_CHECK(vkCreateFence(mDevice, &fenceInfo, nullptr, &frame.mFence));
+        mDeletionQueue.push_function([this, fence = frame.mFence]() {vkDestroyFence(mDevice, fence, nullptr);});
+
+        frame.mTransferCmd = frame.mCmd;
+        if (mTransferQueue != VK_NULL_HANDLE) {
+            VkCommandBufferAllocateInfo transferCmdInfo = cmdInfo;
+            transferCmdInfo.commandPool = mTransferCommandPool;
+            VK_CHECK(vkAllocateCommandBuffers(mDevice, &transferCmdInfo, &frame.mTransferCmd));
+
+            const VkSemaphoreCreateInfo semaphoreInfo = { .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+            VK_CHECK(vkCreateSemaphore(mDevice, &semaphoreInfo, nullptr, &frame.mTransferSemaphore));
+            mDeletionQueue.push_function([this, semaphore = frame.mTransferSemaphore]() {vkDestroySemaphore(mDevice, semaphore, nullptr);});
+        }
+    }
+
+    // Persistent staging memory shared by all uploads.
+    mStagingRing.init(mVmaAllocator, kStagingRingSize);
+    mMemoryTracker.add(MemoryCategory::Staging, kStagingRingSize);
+    mDeletionQueue.push_function([&]() { mStagingRing.destroy(mVmaAllocator); mMemoryTracker.remove(MemoryCategory::Staging, kStagingRingSize); });
+
+    // Mesh geometry. Shared with the transfer queue, if any, so uploads don't need ownership transfers for it.
+    std::vector<uint32_t> geometryQueueFamilies = { mComputeQueueFamily };
+    if (mTransferQueue != VK_NULL_HANDLE) { geometryQueueFamilies.push_back(mTransferQueueFamily); }
+    mGeometryArena.init(mDevice, mVmaAllocator, kGeometryArenaBlockSize,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, std::move(geometryQueueFamilies), &mMemoryTracker);
+    mDeletionQueue.push_function([&]() { mGeometryArena.destroy(); });
+
+    mRenderGraph.init(mDevice, mVmaAllocator, mBufferImageGranularity, &mMemoryTracker);
+    mDeletionQueue.push_function([&]() { mRenderGraph.destroy(); });
 }
 
-// Uploads all scene geometry into GPU buffers;
-void VulkanApp::uploadScene()
+// Wraps a range of host memory in a transfer source buffer without copying it. data and size must be multiples of
+// minImportedHostPointerAlignment. Returns false if the device can't import the memory (e.g. some drivers refuse
+// read-only file mappings), in which case the caller stages the data instead.
+bool VulkanApp::importHostMemory(const void* data, VkDeviceSize size, ImportedHostBuffer& importedBuffer)
 {
-    mScene = createBuddhaCornellBox();
+    if (mHostImportAlignment == 0 || reinterpret_cast<uintptr_t>(data) % mHostImportAlignment != 0 || size % mHostImportAlignment != 0) {
+        return false;
+    }
+    VkMemoryHostPointerPropertiesEXT pointerProperties{ .sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT };
+    if (vkGetMemoryHostPointerPropertiesEXT(mDevice, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, data, &pointerProperties) != VK_SUCCESS) {
+        return false;
+    }
 
-    //TODO: Create one large staging buffer for all scene data? 
-    
-    // Upload triangle mesh data
-    for(auto&& mesh : mScene.mMeshes)
-    { 
-        const size_t vertexBufferSize = mesh.mVertices.size() * sizeof(Vertex);
-        const size_t indexBufferSize = mesh.mIndices.size() * sizeof(uint32_t);
-
-        // Create GPU buffers for the vertices and indices.
-        VkBufferCreateInfo deviceBufferCreateInfo{
-            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-            .size = vertexBufferSize,
-            .usage =
-                VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-                VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
-                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
-                VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-            .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-        };
-        const VmaAllocationCreateInfo deviceBufferAllocInfo{ .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, };
-        VK_CHECK(vmaCreateBuffer(mVmaAllocator, &deviceBufferCreateInfo, &deviceBufferAllocInfo, &mesh.mVertexBuffer.mBuffer, &mesh.mVertexBuffer.mAllocation, &mesh.mVertexBuffer.mAllocInfo));
-        mDeletionQueue.push_function([&]() {vmaDestroyBuffer(mVmaAllocator, mesh.mVertexBuffer.mBuffer, mesh.mVertexBuffer.mAllocation);});
-
-        deviceBufferCreateInfo.size = indexBufferSize;
-        VK_CHECK(vmaCreateBuffer(mVmaAllocator, &deviceBufferCreateInfo, &deviceBufferAllocInfo, &mesh.mIndexBuffer.mBuffer, &mesh.mIndexBuffer.mAllocation, &mesh.mIndexBuffer.mAllocInfo));
-        mDeletionQueue.push_function([&]() {vmaDestroyBuffer(mVmaAllocator, mesh.mIndexBuffer.mBuffer, mesh.mIndexBuffer.mAllocation);});
-
-
-        // Create a staging buffer for the mesh data.
-        AllocatedBuffer meshStagingBuffer;
-        const VkBufferCreateInfo stagingbufferCreateInfo{
-                .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-                .size = vertexBufferSize + indexBufferSize,
-                .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-        };
-        const VmaAllocationCreateInfo stagingBufferAllocInfo{
-                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
-                .usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
-                .requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
-        };
-        VK_CHECK(vmaCreateBuffer(mVmaAllocator, &stagingbufferCreateInfo, &stagingBufferAllocInfo, &meshStagingBuffer.mBuffer, &meshStagingBuffer.mAllocation, &meshStagingBuffer.mAllocInfo));
-
-        // Copy mesh data to staging buffer.
-        void* data;
-        vmaMapMemory(mVmaAllocator, meshStagingBuffer.mAllocation, (void**)&data);
-        memcpy(data, mesh.mVertices.data(), vertexBufferSize);
-        memcpy((char*)data + vertexBufferSize, mesh.mIndices.data(), indexBufferSize);
-        vmaUnmapMemory(mVmaAllocator, meshStagingBuffer.mAllocation); 
-
-        // Transfer mesh data to GPU buffer.
-        immediateSubmit([&](VkCommandBuffer cmd) {
-            VkBufferCopy vertexCopy;
-            vertexCopy.dstOffset = 0;
-            vertexCopy.srcOffset = 0;
-            vertexCopy.size      = vertexBufferSize;
-            vkCmdCopyBuffer(cmd, meshStagingBuffer.mBuffer, mesh.mVertexBuffer.mBuffer, 1, &vertexCopy);
-
-            VkBufferCopy indexCopy;
-            indexCopy.dstOffset = 0;
-            indexCopy.srcOffset = vertexBufferSize;
-            indexCopy.size = indexBufferSize;
-            vkCmdCopyBuffer(cmd, meshStagingBuffer.mBuffer, mesh.mIndexBuffer.mBuffer, 1, &indexCopy);
-        }); 
-
-        // Staging buffer no longer needed.
-        vmaDestroyBuffer(mVmaAllocator, meshStagingBuffer.mBuffer, meshStagingBuffer.mAllocation);
+    const VkExternalMemoryBufferCreateInfo externalInfo{
+        .sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO,
+        .handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT
+    };
+    const VkBufferCreateInfo bufferInfo{
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .pNext = &externalInfo,
+        .size = size,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+    };
+    VK_CHECK(vkCreateBuffer(mDevice, &bufferInfo, nullptr, &importedBuffer.mBuffer));
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(mDevice, importedBuffer.mBuffer, &requirements);
+    const uint32_t memoryTypes = requirements.memoryTypeBits & pointerProperties.memoryTypeBits;
+
+    const VkImportMemoryHostPointerInfoEXT importInfo{
+        .sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT,
+        .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+        .pHostPointer = const_cast<void*>(data)
+    };
+    const VkMemoryAllocateInfo allocInfo{
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .pNext = &importInfo,
+        .allocationSize = size,
+        .memoryTypeIndex = static_cast<uint32_t>(std::countr_zero(memoryTypes))
+    };
+    if (memoryTypes == 0 || requirements.size > size ||
+        vkAllocateMemory(mDevice, &allocInfo, nullptr, &importedBuffer.mMemory) != VK_SUCCESS) {
+        vkDestroyBuffer(mDevice, importedBuffer.mBuffer, nullptr);
+        importedBuffer = {};
+        return false;
+    }
+    VK_CHECK(vkBindBufferMemory(mDevice, importedBuffer.mBuffer, importedBuffer.mMemory, 0));
+    return true;
+}
+
+// Creates a device-local buffer for uploaded data. Where device-local memory is also host-visible (integrated GPUs, CPU
+// implementations, ReBAR), VMA may place the buffer in mappable memory and set mAllocInfo.pMappedData: the data can then
+// be written in place (followed by flushUploadBuffer), with no staging copy. Otherwise it has to be filled by a transfer.
+AllocatedBuffer VulkanApp::createUploadBuffer(VkDeviceSize size, VkBufferUsageFlags usage, MemoryCategory category)
+{
+    const VkBufferCreateInfo createInfo{
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = size,
+        .usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+    };
+    const VmaAllocationCreateInfo allocInfo{
+        .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT,
+        .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE
+    };
+    AllocatedBuffer buffer;
+    VK_CHECK(vmaCreateBuffer(mVmaAllocator, &createInfo, &allocInfo, &buffer.mBuffer, &buffer.mAllocation, &buffer.mAllocInfo));
+    trackAllocation(category, buffer.mAllocation);
+    return buffer;
+}
+
+// Makes host writes to a mapped upload buffer visible to the device (a no-op for host-coherent memory).
+void VulkanApp::flushUploadBuffer(const AllocatedBuffer& buffer)
+{
+    VK_CHECK(vmaFlushAllocation(mVmaAllocator, buffer.mAllocation, 0, VK_WHOLE_SIZE));
+}
+
+// Counts an allocation under its category for the memory report, and names it after the category in VMA's statistics.
+void VulkanApp::trackAllocation(MemoryCategory category, VmaAllocation allocation)
+{
+    VmaAllocationInfo info;
+    vmaGetAllocationInfo(mVmaAllocator, allocation, &info);
+    mMemoryTracker.add(category, info.size);
+    vmaSetAllocationName(mVmaAllocator, allocation, memoryCategoryName(category));
+}
+
+void VulkanApp::untrackAllocation(MemoryCategory category, VmaAllocation allocation)
+{
+    VmaAllocationInfo info;
+    vmaGetAllocationInfo(mVmaAllocator, allocation, &info);
+    mMemoryTracker.remove(category, info.size);
+}
+
+// Throws if size bytes would exceed the budget of the device-local heaps (see checkHeapBudget).
+void VulkanApp::checkMemoryBudget(MemoryCategory category, VkDeviceSize size)
+{
+    checkHeapBudget(mVmaAllocator, category, size);
+}
+
+// Prints the memory used by each category (and the peak of the transient ones), and the usage of each heap.
+void VulkanApp::printMemoryReport()
+{
+    constexpr double kMB = 1024.0 * 1024.0;
+    fmt::println("GPU memory:");
+    for (uint32_t i = 0; i < static_cast<uint32_t>(MemoryCategory::Count); ++i) {
+        const auto category = static_cast<MemoryCategory>(i);
+        fmt::println("  {:<12}{:>10.1f} MB  (peak {:.1f} MB)", memoryCategoryName(category), mMemoryTracker.current(category) / kMB, mMemoryTracker.peak(category) / kMB);
+    }
+
+    VkDeviceSize vertexBytes = 0, indexBytes = 0, attributeBytes = 0, triangleMaterialBytes = 0;
+    for (const auto& mesh : mScene.mMeshes) {
+        vertexBytes += mesh.mVertexRange.mSize;
+        indexBytes += mesh.mIndexRange.mSize;
+        attributeBytes += mesh.mAttributeRange.mSize;
+        triangleMaterialBytes += mesh.mTriangleMaterialRange.mSize;
+    }
+    fmt::println("  geometry arena: {:.1f} MB used of {:.1f} MB in {} blocks (vertices {:.1f} MB, indices {:.1f} MB, attributes {:.1f} MB, triangle materials {:.1f} MB)",
+        mGeometryArena.usedSize() / kMB, mGeometryArena.size() / kMB, mGeometryArena.blockCount(),
+        vertexBytes / kMB, indexBytes / kMB, attributeBytes / kMB, triangleMaterialBytes / kMB);
+
+    const VkPhysicalDeviceMemoryProperties* memoryProperties;
+    vmaGetMemoryProperties(mVmaAllocator, &memoryProperties);
+    std::array<VmaBudget, VK_MAX_MEMORY_HEAPS> budgets;
+    vmaGetHeapBudgets(mVmaAllocator, budgets.data());
+    for (uint32_t i = 0; i < memoryProperties->memoryHeapCount; ++i) {
+        const bool bDeviceLocal = memoryProperties->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+        fmt::println("  heap {}{}: {:.1f} MB used of {:.1f} MB budget{}", i, bDeviceLocal ? " (device local)" : "",
+            budgets[i].usage / kMB, budgets[i].budget / kMB, bMemoryBudget ? "" : " (estimated)");
+    }
+}
+
+// Writes the memory report as JSON: the categories, the heap budgets, and VMA's detailed statistics, whose
+// allocations are named after their category.
+bool VulkanApp::writeMemoryReport(const fs::path& path)
+{
+    std::ofstream file(path);
+    if (!file) {
+        fmt::println("Error: could not open memory report {}", path.string());
+        return false;
+    }
+
+    std::string json = "{\n  \"categories\": {";
+    for (uint32_t i = 0; i < static_cast<uint32_t>(MemoryCategory::Count); ++i) {
+        const auto category = static_cast<MemoryCategory>(i);
+        json += fmt::format("{}\n    \"{}\": {{ \"bytes\": {}, \"peakBytes\": {} }}", i > 0 ? "," : "",
+            memoryCategoryName(category), mMemoryTracker.current(category), mMemoryTracker.peak(category));
+    }
+    json += "\n  },\n  \"heaps\": [";
+
+    const VkPhysicalDeviceMemoryProperties* memoryProperties;
+    vmaGetMemoryProperties(mVmaAllocator, &memoryProperties);
+    std::array<VmaBudget, VK_MAX_MEMORY_HEAPS> budgets;
+    vmaGetHeapBudgets(mVmaAllocator, budgets.data());
+    for (uint32_t i = 0; i < memoryProperties->memoryHeapCount; ++i) {
+        json += fmt::format("{}\n    {{ \"size\": {}, \"deviceLocal\": {}, \"usage\": {}, \"budget\": {} }}", i > 0 ? "," : "",
+            memoryProperties->memoryHeaps[i].size, (memoryProperties->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0,
+            budgets[i].usage, budgets[i].budget);
+    }
+    json += fmt::format("\n  ],\n  \"budgetExtension\": {},\n  \"vma\": ", bMemoryBudget);
+
+    char* vmaStats = nullptr;
+    vmaBuildStatsString(mVmaAllocator, &vmaStats, VK_TRUE);
+    json += vmaStats;
+    vmaFreeStatsString(mVmaAllocator, vmaStats);
+    json += "\n}\n";
+
+    file << json;
+    return static_cast<bool>(file);
+}
+
+// Creates the GPU buffers of a mesh and fills them. Host-visible buffers are written directly (see createUploadBuffer).
+// Otherwise copies are recorded into the frame: from the mapped mesh cache when it can be imported (see
+// importHostMemory), or from staging memory. The mesh's mapped cache must be kept alive until the frame has finished.
+void VulkanApp::recordMeshUpload(UploadFrame& frame, ObjMesh& mesh)
+{
+    if (!mesh.reloadHostData()) { throw std::runtime_error("failed to reload mesh " + mesh.mPath.string()); }
+
+    const VkCommandBuffer cmd = frame.mTransferCmd;
+    const bool bCompact = mSpecializationData.vertexLayout == VERTEX_LAYOUT_COMPACT;
+    const auto vertices = mesh.vertices();
+    const auto indices = mesh.indices();
+
+    // In the compact layout the vertex buffer only stores positions (which is all the BLAS build reads),
+    // normals and uvs are packed into a separate attribute stream, and small meshes use 16-bit indices.
+    mesh.mIndexType = (bCompact && mesh.fitsIndex16()) ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+    const size_t vertexBufferSize = bCompact ? vertices.size() * sizeof(glm::vec3) : vertices.size_bytes();
+    const size_t attributeBufferSize = bCompact ? vertices.size() * sizeof(PackedVertexAttributes) : 0;
+    const size_t indexBufferSize = (mesh.mIndexType == VK_INDEX_TYPE_UINT16) ? alignUp(indices.size() * sizeof(uint16_t), sizeof(uint32_t)) : indices.size_bytes();
+    const auto triangleMaterials = mesh.triangleMaterials();
+    const size_t triangleMaterialBufferSize = triangleMaterials.size_bytes();
+
+    // Suballocate the geometry streams from the arena. The scene deleter frees the ranges (see uploadScene).
+    mesh.mVertexRange = mGeometryArena.allocate(vertexBufferSize);
+    mesh.mIndexRange = mGeometryArena.allocate(indexBufferSize);
+    mesh.mAttributeRange = mGeometryArena.allocate(attributeBufferSize);
+    mesh.mTriangleMaterialRange = mGeometryArena.allocate(triangleMaterialBufferSize);
+    std::vector<const BufferRange*> ranges = { &mesh.mVertexRange, &mesh.mIndexRange };
+    if (bCompact) { ranges.push_back(&mesh.mAttributeRange); }
+    if (triangleMaterialBufferSize > 0) { ranges.push_back(&mesh.mTriangleMaterialRange); }
+
+    // Writes the buffer contents, converting to the compact layout if needed.
+    const auto writeMeshData = [&](char* vertexData, char* indexData, char* attributeData, char* triangleMaterialData) {
+        if (bCompact) {
+            auto* positions = reinterpret_cast<glm::vec3*>(vertexData);
+            auto* attributes = reinterpret_cast<PackedVertexAttributes*>(attributeData);
+            for (size_t i = 0; i < vertices.size(); ++i) {
+                positions[i] = vertices[i].position;
+                attributes[i] = packVertexAttributes(vertices[i]);
+            }
+        }
+        else {
+            memcpy(vertexData, vertices.data(), vertexBufferSize);
+        }
+        if (mesh.mIndexType == VK_INDEX_TYPE_UINT16) {
+            auto* indices16 = reinterpret_cast<uint16_t*>(indexData);
+            std::fill_n(indices16, indexBufferSize / sizeof(uint16_t), uint16_t(0));
+            std::copy(indices.begin(), indices.end(), indices16);
+        }
+        else {
+            memcpy(indexData, indices.data(), indexBufferSize);
+        }
+        if (triangleMaterialBufferSize > 0) {
+            memcpy(triangleMaterialData, triangleMaterials.data(), triangleMaterialBufferSize);
+        }
+    };
+
+    // Unified memory: write straight into the arena. The queue submission makes the writes visible to the BLAS build.
+    if (std::all_of(ranges.begin(), ranges.end(), [](const BufferRange* r) { return r->mMapped != nullptr; })) {
+        writeMeshData(
+            static_cast<char*>(mesh.mVertexRange.mMapped),
+            static_cast<char*>(mesh.mIndexRange.mMapped),
+            static_cast<char*>(mesh.mAttributeRange.mMapped),
+            static_cast<char*>(mesh.mTriangleMaterialRange.mMapped));
+        for (const BufferRange* range : ranges) { mGeometryArena.flush(*range); }
+        return;
+    }
+    frame.bArenaWrites = true;
+
+    // The standard layout uploads the cached vertices, indices and triangle materials unchanged. Their cache sections are
+    // page aligned and contiguous, so a single import of the mapped file covers all of them.
+    if (!bCompact && mesh.mCacheHeader) {
+        const MeshCacheHeader& header = *mesh.mCacheHeader;
+        const uint64_t begin = header.vertexOffset;
+        const uint64_t end = alignUp(triangleMaterialBufferSize > 0 ? header.triangleMaterialOffset + triangleMaterialBufferSize : header.indexOffset + indexBufferSize, kMeshCacheAlignment);
+        ImportedHostBuffer importedBuffer;
+        if (end <= mesh.mCacheFile.size() && importHostMemory(mesh.mCacheFile.data() + begin, end - begin, importedBuffer)) {
+            frame.mImportedBuffers.push_back(importedBuffer);
+            const VkBufferCopy vertexCopy{ .srcOffset = 0, .dstOffset = mesh.mVertexRange.mOffset, .size = vertexBufferSize };
+            vkCmdCopyBuffer(cmd, importedBuffer.mBuffer, mesh.mVertexRange.mBuffer, 1, &vertexCopy);
+            const VkBufferCopy indexCopy{ .srcOffset = header.indexOffset - begin, .dstOffset = mesh.mIndexRange.mOffset, .size = indexBufferSize };
+            vkCmdCopyBuffer(cmd, importedBuffer.mBuffer, mesh.mIndexRange.mBuffer, 1, &indexCopy);
+            if (triangleMaterialBufferSize > 0) {
+                const VkBufferCopy triangleMaterialCopy{ .srcOffset = header.triangleMaterialOffset - begin, .dstOffset = mesh.mTriangleMaterialRange.mOffset, .size = triangleMaterialBufferSize };
+                vkCmdCopyBuffer(cmd, importedBuffer.mBuffer, mesh.mTriangleMaterialRange.mBuffer, 1, &triangleMaterialCopy);
+            }
+            return;
+        }
+    }
+
+    // Copy mesh data to staging memory (straight from the mapped mesh cache when the mesh was loaded from it).
+    // Layout: vertices | indices | attributes | triangle materials.
+    const auto staging = allocateStaging(frame, vertexBufferSize + indexBufferSize + attributeBufferSize + triangleMaterialBufferSize);
+    char* data = static_cast<char*>(staging.data);
+    writeMeshData(data, data + vertexBufferSize, data + vertexBufferSize + indexBufferSize, data + vertexBufferSize + indexBufferSize + attributeBufferSize);
+
+    // Transfer mesh data to the arena.
+    VkBufferCopy vertexCopy;
+    vertexCopy.dstOffset = mesh.mVertexRange.mOffset;
+    vertexCopy.srcOffset = staging.offset;
+    vertexCopy.size      = vertexBufferSize;
+    vkCmdCopyBuffer(cmd, staging.buffer, mesh.mVertexRange.mBuffer, 1, &vertexCopy);
+
+    VkBufferCopy indexCopy;
+    indexCopy.dstOffset = mesh.mIndexRange.mOffset;
+    indexCopy.srcOffset = staging.offset + vertexBufferSize;
+    indexCopy.size = indexBufferSize;
+    vkCmdCopyBuffer(cmd, staging.buffer, mesh.mIndexRange.mBuffer, 1, &indexCopy);
+
+    if (bCompact) {
+        const VkBufferCopy attributeCopy{ .srcOffset = staging.offset + vertexBufferSize + indexBufferSize, .dstOffset = mesh.mAttributeRange.mOffset, .size = attributeBufferSize };
+        vkCmdCopyBuffer(cmd, staging.buffer, mesh.mAttributeRange.mBuffer, 1, &attributeCopy);
+    }
+
+    if (triangleMaterialBufferSize > 0) {
+        const VkBufferCopy triangleMaterialCopy{ .srcOffset = staging.offset + vertexBufferSize + indexBufferSize + attributeBufferSize, .dstOffset = mesh.mTriangleMaterialRange.mOffset, .size = triangleMaterialBufferSize };
+        vkCmdCopyBuffer(cmd, staging.buffer, mesh.mTriangleMaterialRange.mBuffer, 1, &triangleMaterialCopy);
+    }
+}
+
+// Hands the buffers and images written by the frame's copies over to the compute queue. With a dedicated transfer queue
+// this is a queue family ownership transfer: a release in the transfer commands, and a matching acquire in the compute
+// commands, which wait for the transfer submission's semaphore (see submitUploadFrame). Otherwise it is a plain barrier.
+// Images also move from TRANSFER_DST_OPTIMAL to SHADER_READ_ONLY_OPTIMAL. The geometry arena is shared concurrently
+// between the queues, so its writes need no ownership transfer: the semaphore makes them visible, or a global barrier.
+void VulkanApp::recordUploadHandoff(UploadFrame& frame)
+{
+    if (frame.mReleasedBuffers.empty() && frame.mReleasedImages.empty() && !frame.bArenaWrites) { return; }
+
+    const bool bTransferQueue = frame.mTransferCmd != frame.mCmd;
+    const uint32_t srcQueueFamily = bTransferQueue ? mTransferQueueFamily : VK_QUEUE_FAMILY_IGNORED;
+    const uint32_t dstQueueFamily = bTransferQueue ? mComputeQueueFamily : VK_QUEUE_FAMILY_IGNORED;
+
+    std::vector<VkBufferMemoryBarrier2> bufferBarriers;
+    for (const VkBuffer buffer : frame.mReleasedBuffers) {
+        bufferBarriers.push_back({
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+            .srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+            .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .dstStageMask = kUploadConsumerStages,
+            .dstAccessMask = VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_2_SHADER_READ_BIT,
+            .srcQueueFamilyIndex = srcQueueFamily,
+            .dstQueueFamilyIndex = dstQueueFamily,
+            .buffer = buffer,
+            .offset = 0,
+            .size = VK_WHOLE_SIZE });
+    }
+    std::vector<VkImageMemoryBarrier2> imageBarriers;
+    for (const VkImage image : frame.mReleasedImages) {
+        imageBarriers.push_back({
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+            .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .dstAccessMask = VK_ACCESS_2_SHADER_READ_BIT,
+            .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            .srcQueueFamilyIndex = srcQueueFamily,
+            .dstQueueFamilyIndex = dstQueueFamily,
+            .image = image,
+            .subresourceRange = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .levelCount = VK_REMAINING_MIP_LEVELS, .layerCount = VK_REMAINING_ARRAY_LAYERS } });
+    }
+    const VkMemoryBarrier2 arenaBarrier{
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        .srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+        .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        .dstStageMask = kUploadConsumerStages,
+        .dstAccessMask = VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_2_SHADER_READ_BIT
+    };
+    const bool bArenaBarrier = frame.bArenaWrites && !bTransferQueue;
+    frame.mReleasedBuffers.clear();
+    frame.mReleasedImages.clear();
+    frame.bArenaWrites = false;
+    if (bufferBarriers.empty() && imageBarriers.empty() && !bArenaBarrier) { return; }
+
+    const VkDependencyInfo dependency{
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .memoryBarrierCount = bArenaBarrier ? 1u : 0u,
+        .pMemoryBarriers = &arenaBarrier,
+        .bufferMemoryBarrierCount = static_cast<uint32_t>(bufferBarriers.size()),
+        .pBufferMemoryBarriers = bufferBarriers.data(),
+        .imageMemoryBarrierCount = static_cast<uint32_t>(imageBarriers.size()),
+        .pImageMemoryBarriers = imageBarriers.data()
+    };
+    if (!bTransferQueue) {
+        vkCmdPipelineBarrier2(frame.mCmd, &dependency);
+        return;
     }
 
+    // Release: only the source half of the barriers applies on the transfer queue.
+    for (auto& barrier : bufferBarriers) { barrier.dstStageMask = VK_PIPELINE_STAGE_2_NONE; barrier.dstAccessMask = VK_ACCESS_2_NONE; }
+    for (auto& barrier : imageBarriers) { barrier.dstStageMask = VK_PIPELINE_STAGE_2_NONE; barrier.dstAccessMask = VK_ACCESS_2_NONE; }
+    vkCmdPipelineBarrier2(frame.mTransferCmd, &dependency);
+
+    // Acquire: only the destination half applies. Its source stages chain with the semaphore wait.
+    for (auto& barrier : bufferBarriers) {
+        barrier.srcStageMask = kUploadConsumerStages; barrier.srcAccessMask = VK_ACCESS_2_NONE;
+        barrier.dstStageMask = kUploadConsumerStages; barrier.dstAccessMask = VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_2_SHADER_READ_BIT;
+    }
+    for (auto& barrier : imageBarriers) {
+        barrier.srcStageMask = kUploadConsumerStages; barrier.srcAccessMask = VK_ACCESS_2_NONE;
+        barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT; barrier.dstAccessMask = VK_ACCESS_2_SHADER_READ_BIT;
+    }
+    vkCmdPipelineBarrier2(frame.mCmd, &dependency);
+}
+
+// Records the BLAS builds of the meshes whose copies were recorded into the frame, after handing their buffers over
+// to the compute queue. Each build gets its own scratch buffer, so the builds of a frame can overlap.
+void VulkanApp::recordPendingBlasBuilds(UploadFrame& frame)
+{
+    if (frame.mPendingBuilds.empty()) { return; }
+
+    recordUploadHandoff(frame);
+
+    for (const uint32_t meshID : frame.mPendingBuilds) {
+        recordMeshBlasBuild(frame.mCmd, mScene.mMeshes[meshID], frame.mScratchBuffers.emplace_back());
+    }
+    frame.mPendingBuilds.clear();
+}
+
+// Returns staging memory for an upload recorded into the frame. Uploads are packed into the staging ring; when it is
+// full the frames in flight are retired first, and an upload that still doesn't fit gets a dedicated buffer.
+StagingRing::Allocation VulkanApp::allocateStaging(UploadFrame& frame, VkDeviceSize size)
+{
+    constexpr VkDeviceSize kAlignment = 16;
+    StagingRing::Allocation allocation;
+    if (mStagingRing.allocate(size, kAlignment, allocation)) { return allocation; }
+    retireUploadFrames();
+    if (mStagingRing.allocate(size, kAlignment, allocation)) { return allocation; }
+
+    const AllocatedBuffer& buffer = frame.mStagingBuffers.emplace_back(
+        createHostVisibleStagingBuffer(mVmaAllocator, size, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT));
+    trackAllocation(MemoryCategory::Staging, buffer.mAllocation);
+    return { buffer.mBuffer, 0, buffer.mAllocInfo.pMappedData };
+}
+
+// Waits for a previous use of the frame and starts recording into it.
+void VulkanApp::beginUploadFrame(UploadFrame& frame)
+{
+    waitUploadFrame(frame);
+    VK_CHECK(vkResetFences(mDevice, 1, &frame.mFence));
+    VkCommandBufferBeginInfo cmdBeginInfo = { .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+    cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK(vkResetCommandBuffer(frame.mCmd, 0));
+    VK_CHECK(vkBeginCommandBuffer(frame.mCmd, &cmdBeginInfo));
+    if (frame.mTransferCmd != frame.mCmd) {
+        VK_CHECK(vkResetCommandBuffer(frame.mTransferCmd, 0));
+        VK_CHECK(vkBeginCommandBuffer(frame.mTransferCmd, &cmdBeginInfo));
+    }
+}
+
+// Records the frame's pending BLAS builds and submits it without waiting. With a dedicated transfer queue the copies
+// are submitted there first, and the compute commands wait on them through the frame's semaphore.
+// The compute submission's fence covers both, as it can't complete before the copies.
+void VulkanApp::submitUploadFrame(UploadFrame& frame)
+{
+    recordPendingImageCopies(frame);
+    recordPendingBlasBuilds(frame);
+    recordUploadHandoff(frame);
+
+    VkSemaphoreSubmitInfo transferDone = { .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+    transferDone.semaphore = frame.mTransferSemaphore;
+    transferDone.stageMask = kUploadConsumerStages;
+    const bool bTransferQueue = frame.mTransferCmd != frame.mCmd;
+    if (bTransferQueue) {
+        VK_CHECK(vkEndCommandBuffer(frame.mTransferCmd));
+        VkCommandBufferSubmitInfo transferCmdInfo = { .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO };
+        transferCmdInfo.commandBuffer = frame.mTransferCmd;
+        VkSemaphoreSubmitInfo signal = transferDone;
+        signal.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+        VkSubmitInfo2 transferSubmit = { .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2 };
+        transferSubmit.commandBufferInfoCount = 1;
+        transferSubmit.pCommandBufferInfos = &transferCmdInfo;
+        transferSubmit.signalSemaphoreInfoCount = 1;
+        transferSubmit.pSignalSemaphoreInfos = &signal;
+        VK_CHECK(vkQueueSubmit2(mTransferQueue, 1, &transferSubmit, VK_NULL_HANDLE));
+    }
+
+    VK_CHECK(vkEndCommandBuffer(frame.mCmd));
+    VkCommandBufferSubmitInfo cmdinfo = { .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO };
+    cmdinfo.commandBuffer = frame.mCmd;
+    VkSubmitInfo2 submit = { .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2 };
+    submit.waitSemaphoreInfoCount = bTransferQueue ? 1 : 0;
+    submit.pWaitSemaphoreInfos = &transferDone;
+    submit.commandBufferInfoCount = 1;
+    submit.pCommandBufferInfos = &cmdinfo;
+    VK_CHECK(vkQueueSubmit2(mComputeQueue, 1, &submit, frame.mFence));
+    frame.mStagingRingEnd = mStagingRing.head();
+    frame.mSubmitIndex = mUploadSubmitCount++;
+    frame.bInFlight = true;
+}
+
+// Waits for all frames in flight, oldest first so the staging ring is released in order.
+void VulkanApp::retireUploadFrames()
+{
+    std::array<UploadFrame*, kUploadFramesInFlight> frames;
+    for (uint32_t i = 0; i < kUploadFramesInFlight; ++i) { frames[i] = &mUploadFrames[i]; }
+    std::sort(frames.begin(), frames.end(), [](const UploadFrame* a, const UploadFrame* b) { return a->mSubmitIndex < b->mSubmitIndex; });
+    for (UploadFrame* frame : frames) { waitUploadFrame(*frame); }
+}
+
+// Waits until the GPU is done with an upload frame, and releases its transient buffers.
+void VulkanApp::waitUploadFrame(UploadFrame& frame)
+{
+    if (!frame.bInFlight) { return; }
+    VK_CHECK(vkWaitForFences(mDevice, 1, &frame.mFence, true, 9999999999));
+    for (const auto& buffer : frame.mStagingBuffers) {
+        untrackAllocation(MemoryCategory::Staging, buffer.mAllocation);
+        vmaDestroyBuffer(mVmaAllocator, buffer.mBuffer, buffer.mAllocation);
+    }
+    for (const auto& buffer : frame.mScratchBuffers) {
+        untrackAllocation(MemoryCategory::Scratch, buffer.mAllocation);
+        vmaDestroyBuffer(mVmaAllocator, buffer.mBuffer, buffer.mAllocation);
+    }
+    for (const auto& buffer : frame.mImportedBuffers) {
+        vkDestroyBuffer(mDevice, buffer.mBuffer, nullptr);
+        vkFreeMemory(mDevice, buffer.mMemory, nullptr);
+    }
+    frame.mStagingBuffers.clear();
+    frame.mScratchBuffers.clear();
+    frame.mImportedBuffers.clear();
+    mStagingRing.release(frame.mStagingRingEnd);
+    frame.bInFlight = false;
+}
+
+// Starts reading the assets of mScene from disk on the thread pool. Needs no Vulkan state, so it is called before the
+// device is created and the loads overlap with device bring-up. uploadScene consumes the results.
+void VulkanApp::startSceneLoad()
+{
+    mLoadStart = std::chrono::steady_clock::now();
+
+    // Material libraries are only parsed for meshes that are instanced with their own materials.
+    std::vector<bool> bUsesMeshMaterials(mScene.mMeshes.size(), false);
+    for (const auto& instance : mScene.mMeshInstances) {
+        if (instance.materialID == kMeshMaterials) { bUsesMeshMaterials[instance.meshID] = true; }
+    }
+
+    // Start parsing every mesh. The pool works through them in scene order.
+    mMeshLoads.clear();
+    for (uint32_t i = 0; i < mScene.mMeshes.size(); ++i) {
+        mMeshLoads.push_back(ThreadPool::global().submit([&mesh = mScene.mMeshes[i], bMaterials = bUsesMeshMaterials[i]]() {
+            if (mesh.isLoaded()) { return; }    // Already imported, e.g. from a glTF file.
+            const auto start = std::chrono::steady_clock::now();
+            if (!mesh.loadFromFile(mesh.mPath)) {
+                throw std::runtime_error("failed to load mesh " + mesh.mPath.string());
+            }
+            if (bMaterials) { mesh.loadMaterialLibraries(); }
+            const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            fmt::println("Loaded {} ({} triangles, from {}) in {:.1f} ms", mesh.mPath.string(), mesh.indices().size() / 3, mesh.mCacheHeader ? "cache" : "obj", elapsed.count());
+            }));
+    }
+
+    // Decode the textures known so far. Those of mesh materials are only found once the meshes are loaded.
+    mTextureLoads.clear();
+    startTextureLoads();
+    bSceneLoadStarted = true;
+}
+
+// Starts loading the scene textures that aren't being loaded yet on the thread pool, from their texture caches or by
+// decoding and compressing the images (see loadTexture). A texture that can't be loaded is replaced by the white texture.
+// Waits for the asset loads that are still running, as they write into mScene, and drops them. Used when a scene is
+// abandoned before uploadScene has consumed its loads.
+void VulkanApp::waitSceneLoads()
+{
+    for (auto& load : mMeshLoads) {
+        if (load.valid()) { try { load.get(); } catch (const std::exception&) {} }
+    }
+    for (auto& load : mTextureLoads) {
+        if (load.valid()) { load.wait(); }
+    }
+    mMeshLoads.clear();
+    mTextureLoads.clear();
+    bSceneLoadStarted = false;
+}
+
+void VulkanApp::startTextureLoads()
+{
+    if (mScene.mTextures.size() >= MAX_TEXTURE_COUNT) {
+        throw std::runtime_error(fmt::format("scene has {} textures, at most {} are supported", mScene.mTextures.size(), MAX_TEXTURE_COUNT - 1));
+    }
+    for (size_t i = mTextureLoads.size(); i < mScene.mTextures.size(); ++i) {
+        mTextureLoads.push_back(ThreadPool::global().submit([path = mScene.mTextures[i]]() {
+            const auto start = std::chrono::steady_clock::now();
+            TextureData texture = loadTexture(path);
+            if (texture) {
+                const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                fmt::println("Loaded {} ({}x{}, from {}) in {:.1f} ms", path.string(), texture.width, texture.height, texture.cacheFile ? "cache" : "image", elapsed.count());
+            }
+            return texture;
+            }));
+    }
+}
+
+// Uploads all scene geometry into GPU buffers and builds the mesh BLASes as the meshes finish loading, then uploads the
+// materials and the textures. Uploads are staged through mStagingRing and batched into a ring of kUploadFramesInFlight
+// command buffers: a frame takes meshes, or textures, until its staging budget is used or the next one is still loading,
+// then it is submitted without waiting. Textures are taken in the order their loads complete. There is a single wait at
+// the end, before the texture mip chains are generated. Returns false if a mesh could not be loaded.
+bool VulkanApp::uploadScene()
+{
+    if (!bSceneLoadStarted) { startSceneLoad(); }
+
+    // The mesh BLASes may be moved by defragment, so they are read from the meshes when the scene is unloaded.
+    mSceneDeletionQueue.push_function([&]() {
+        for (auto& mesh : mScene.mMeshes) {
+            if (mesh.mBlas.mHandle) {
+                vkDestroyAccelerationStructureKHR(mDevice, mesh.mBlas.mHandle, nullptr);
+                untrackAllocation(MemoryCategory::Blas, mesh.mBlas.mData.mAllocation);
+                vmaDestroyBuffer(mVmaAllocator, mesh.mBlas.mData.mBuffer, mesh.mBlas.mData.mAllocation);
+                mesh.mBlas = {};
+            }
+            mGeometryArena.free(mesh.mVertexRange);
+            mGeometryArena.free(mesh.mAttributeRange);
+            mGeometryArena.free(mesh.mIndexRange);
+            mGeometryArena.free(mesh.mTriangleMaterialRange);
+        }
+    });
+
+    // Stage, upload and build each mesh as soon as it has been parsed.
+    constexpr VkDeviceSize kFrameStagingBudget = kStagingRingSize / kUploadFramesInFlight;
+    std::unordered_map<uint64_t, uint32_t> uploadedByHash;
+    uint32_t frameIndex = 0;
+    UploadFrame* frame = nullptr;
+    uint64_t frameStagingStart = 0;
+    const auto beginFrame = [&]() {
+        frame = &mUploadFrames[frameIndex++ % mUploadFrames.size()];
+        beginUploadFrame(*frame);
+        frameStagingStart = mStagingRing.head();
+    };
+    for (uint32_t i = 0; i < mScene.mMeshes.size(); ++i)
+    {
+        try {
+            mMeshLoads[i].get();
+        }
+        catch (const std::exception& e) {
+            fmt::println("Error: {}", e.what());
+
+            // The other loads write into the scene, and the recorded uploads into its buffers: let them all finish, so
+            // that the scene can be unloaded or cleaned up.
+            waitSceneLoads();
+            if (frame) { submitUploadFrame(*frame); }
+            retireUploadFrames();
+            return false;
+        }
+        ObjMesh& mesh = mScene.mMeshes[i];
+
+        // Meshes with identical content and materials are merged by deduplicateMeshes below, so only upload the first one.
+        if (!uploadedByHash.try_emplace(mesh.assetKey(), i).second) { continue; }
+
+        if (!frame) { beginFrame(); }
+        recordMeshUpload(*frame, mesh);
+        frame->mPendingBuilds.push_back(i);
+
+        // Keep the GPU busy rather than wait for the next mesh to load.
+        const bool bNextMeshLoading = i + 1 < mMeshLoads.size() && mMeshLoads[i + 1].wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+        if (bNextMeshLoading || mStagingRing.head() - frameStagingStart >= kFrameStagingBudget) {
+            submitUploadFrame(*frame);
+            frame = nullptr;
+        }
+    }
+    if (!frame) { beginFrame(); }
+    recordPendingBlasBuilds(*frame);    // Before deduplicateMeshes moves the meshes.
+
+    deduplicateMeshes(mScene);
+    resolveMeshMaterials(mScene);
+    fmt::println("Scene has {} unique meshes and {} mesh instances", mScene.mMeshes.size(), mScene.mMeshInstances.size());
+    fmt::println("Loaded scene {} in {:.1f} ms", mScene.mName, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - mLoadStart).count());
+    mMeshLoads.clear();
+    bSceneLoadStarted = false;
+
     // Upload materials.
     {
         const auto materialsBufferSize = mScene.mMaterials.size() * sizeof(Material);
 
         // Create GPU buffer for the scene materials.
-        const VkBufferCreateInfo deviceBufferCreateInfo{
-            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-            .size = materialsBufferSize,
-            .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-            .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-        };
-        const VmaAllocationCreateInfo deviceBufferAllocInfo{ .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, };
-        VK_CHECK(vmaCreateBuffer(mVmaAllocator, &deviceBufferCreateInfo, &deviceBufferAllocInfo, &mScene.mMaterialsBuffer.mBuffer, &mScene.mMaterialsBuffer.mAllocation, &mScene.mMaterialsBuffer.mAllocInfo));
-        mDeletionQueue.push_function([&]() {vmaDestroyBuffer(mVmaAllocator, mScene.mMaterialsBuffer.mBuffer, mScene.mMaterialsBuffer.mAllocation);});
-
-        // Create a staging buffer.
-        AllocatedBuffer materialsStagingBuffer;
-        const VkBufferCreateInfo stagingbufferCreateInfo{
-                .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-                .size = materialsBufferSize,
-                .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-        };
-        const VmaAllocationCreateInfo stagingBufferAllocInfo{
-                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
-                .usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
-                .requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
-        };
-        VK_CHECK(vmaCreateBuffer(mVmaAllocator, &stagingbufferCreateInfo, &stagingBufferAllocInfo, &materialsStagingBuffer.mBuffer, &materialsStagingBuffer.mAllocation, &materialsStagingBuffer.mAllocInfo));
-
-        // Copy material data to staging buffer.
-        void* sdata;
-        vmaMapMemory(mVmaAllocator, materialsStagingBuffer.mAllocation, (void**)&sdata);
-        memcpy(sdata, mScene.mMaterials.data(), mScene.mMaterials.size() * sizeof(Material));
-        vmaUnmapMemory(mVmaAllocator, materialsStagingBuffer.mAllocation);
-
-        // Transfer material data from staging buffer to gpu buffer.
-        immediateSubmit([&](VkCommandBuffer cmd) {
-            const VkBufferCopy copy{ .srcOffset = 0, .dstOffset = 0, .size = materialsBufferSize };
-            vkCmdCopyBuffer(cmd, materialsStagingBuffer.mBuffer, mScene.mMaterialsBuffer.mBuffer, 1, &copy);
+        mScene.mMaterialsBuffer = createUploadBuffer(materialsBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, MemoryCategory::SceneData);
+        mSceneDeletionQueue.push_function([&]() {
+            untrackAllocation(MemoryCategory::SceneData, mScene.mMaterialsBuffer.mAllocation);
+            vmaDestroyBuffer(mVmaAllocator, mScene.mMaterialsBuffer.mBuffer, mScene.mMaterialsBuffer.mAllocation);
             });
 
-        // No longer need staging buffer.
-        vmaDestroyBuffer(mVmaAllocator, materialsStagingBuffer.mBuffer, materialsStagingBuffer.mAllocation);
+        // Write the materials in place if the buffer is host-visible, otherwise copy them through staging memory.
+        if (void* mapped = mScene.mMaterialsBuffer.mAllocInfo.pMappedData) {
+            memcpy(mapped, mScene.mMaterials.data(), materialsBufferSize);
+            flushUploadBuffer(mScene.mMaterialsBuffer);
+        }
+        else {
+            const auto staging = allocateStaging(*frame, materialsBufferSize);
+            memcpy(staging.data, mScene.mMaterials.data(), materialsBufferSize);
+            const VkBufferCopy copy{ .srcOffset = staging.offset, .dstOffset = 0, .size = materialsBufferSize };
+            vkCmdCopyBuffer(frame->mTransferCmd, staging.buffer, mScene.mMaterialsBuffer.mBuffer, 1, &copy);
+            frame->mReleasedBuffers.push_back(mScene.mMaterialsBuffer.mBuffer);
+        }
     }
 
-    // Upload Textures 
+    // Upload the mesh table: the geometry addresses of each mesh, indexed by the mesh ID in the instance records.
     {
-        stbi_set_flip_vertically_on_load(true);
-        stbi_uc* pixels = stbi_load("assets/textures/statue.jpg", reinterpret_cast<int*>(&mTextureExtents.width), reinterpret_cast<int*>(&mTextureExtents.height), nullptr, STBI_rgb_alpha);
-        mTextureByteSize = mTextureExtents.width * mTextureExtents.height * 4;
-        if (!pixels) {
-            throw std::runtime_error("failed to load texture image!");
+        const std::vector<MeshRecord> meshTable = buildMeshTable();
+        const VkDeviceSize meshTableSize = meshTable.size() * sizeof(MeshRecord);
+
+        mMeshTableBuffer = createUploadBuffer(meshTableSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, MemoryCategory::SceneData);
+        mSceneDeletionQueue.push_function([&]() {
+            untrackAllocation(MemoryCategory::SceneData, mMeshTableBuffer.mAllocation);
+            vmaDestroyBuffer(mVmaAllocator, mMeshTableBuffer.mBuffer, mMeshTableBuffer.mAllocation);
+            mMeshTableBuffer = {};
+            });
+
+        if (void* mapped = mMeshTableBuffer.mAllocInfo.pMappedData) {
+            memcpy(mapped, meshTable.data(), meshTableSize);
+            flushUploadBuffer(mMeshTableBuffer);
         }
+        else {
+            const auto staging = allocateStaging(*frame, meshTableSize);
+            memcpy(staging.data, meshTable.data(), meshTableSize);
+            const VkBufferCopy copy{ .srcOffset = staging.offset, .dstOffset = 0, .size = meshTableSize };
+            vkCmdCopyBuffer(frame->mTransferCmd, staging.buffer, mMeshTableBuffer.mBuffer, 1, &copy);
+            frame->mReleasedBuffers.push_back(mMeshTableBuffer.mBuffer);
+        }
+    }
 
-        // Copy pixel data to a staging buffer (apparently using a staging buffer is faster than a staging image)
-        AllocatedBuffer imageStagingBuffer = createHostVisibleStagingBuffer(mVmaAllocator, mTextureByteSize);
-
-        void* data;
-        vmaMapMemory(mVmaAllocator, imageStagingBuffer.mAllocation, (void**)&data);
-        memcpy(data, pixels, mTextureByteSize);
-        vmaUnmapMemory(mVmaAllocator, imageStagingBuffer.mAllocation);
-
-        stbi_image_free(pixels);
-
-        // Create an image to store texture data.
-        // Make sure to store the data in device-local memory.
-        const VkImageCreateInfo imageCreateInfo{
-            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-            .imageType = VK_IMAGE_TYPE_2D,
-            .format = VK_FORMAT_R8G8B8A8_SRGB,
-            .extent = {mTextureExtents.width, mTextureExtents.height, 1} ,
-            .mipLevels = 1,  
-            .arrayLayers = 1,
-            .samples = VK_SAMPLE_COUNT_1_BIT,
-            .tiling = VK_IMAGE_TILING_OPTIMAL,  // Use a gpu-friendly texel layout.
-            .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
-        };
-        const VmaAllocationCreateInfo allocinfo = {
-            .usage          = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-            .requiredFlags  = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-        };
-        VK_CHECK(vmaCreateImage(mVmaAllocator, &imageCreateInfo, &allocinfo, &mTextureImage.mImage, &mTextureImage.mAllocation, nullptr));
-        mDeletionQueue.push_function([&]() {vmaDestroyImage(mVmaAllocator, mTextureImage.mImage, mTextureImage.mAllocation);});
-
-        // Create an image view for the image.
-        VkImageViewCreateInfo info = {};
-        info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-        info.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        info.image = mTextureImage.mImage;
-        info.format = VK_FORMAT_R8G8B8A8_SRGB;
-        info.subresourceRange = { 
-            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .baseMipLevel = 0, .levelCount = 1,
-            .baseArrayLayer = 0,.layerCount = 1 };
-
-        VK_CHECK(vkCreateImageView(mDevice, &info, nullptr, &mTextureImageView));
-        mDeletionQueue.push_function([&]() {vkDestroyImageView(mDevice, mTextureImageView, nullptr);});
-
-
-        // Transition the image layout into VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL for copying from staging buffer.
-        // Then copy data from the staging buffer to the device.
-        // Then transition the image layout into VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL for sampling from shader.
-        immediateSubmit([&](VkCommandBuffer cmd) {
-            VkImageMemoryBarrier imageBarrier = {};
-            imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-            imageBarrier.srcAccessMask = 0;
-            imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-            imageBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-            imageBarrier.image = mTextureImage.mImage;
-            imageBarrier.subresourceRange = {
-                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                .baseMipLevel = 0,
-                .levelCount = 1,
-                .baseArrayLayer = 0,
-                .layerCount = 1 };
-
-            vkCmdPipelineBarrier(cmd,
-                VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                VK_PIPELINE_STAGE_TRANSFER_BIT,
-                0,
-                0, nullptr,
-                0, nullptr,
-                1, &imageBarrier);
-
-            // Copy data from staging buffer to image.
-            VkBufferImageCopy region{};
-            region.bufferOffset = 0;
-            region.bufferRowLength = 0;
-            region.bufferImageHeight = 0;
-            region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-            region.imageSubresource.mipLevel = 0;
-            region.imageSubresource.baseArrayLayer = 0;
-            region.imageSubresource.layerCount = 1;
-            region.imageOffset = { 0, 0, 0 };
-            region.imageExtent = { mTextureExtents.width, mTextureExtents.height, 1 };
-
-            vkCmdCopyBufferToImage(cmd, imageStagingBuffer.mBuffer, mTextureImage.mImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-
-            VkImageMemoryBarrier imageBarrier2 = {};
-            imageBarrier2.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-            imageBarrier2.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            imageBarrier2.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-            imageBarrier2.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-            imageBarrier2.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-            imageBarrier2.image = mTextureImage.mImage;
-            imageBarrier2.subresourceRange = {
-                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                .baseMipLevel = 0,
-                .levelCount = 1,
-                .baseArrayLayer = 0,
-                .layerCount = 1 };
-
-            vkCmdPipelineBarrier(cmd,
-                VK_PIPELINE_STAGE_TRANSFER_BIT,
-                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                0,
-                0, nullptr,
-                0, nullptr,
-                1, &imageBarrier2);
+    // Upload the textures: the white texture of untextured materials, then the scene textures as their loads complete.
+    // The textures of mesh materials were registered by resolveMeshMaterials.
+    {
+        startTextureLoads();
+        mTextures.resize(mScene.mTextures.size() + 1);
+        mSceneDeletionQueue.push_function([&]() {
+            for (const auto& texture : mTextures) {
+                if (!texture.mImage.mImage) { continue; }
+                vkDestroyImageView(mDevice, texture.mImageView, nullptr);
+                untrackAllocation(MemoryCategory::Textures, texture.mImage.mAllocation);
+                vmaDestroyImage(mVmaAllocator, texture.mImage.mImage, texture.mImage.mAllocation);
+            }
+            mTextures.clear();
             });
 
-        vmaDestroyBuffer(mVmaAllocator, imageStagingBuffer.mBuffer, imageStagingBuffer.mAllocation);
+        static constexpr uint32_t kWhitePixel = 0xFFFFFFFF;
+        TextureData white{ .format = VK_FORMAT_R8G8B8A8_SRGB, .width = 1, .height = 1, .mipLevels = 1 };
+        white.bytes = std::as_bytes(std::span(&kWhitePixel, 1));
+        recordTextureUpload(*frame, mTextures[0], white);
+
+        std::vector<uint32_t> pending(mScene.mTextures.size());
+        std::iota(pending.begin(), pending.end(), 0);
+        while (!pending.empty()) {
+            auto next = std::find_if(pending.begin(), pending.end(), [&](uint32_t i) {
+                return mTextureLoads[i].wait_for(std::chrono::seconds(0)) == std::future_status::ready; });
+            if (next == pending.end()) {
+                // Nothing is loaded yet: keep the GPU busy with what is recorded, and help with the oldest load.
+                if (frame) {
+                    submitUploadFrame(*frame);
+                    frame = nullptr;
+                }
+                next = pending.begin();
+            }
+            const uint32_t i = *next;
+            pending.erase(next);
+
+            // The loaded data is released as soon as it is staged.
+            TextureData texture = ThreadPool::global().wait(mTextureLoads[i]);
+            if (texture.format == VK_FORMAT_BC1_RGB_SRGB_BLOCK && !bTextureCompressionBC) {
+                // Loaded before the device was selected: decode it again, uncompressed.
+                texture = loadTexture(mScene.mTextures[i]);
+            }
+            if (!frame) { beginFrame(); }
+            recordTextureUpload(*frame, mTextures[i + 1], texture ? texture : white);
+            if (mStagingRing.head() - frameStagingStart >= kFrameStagingBudget) {
+                submitUploadFrame(*frame);
+                frame = nullptr;
+            }
+        }
+        mTextureLoads.clear();
+    }
+
+    // The materials and textures are read by the first render, and the TLAS build reads the BLASes: wait once for all of it.
+    if (frame) { submitUploadFrame(*frame); }
+    retireUploadFrames();
+    generateMipmaps();
+
+    // Everything is on the GPU and the BLASes are built: only the geometry counts are needed from here on.
+    // The geometry can be re-read from the mesh caches if it has to be uploaded again.
+    if (ObjMesh::bReleaseHostData) {
+        const auto released = std::count_if(mScene.mMeshes.begin(), mScene.mMeshes.end(), [](ObjMesh& mesh) { return mesh.releaseHostData(); });
+        fmt::println("Released the host copies of {} of {} meshes", released, mScene.mMeshes.size());
     }
 
-    // Create sampler for the texture.
+    // Create the sampler for the textures. The shader selects the mip level itself (see rayConeTextureLod), so there
+    // is no anisotropic filtering.
     VkSamplerCreateInfo samplerInfo{};
     samplerInfo.sType           = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-    samplerInfo.magFilter       = VK_FILTER_NEAREST;
-    samplerInfo.minFilter       = VK_FILTER_NEAREST;
+    samplerInfo.magFilter       = VK_FILTER_LINEAR;
+    samplerInfo.minFilter       = VK_FILTER_LINEAR;
+    samplerInfo.mipmapMode      = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    samplerInfo.addressModeU    = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerInfo.addressModeV    = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerInfo.addressModeW    = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerInfo.minLod          = 0.0f;
+    samplerInfo.maxLod          = VK_LOD_CLAMP_NONE;
+    VK_CHECK(vkCreateSampler(mDevice, &samplerInfo, nullptr, &mTextureSampler));
+    mSceneDeletionQueue.push_function([&] {vkDestroySampler(mDevice, mTextureSampler, nullptr);});
+    return true;
+}
+
+// Creates a texture with a full mip chain and records the upload of the levels in data into the frame: all of them for
+// block-compressed textures, the top level of RGBA8 ones. The handoff leaves every level in SHADER_READ_ONLY_OPTIMAL; the
+// lower levels of RGBA8 textures are filled by generateMipmaps once the upload is complete.
+void VulkanApp::recordTextureUpload(UploadFrame& frame, Texture& texture, const TextureData& data)
+{
+    texture.mExtents = { data.width, data.height, 1 };
+    texture.mFormat = data.format;
+    texture.mMipLevels = static_cast<uint32_t>(std::bit_width(std::max(data.width, data.height)));
+    const bool bGenerateMips = data.mipLevels < texture.mMipLevels;
+    VkDeviceSize imageSize = 0;
+    for (uint32_t level = 0; level < texture.mMipLevels; ++level) {
+        imageSize += textureLevelSize(texture.mFormat, data.width, data.height, level);
+    }
+
+    // Copy the levels to staging memory (apparently using a staging buffer is faster than a staging image).
+    // Unlike buffers, textures are staged on unified memory devices too: the host can't write optimal tiling.
+    const auto staging = allocateStaging(frame, data.bytes.size());
+    memcpy(staging.data, data.bytes.data(), data.bytes.size());
+
+    // Generated mip levels are written by a compute shader through a UNORM view, as sRGB formats don't support storage.
+    const VkImageCreateInfo imageCreateInfo{
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .flags = bGenerateMips ? VkImageCreateFlags(VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT | VK_IMAGE_CREATE_EXTENDED_USAGE_BIT) : 0,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = texture.mFormat,
+        .extent = texture.mExtents,
+        .mipLevels = texture.mMipLevels,
+        .arrayLayers = 1,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .tiling = VK_IMAGE_TILING_OPTIMAL,  // Use a gpu-friendly texel layout.
+        .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | (bGenerateMips ? VK_IMAGE_USAGE_STORAGE_BIT : 0u),
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+    };
+    const VmaAllocationCreateInfo allocinfo = {
+        .usage          = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+        .requiredFlags  = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+    };
+    checkMemoryBudget(MemoryCategory::Textures, imageSize);
+    VK_CHECK(vmaCreateImage(mVmaAllocator, &imageCreateInfo, &allocinfo, &texture.mImage.mImage, &texture.mImage.mAllocation, nullptr));
+    trackAllocation(MemoryCategory::Textures, texture.mImage.mAllocation);
+
+    // Create an image view of the whole mip chain, for sampling.
+    const VkImageViewUsageCreateInfo viewUsage{ .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_USAGE_CREATE_INFO, .usage = VK_IMAGE_USAGE_SAMPLED_BIT };
+    const VkImageViewCreateInfo viewInfo{
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .pNext = bGenerateMips ? &viewUsage : nullptr,
+        .image = texture.mImage.mImage,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = texture.mFormat,
+        .subresourceRange = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .baseMipLevel = 0, .levelCount = texture.mMipLevels, .baseArrayLayer = 0, .layerCount = 1 }
+    };
+    VK_CHECK(vkCreateImageView(mDevice, &viewInfo, nullptr, &texture.mImageView));
+
+    // Copy the uploaded levels from the staging buffer, in the batch of the frame's image copies.
+    frame.mPendingImageCopies.push_back({ staging.buffer, texture.mImage.mImage, std::vector<VkBufferImageCopy>(data.mipLevels) });
+    PendingImageCopy& copy = frame.mPendingImageCopies.back();
+    VkDeviceSize offset = 0;
+    for (uint32_t level = 0; level < data.mipLevels; ++level) {
+        VkBufferImageCopy& region = copy.mRegions[level];
+        region.bufferOffset = staging.offset + offset;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = level;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageExtent = { std::max(data.width >> level, 1u), std::max(data.height >> level, 1u), 1 };
+        offset += textureLevelSize(texture.mFormat, data.width, data.height, level);
+    }
+}
+
+// Records the frame's texture copies: one barrier moves all their images into VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, then
+// the copies follow back to back. The handoff to the compute queue then transitions the images into
+// VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
+void VulkanApp::recordPendingImageCopies(UploadFrame& frame)
+{
+    if (frame.mPendingImageCopies.empty()) { return; }
+
+    std::vector<VkImageMemoryBarrier2> imageBarriers;
+    for (const auto& copy : frame.mPendingImageCopies) {
+        imageBarriers.push_back({
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .srcStageMask = VK_PIPELINE_STAGE_2_NONE,          // New images: nothing to wait for.
+            .srcAccessMask = VK_ACCESS_2_NONE,
+            .dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+            .dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = copy.mImage,
+            .subresourceRange = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .levelCount = VK_REMAINING_MIP_LEVELS, .layerCount = 1 } });
+    }
+    const VkDependencyInfo dependency{
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .imageMemoryBarrierCount = static_cast<uint32_t>(imageBarriers.size()),
+        .pImageMemoryBarriers = imageBarriers.data()
+    };
+    vkCmdPipelineBarrier2(frame.mTransferCmd, &dependency);
+
+    for (const auto& copy : frame.mPendingImageCopies) {
+        vkCmdCopyBufferToImage(frame.mTransferCmd, copy.mBuffer, copy.mImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(copy.mRegions.size()), copy.mRegions.data());
+        frame.mReleasedImages.push_back(copy.mImage);
+    }
+    frame.mPendingImageCopies.clear();
+}
+
+// Fills the mip chains of the RGBA8 textures from their top levels; block-compressed textures are uploaded with theirs.
+// Each level is filtered from the one above it by
+// shaders/mipmap.comp.glsl, in linear space. The same level of every texture is generated by one render graph pass, so
+// the dispatches of a pass overlap and there is one barrier per level.
+void VulkanApp::generateMipmaps()
+{
+    std::vector<const Texture*> textures;
+    uint32_t maxMipLevels = 1;
+    uint32_t generatedLevels = 0;
+    for (const auto& texture : mTextures) {
+        if (texture.mFormat != VK_FORMAT_R8G8B8A8_SRGB || texture.mMipLevels == 1) { continue; }
+        textures.push_back(&texture);
+        maxMipLevels = std::max(maxMipLevels, texture.mMipLevels);
+        generatedLevels += texture.mMipLevels - 1;
+    }
+    if (generatedLevels == 0) { return; }
+    if (mMipmapPipeline == VK_NULL_HANDLE) { initMipmapPipeline(); }
+
+    // A descriptor set per generated level: the level above through an sRGB view, and the level through a UNORM view.
+    const std::array<VkDescriptorPoolSize, 2> poolSizes{ {
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, generatedLevels },
+        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, generatedLevels } } };
+    const VkDescriptorPoolCreateInfo poolInfo{
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = generatedLevels,
+        .poolSizeCount = static_cast<uint32_t>(poolSizes.size()),
+        .pPoolSizes = poolSizes.data()
+    };
+    VkDescriptorPool pool;
+    VK_CHECK(vkCreateDescriptorPool(mDevice, &poolInfo, nullptr, &pool));
+
+    const std::vector<VkDescriptorSetLayout> setLayouts(generatedLevels, mMipmapSetLayout);
+    std::vector<VkDescriptorSet> sets(generatedLevels);
+    const VkDescriptorSetAllocateInfo setAllocInfo{
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = pool,
+        .descriptorSetCount = generatedLevels,
+        .pSetLayouts = setLayouts.data()
+    };
+    VK_CHECK(vkAllocateDescriptorSets(mDevice, &setAllocInfo, sets.data()));
+
+    // The views and graph states of each texture's levels. The states are sized up front: the graph keeps pointers to them.
+    std::vector<VkImageView> views;
+    std::vector<std::vector<RenderGraph::ResourceState>> levelStates(textures.size());
+    std::vector<std::vector<RenderGraph::ResourceID>> levels(textures.size());
+    std::vector<uint32_t> firstSet(textures.size());
+    mRenderGraph.reset();
+    for (uint32_t t = 0, set = 0; t < textures.size(); ++t) {
+        const Texture& texture = *textures[t];
+        levelStates[t].resize(texture.mMipLevels);
+        // The top level was made visible to compute shaders by the upload handoff. The others hold nothing yet.
+        levelStates[t][0] = {
+            .readStages = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .readAccesses = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+            .layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+        for (uint32_t level = 0; level < texture.mMipLevels; ++level) {
+            const VkImageSubresourceRange range{ .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .baseMipLevel = level, .levelCount = 1, .baseArrayLayer = 0, .layerCount = 1 };
+            levels[t].push_back(mRenderGraph.importImage(texture.mImage.mImage, range, levelStates[t][level]));
+        }
+
+        firstSet[t] = set;
+        for (uint32_t level = 1; level < texture.mMipLevels; ++level, ++set) {
+            const VkImageViewUsageCreateInfo srcUsage{ .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_USAGE_CREATE_INFO, .usage = VK_IMAGE_USAGE_SAMPLED_BIT };
+            const VkImageViewUsageCreateInfo dstUsage{ .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_USAGE_CREATE_INFO, .usage = VK_IMAGE_USAGE_STORAGE_BIT };
+            VkImageViewCreateInfo viewInfo{
+                .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                .pNext = &srcUsage,
+                .image = texture.mImage.mImage,
+                .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                .format = texture.mFormat,
+                .subresourceRange = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .baseMipLevel = level - 1, .levelCount = 1, .baseArrayLayer = 0, .layerCount = 1 }
+            };
+            VkImageView srcView, dstView;
+            VK_CHECK(vkCreateImageView(mDevice, &viewInfo, nullptr, &srcView));
+            viewInfo.pNext = &dstUsage;
+            viewInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+            viewInfo.subresourceRange.baseMipLevel = level;
+            VK_CHECK(vkCreateImageView(mDevice, &viewInfo, nullptr, &dstView));
+            views.push_back(srcView);
+            views.push_back(dstView);
+
+            const VkDescriptorImageInfo srcInfo{ .sampler = mMipmapSampler, .imageView = srcView, .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+            const VkDescriptorImageInfo dstInfo{ .imageView = dstView, .imageLayout = VK_IMAGE_LAYOUT_GENERAL };
+            const std::array<VkWriteDescriptorSet, 2> writes{ {
+                { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = sets[set], .dstBinding = 0, .descriptorCount = 1, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .pImageInfo = &srcInfo },
+                { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = sets[set], .dstBinding = 1, .descriptorCount = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .pImageInfo = &dstInfo } } };
+            vkUpdateDescriptorSets(mDevice, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+        }
+    }
+
+    for (uint32_t level = 1; level < maxMipLevels; ++level) {
+        std::vector<RenderGraph::Access> accesses;
+        for (uint32_t t = 0; t < textures.size(); ++t) {
+            if (level >= textures[t]->mMipLevels) { continue; }
+            accesses.push_back({ levels[t][level - 1], VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL });
+            accesses.push_back({ levels[t][level], VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL });
+        }
+        mRenderGraph.addPass(std::move(accesses), [&, level](VkCommandBuffer cmd) {
+            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mMipmapPipeline);
+            for (uint32_t t = 0; t < textures.size(); ++t) {
+                const Texture& texture = *textures[t];
+                if (level >= texture.mMipLevels) { continue; }
+                vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mMipmapPipelineLayout, 0, 1, &sets[firstSet[t] + level - 1], 0, nullptr);
+                const uint32_t width = std::max(texture.mExtents.width >> level, 1u);
+                const uint32_t height = std::max(texture.mExtents.height >> level, 1u);
+                vkCmdDispatch(cmd, (width + 7) / 8, (height + 7) / 8, 1);
+            }
+            });
+    }
+
+    // Leave every level readable by the render.
+    std::vector<RenderGraph::Access> accesses;
+    for (uint32_t t = 0; t < textures.size(); ++t) {
+        for (uint32_t level = 1; level < textures[t]->mMipLevels; ++level) {
+            accesses.push_back({ levels[t][level], VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL });
+        }
+    }
+    mRenderGraph.addPass(std::move(accesses));
+    immediateSubmit([&](VkCommandBuffer cmd) { mRenderGraph.execute(cmd); });
+
+    for (const VkImageView view : views) { vkDestroyImageView(mDevice, view, nullptr); }
+    vkDestroyDescriptorPool(mDevice, pool, nullptr);
+}
+
+// The pipeline of generateMipmaps, created with the first textures that need it.
+void VulkanApp::initMipmapPipeline()
+{
+    std::array<VkDescriptorSetLayoutBinding, 2> bindings{ {
+        { 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT },   // Level above, sRGB.
+        { 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT } } };       // Level written, UNORM.
+    const VkDescriptorSetLayoutCreateInfo setLayoutInfo{
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = static_cast<uint32_t>(bindings.size()),
+        .pBindings = bindings.data()
+    };
+    VK_CHECK(vkCreateDescriptorSetLayout(mDevice, &setLayoutInfo, nullptr, &mMipmapSetLayout));
+    mDeletionQueue.push_function([&]() {vkDestroyDescriptorSetLayout(mDevice, mMipmapSetLayout, nullptr);});
+
+    // Bilinear filtering at the center of a 2x2 footprint averages it.
+    VkSamplerCreateInfo samplerInfo{};
+    samplerInfo.sType           = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter       = VK_FILTER_LINEAR;
+    samplerInfo.minFilter       = VK_FILTER_LINEAR;
+    samplerInfo.mipmapMode      = VK_SAMPLER_MIPMAP_MODE_NEAREST;
     samplerInfo.addressModeU    = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
     samplerInfo.addressModeV    = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
-    //samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-    //TODO: Read about anisotropic filtering.
-    //samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
-    //samplerInfo.unnormalizedCoordinates = VK_FALSE;
-    //samplerInfo.compareEnable = VK_FALSE;
-    //samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
-    //samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-    //samplerInfo.mipLodBias = 0.0f;
-    //samplerInfo.minLod = 0.0f;
-    //samplerInfo.maxLod = 0.0f;
-    VK_CHECK(vkCreateSampler(mDevice, &samplerInfo, nullptr, &mTextureSampler));
-    mDeletionQueue.push_function([&] {vkDestroySampler(mDevice, mTextureSampler, nullptr);});
+    samplerInfo.addressModeW    = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    VK_CHECK(vkCreateSampler(mDevice, &samplerInfo, nullptr, &mMipmapSampler));
+    mDeletionQueue.push_function([&]() {vkDestroySampler(mDevice, mMipmapSampler, nullptr);});
+
+    const VkPipelineLayoutCreateInfo pipelineLayoutInfo{
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &mMipmapSetLayout
+    };
+    VK_CHECK(vkCreatePipelineLayout(mDevice, &pipelineLayoutInfo, nullptr, &mMipmapPipelineLayout));
+    mDeletionQueue.push_function([&]() {vkDestroyPipelineLayout(mDevice, mMipmapPipelineLayout, nullptr);});
+
+    mMipmapShader = createShaderModule(mDevice, fs::path("shaders/mipmap.comp.spv"));
+    mDeletionQueue.push_function([&]() {vkDestroyShaderModule(mDevice, mMipmapShader, nullptr);});
+    const VkComputePipelineCreateInfo pipelineInfo{
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+            .module = mMipmapShader,
+            .pName = "main" },
+        .layout = mMipmapPipelineLayout
+    };
+    VK_CHECK(vkCreateComputePipelines(mDevice, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &mMipmapPipeline));
+    mDeletionQueue.push_function([&]() {vkDestroyPipeline(mDevice, mMipmapPipeline, nullptr);});
+}
+
+// The geometry addresses of each mesh, indexed by mesh ID. Scenes without meshes still get one record, so that a valid
+// buffer can be bound.
+std::vector<MeshRecord> VulkanApp::buildMeshTable() const
+{
+    std::vector<MeshRecord> meshTable;
+    meshTable.reserve(std::max<size_t>(mScene.mMeshes.size(), 1));
+    for (const auto& mesh : mScene.mMeshes) {
+        meshTable.push_back({
+            .vertexAddress = mesh.mVertexRange.mAddress,
+            .indexAddress = mesh.mIndexRange.mAddress,
+            .attributeAddress = mesh.mAttributeRange.mAddress,
+            .triangleMaterialAddress = mesh.mTriangleMaterialRange.mAddress });
+    }
+    if (meshTable.empty()) { meshTable.push_back({}); }
+    return meshTable;
+}
+
+void VulkanApp::unloadScene()
+{
+    waitSceneLoads();
+    vkDeviceWaitIdle(mDevice);
+    mSceneDeletionQueue.flush();
+    mGeometryArena.releaseEmptyBlocks();
+    mScene = Scene{};
+}
+
+void VulkanApp::defragment(uint32_t maxPasses)
+{
+    vkDeviceWaitIdle(mDevice);
+
+    const VmaDefragmentationInfo defragInfo{
+        .flags = VMA_DEFRAGMENTATION_FLAG_ALGORITHM_BALANCED_BIT,
+        .maxBytesPerPass = kDefragmentationBytesPerPass,
+        .maxAllocationsPerPass = kDefragmentationMovesPerPass
+    };
+    VmaDefragmentationContext context;
+    VK_CHECK(vmaBeginDefragmentation(mVmaAllocator, &defragInfo, &context));
+
+    // Only the allocations we know how to move: the mesh BLASes and the geometry arena blocks. Everything else
+    // (images, scene buffers, the staging ring) stays where it is.
+    std::unordered_map<VmaAllocation, uint32_t> blasOwners;
+    for (uint32_t i = 0; i < mScene.mMeshes.size(); ++i) {
+        if (mScene.mMeshes[i].mBlas.mHandle) { blasOwners.emplace(mScene.mMeshes[i].mBlas.mData.mAllocation, i); }
+    }
+
+    struct BlasMove { uint32_t meshID; AccelerationStructure blas; };
+    struct BlockMove { uint32_t blockIndex; VkBuffer buffer; };
+    bool bBlasMoved = false;
+    bool bGeometryMoved = false;
+    for (uint32_t pass = 0; pass < maxPasses; ++pass)
+    {
+        VmaDefragmentationPassMoveInfo passInfo;
+        if (vmaBeginDefragmentationPass(mVmaAllocator, context, &passInfo) == VK_SUCCESS) { break; }  // Nothing left to move.
+
+        // Bind new buffers to the destinations, and copy the contents into them.
+        std::vector<BlasMove> blasMoves;
+        std::vector<BlockMove> blockMoves;
+        for (uint32_t i = 0; i < passInfo.moveCount; ++i)
+        {
+            VmaDefragmentationMove& move = passInfo.pMoves[i];
+            if (const auto it = blasOwners.find(move.srcAllocation); it != blasOwners.end()) {
+                const ObjMesh& mesh = mScene.mMeshes[it->second];
+                const VkBufferCreateInfo bufferCreateInfo{
+                    .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                    .size = mesh.mBlas.mSize,
+                    .usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                    .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+                };
+                AccelerationStructure blas{ .mData = mesh.mBlas.mData, .mSize = mesh.mBlas.mSize };
+                VK_CHECK(vkCreateBuffer(mDevice, &bufferCreateInfo, nullptr, &blas.mData.mBuffer));
+                VK_CHECK(vmaBindBufferMemory(mVmaAllocator, move.dstTmpAllocation, blas.mData.mBuffer));
+
+                const VkAccelerationStructureCreateInfoKHR blasCreateInfo{
+                    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+                    .buffer = blas.mData.mBuffer,
+                    .size = blas.mSize,
+                    .type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR
+                };
+                VK_CHECK(vkCreateAccelerationStructureKHR(mDevice, &blasCreateInfo, nullptr, &blas.mHandle));
+                blasMoves.push_back({ it->second, blas });
+            }
+            else if (const int32_t block = mGeometryArena.findBlock(move.srcAllocation); block >= 0) {
+                blockMoves.push_back({ static_cast<uint32_t>(block), mGeometryArena.createMovedBlockBuffer(block, move.dstTmpAllocation) });
+            }
+            else {
+                move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+            }
+        }
+
+        if (!blasMoves.empty() || !blockMoves.empty()) {
+            immediateSubmit([&](VkCommandBuffer cmd) {
+                for (const auto& move : blasMoves) {
+                    const VkCopyAccelerationStructureInfoKHR copyInfo{
+                        .sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR,
+                        .src = mScene.mMeshes[move.meshID].mBlas.mHandle,
+                        .dst = move.blas.mHandle,
+                        .mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_CLONE_KHR
+                    };
+                    vkCmdCopyAccelerationStructureKHR(cmd, &copyInfo);
+                }
+                for (const auto& move : blockMoves) { mGeometryArena.recordBlockCopy(cmd, move.blockIndex, move.buffer); }
+
+                // Make the moved data visible to the TLAS rebuild and to later renders.
+                const VkMemoryBarrier2 barrier{
+                    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+                    .srcStageMask = VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_COPY_BIT_KHR | VK_PIPELINE_STAGE_2_COPY_BIT,
+                    .srcAccessMask = VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR | VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                    .dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                    .dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT
+                };
+                const VkDependencyInfo dependency{ .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .memoryBarrierCount = 1, .pMemoryBarriers = &barrier };
+                vkCmdPipelineBarrier2(cmd, &dependency);
+                });
+        }
+
+        // The old buffers must be gone before VMA frees their memory.
+        for (const auto& move : blasMoves) {
+            AccelerationStructure& blas = mScene.mMeshes[move.meshID].mBlas;
+            vkDestroyAccelerationStructureKHR(mDevice, blas.mHandle, nullptr);
+            vkDestroyBuffer(mDevice, blas.mData.mBuffer, nullptr);
+            blas.mHandle = move.blas.mHandle;
+            blas.mData.mBuffer = move.blas.mData.mBuffer;  // mAllocation now refers to the new memory.
+        }
+        for (const auto& move : blockMoves) { mGeometryArena.replaceBlockBuffer(move.blockIndex, move.buffer); }
+
+        const VkResult result = vmaEndDefragmentationPass(mVmaAllocator, context, &passInfo);
+        for (const auto& move : blockMoves) { mGeometryArena.refreshBlock(move.blockIndex); }
+        bBlasMoved |= !blasMoves.empty();
+        bGeometryMoved |= !blockMoves.empty();
+        if (result == VK_SUCCESS) { break; }
+    }
+
+    VmaDefragmentationStats stats;
+    vmaEndDefragmentation(mVmaAllocator, context, &stats);
+
+    // Point the shader and the TLAS at the new locations. The mesh table and the TLAS stay in place, so the descriptor
+    // set doesn't change. Neither exists yet if the scene isn't fully uploaded.
+    if (bGeometryMoved) {
+        for (auto& mesh : mScene.mMeshes) {
+            mGeometryArena.refreshRange(mesh.mVertexRange);
+            mGeometryArena.refreshRange(mesh.mAttributeRange);
+            mGeometryArena.refreshRange(mesh.mIndexRange);
+            mGeometryArena.refreshRange(mesh.mTriangleMaterialRange);
+        }
+    }
+    if (bGeometryMoved && mMeshTableBuffer.mBuffer) {
+        const std::vector<MeshRecord> meshTable = buildMeshTable();
+        const VkDeviceSize meshTableSize = meshTable.size() * sizeof(MeshRecord);
+        if (void* mapped = mMeshTableBuffer.mAllocInfo.pMappedData) {
+            memcpy(mapped, meshTable.data(), meshTableSize);
+            flushUploadBuffer(mMeshTableBuffer);
+        }
+        else {
+            AllocatedBuffer stagingBuffer = createHostVisibleStagingBuffer(mVmaAllocator, meshTableSize);
+            trackAllocation(MemoryCategory::Staging, stagingBuffer.mAllocation);
+            void* data;
+            vmaMapMemory(mVmaAllocator, stagingBuffer.mAllocation, &data);
+            memcpy(data, meshTable.data(), meshTableSize);
+            vmaUnmapMemory(mVmaAllocator, stagingBuffer.mAllocation);
+            immediateSubmit([&](VkCommandBuffer cmd) {
+                const VkBufferCopy copy{ .srcOffset = 0, .dstOffset = 0, .size = meshTableSize };
+                vkCmdCopyBuffer(cmd, stagingBuffer.mBuffer, mMeshTableBuffer.mBuffer, 1, &copy);
+                });
+            untrackAllocation(MemoryCategory::Staging, stagingBuffer.mAllocation);
+            vmaDestroyBuffer(mVmaAllocator, stagingBuffer.mBuffer, stagingBuffer.mAllocation);
+        }
+    }
+    if (bBlasMoved && mTlas.mHandle) { initSceneTLAS(); }
+
+    fmt::println("Defragmentation moved {} allocations ({:.1f} MB) and freed {} memory blocks ({:.1f} MB)",
+        stats.allocationsMoved, stats.bytesMoved / double(1 << 20), stats.deviceMemoryBlocksFreed, stats.bytesFreed / double(1 << 20));
 }
 
 // Creates a blas for an AABB centered at the origin, with a half-extents of 1.
 void VulkanApp::initAabbBlas()
 {
+    // The unit AABB doesn't depend on the scene: it is built once and kept across scenes.
+    if (mAabbBlas.mHandle) { return; }
+
     // First need to create a GPU buffer for the aabb, which will be used to build the BLAS. 
+    AllocatedBuffer stagingBuffer{};
     {
         const AABB aabb{ .min = glm::vec3(-1.f), .max = glm::vec3(1.f)};
         const auto aabbBufferSize = sizeof(AABB);
 
         // Create GPU buffer for the AABB.
-        const VkBufferCreateInfo deviceBufferCreateInfo{
-            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-            .size = aabbBufferSize,
-            .usage =
-                VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-                VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
-                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
-                VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-            .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-        };
-        const VmaAllocationCreateInfo deviceBufferAllocInfo{ .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, };
-        VK_CHECK(vmaCreateBuffer(mVmaAllocator, &deviceBufferCreateInfo, &deviceBufferAllocInfo, &mAabbGeometryBuffer.mBuffer, &mAabbGeometryBuffer.mAllocation, &mAabbGeometryBuffer.mAllocInfo));
-        mDeletionQueue.push_function([&]() {vmaDestroyBuffer(mVmaAllocator, mAabbGeometryBuffer.mBuffer, mAabbGeometryBuffer.mAllocation);});
-
-        // Create staging buffer for the AABB.
-        AllocatedBuffer stagingBuffer;
-        const VkBufferCreateInfo stagingbufferCreateInfo{
-                .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-                .size = aabbBufferSize,
-                .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-        };
-        const VmaAllocationCreateInfo stagingBufferAllocInfo{
-                .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
-                .usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
-                .requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
-        };
-        VK_CHECK(vmaCreateBuffer(mVmaAllocator, &stagingbufferCreateInfo, &stagingBufferAllocInfo, &stagingBuffer.mBuffer, &stagingBuffer.mAllocation, &stagingBuffer.mAllocInfo));
-
-        // Copy data to the staging buffer.
-        void* data;
-        vmaMapMemory(mVmaAllocator, stagingBuffer.mAllocation, (void**)&data);
-        memcpy(data, &aabb, sizeof(AABB));
-        vmaUnmapMemory(mVmaAllocator, stagingBuffer.mAllocation);
-        
-        // Transfer data from stating buffer to GPU buffer.
-        immediateSubmit([&](VkCommandBuffer cmd) {
-            const VkBufferCopy copy{ .srcOffset = 0, .dstOffset = 0, .size = aabbBufferSize };
-            vkCmdCopyBuffer(cmd, stagingBuffer.mBuffer, mAabbGeometryBuffer.mBuffer, 1, &copy);
-            });
-
-        vmaDestroyBuffer(mVmaAllocator, stagingBuffer.mBuffer, stagingBuffer.mAllocation);
+        mAabbGeometryBuffer = createUploadBuffer(aabbBufferSize,
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+            VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+            MemoryCategory::SceneData);
+
+        if (void* mapped = mAabbGeometryBuffer.mAllocInfo.pMappedData) {
+            memcpy(mapped, &aabb, sizeof(AABB));
+            flushUploadBuffer(mAabbGeometryBuffer);
+        }
+        else {
+            // Copy data to a staging buffer. It is copied to the GPU buffer in the same submission as the build.
+            stagingBuffer = createHostVisibleStagingBuffer(mVmaAllocator, aabbBufferSize);
+            trackAllocation(MemoryCategory::Staging, stagingBuffer.mAllocation);
+            void* data;
+            vmaMapMemory(mVmaAllocator, stagingBuffer.mAllocation, (void**)&data);
+            memcpy(data, &aabb, sizeof(AABB));
+            vmaUnmapMemory(mVmaAllocator, stagingBuffer.mAllocation);
+        }
     }
     const uint32_t kAabbCount = 1;
 
@@ -535,9 +1562,9 @@ void VulkanApp::initAabbBlas()
             .usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
             .sharingMode = VK_SHARING_MODE_EXCLUSIVE
         };
-        const VmaAllocationCreateInfo blasBufferAllocInfo{ .usage = VMA_MEMORY_USAGE_AUTO };
+        const VmaAllocationCreateInfo blasBufferAllocInfo{ .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE };
         VK_CHECK(vmaCreateBuffer(mVmaAllocator, &blasBufferCreateInfo, &blasBufferAllocInfo, &mAabbBlas.mData.mBuffer, &mAabbBlas.mData.mAllocation, nullptr));
-        mDeletionQueue.push_function([&]() {vmaDestroyBuffer(mVmaAllocator, mAabbBlas.mData.mBuffer, mAabbBlas.mData.mAllocation);});
+        trackAllocation(MemoryCategory::Blas, mAabbBlas.mData.mAllocation);
 
         const VkAccelerationStructureCreateInfoKHR blasCreateInfo{
             .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
@@ -546,50 +1573,65 @@ void VulkanApp::initAabbBlas()
             .type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR
         };
         vkCreateAccelerationStructureKHR(mDevice, &blasCreateInfo, nullptr, &mAabbBlas.mHandle);
-        mDeletionQueue.push_function([&]() {vkDestroyAccelerationStructureKHR(mDevice, mAabbBlas.mHandle, nullptr);});
+        mAabbBlas.mSize = buildSizesInfo.accelerationStructureSize;
+        mDeletionQueue.push_function([&]() {
+            vkDestroyAccelerationStructureKHR(mDevice, mAabbBlas.mHandle, nullptr);
+            untrackAllocation(MemoryCategory::Blas, mAabbBlas.mData.mAllocation);
+            vmaDestroyBuffer(mVmaAllocator, mAabbBlas.mData.mBuffer, mAabbBlas.mData.mAllocation);
+            untrackAllocation(MemoryCategory::SceneData, mAabbGeometryBuffer.mAllocation);
+            vmaDestroyBuffer(mVmaAllocator, mAabbGeometryBuffer.mBuffer, mAabbGeometryBuffer.mAllocation);
+            mAabbBlas = {};
+            mAabbGeometryBuffer = {};
+            });
     }
 
 
-    // Allocate a GPU scratch buffer holding the temporary data of the acceleration structure builder.
-    AllocatedBuffer  scratchBuffer;
-    {
-        const VkBufferCreateInfo scratchBufCreateInfo{
-            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-            .size = buildSizesInfo.buildScratchSize ,
-            .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-            .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-        };
-        const VmaAllocationCreateInfo scratchBufAllocCreateInfo{ .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE };
-        VK_CHECK(vmaCreateBuffer(mVmaAllocator, &scratchBufCreateInfo, &scratchBufAllocCreateInfo, &scratchBuffer.mBuffer, &scratchBuffer.mAllocation, &scratchBuffer.mAllocInfo));
+    // Upload (if staged) and build passes. The scratch buffer is transient memory of the render graph.
+    RenderGraph::ResourceState geometryState;
+    mRenderGraph.reset();
+    const auto geometry = mRenderGraph.importBuffer(mAabbGeometryBuffer.mBuffer, geometryState);
+    const auto blas = mRenderGraph.importBuffer(mAabbBlas.mData.mBuffer, mAabbBlasState);
+    const auto scratch = mRenderGraph.createBuffer(buildSizesInfo.buildScratchSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, mScratchAlignment);
+    if (stagingBuffer.mBuffer) {
+        mRenderGraph.addPass({ { geometry, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT } }, [&](VkCommandBuffer cmd) {
+            const VkBufferCopy copy{ .srcOffset = 0, .dstOffset = 0, .size = sizeof(AABB) };
+            vkCmdCopyBuffer(cmd, stagingBuffer.mBuffer, mAabbGeometryBuffer.mBuffer, 1, &copy);
+            });
     }
-
-    // Build the blas in a command buffer.
-    immediateSubmit([&](VkCommandBuffer cmd) {
-        // We can fill the rest of the buildGeometry struct.
-        buildGeometryInfo.dstAccelerationStructure = mAabbBlas.mHandle;
-        buildGeometryInfo.scratchData.deviceAddress = GetBufferDeviceAddress(mDevice, scratchBuffer.mBuffer);
-        const VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo{ kAabbCount, 0, 0, 0 };
-        const VkAccelerationStructureBuildRangeInfoKHR* pRangeInfos = &buildRangeInfo;
-        vkCmdBuildAccelerationStructuresKHR(cmd, 1, &buildGeometryInfo, &pRangeInfos);
+    mRenderGraph.addPass({
+        { geometry, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_ACCESS_2_SHADER_READ_BIT },
+        { scratch, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR },
+        { blas, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR } },
+        [&](VkCommandBuffer cmd) {
+            // We can fill the rest of the buildGeometry struct.
+            buildGeometryInfo.dstAccelerationStructure = mAabbBlas.mHandle;
+            buildGeometryInfo.scratchData.deviceAddress = mRenderGraph.address(scratch);
+            const VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo{ kAabbCount, 0, 0, 0 };
+            const VkAccelerationStructureBuildRangeInfoKHR* pRangeInfos = &buildRangeInfo;
+            vkCmdBuildAccelerationStructuresKHR(cmd, 1, &buildGeometryInfo, &pRangeInfos);
         });
+    immediateSubmit([&](VkCommandBuffer cmd) { mRenderGraph.execute(cmd); });
 
-    // We no longer need the scratch buffer.
-    vmaDestroyBuffer(mVmaAllocator, scratchBuffer.mBuffer, scratchBuffer.mAllocation);
+    if (stagingBuffer.mBuffer) {
+        untrackAllocation(MemoryCategory::Staging, stagingBuffer.mAllocation);
+        vmaDestroyBuffer(mVmaAllocator, stagingBuffer.mBuffer, stagingBuffer.mAllocation);
+    }
 }
 
-// Creates a blas for a triangle mesh. The geometry is defined in model space.
-void VulkanApp::initMeshBlas(ObjMesh& mesh)
+// Creates a blas for a triangle mesh, and records its build into cmd. The geometry is defined in model space.
+// The scratch buffer is allocated here and must be kept alive until cmd has finished executing.
+void VulkanApp::recordMeshBlasBuild(VkCommandBuffer cmd, ObjMesh& mesh, AllocatedBuffer& scratchBuffer)
 {
-    const uint32_t        meshPrimitiveCount = static_cast<uint32_t>(mesh.mIndices.size() / 3); // number of triangles in the mesh.
+    const uint32_t        meshPrimitiveCount = static_cast<uint32_t>(mesh.indexCount() / 3); // number of triangles in the mesh.
 
     const VkAccelerationStructureGeometryTrianglesDataKHR trianglesData{
         .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR,
         .vertexFormat = VK_FORMAT_R32G32B32_SFLOAT,
-        .vertexData = {.deviceAddress = GetBufferDeviceAddress(mDevice, mesh.mVertexBuffer.mBuffer)},
-        .vertexStride = sizeof(Vertex),
-        .maxVertex = static_cast<uint32_t>(mesh.mVertices.size() - 1),
-        .indexType = VK_INDEX_TYPE_UINT32,
-        .indexData = {.deviceAddress = GetBufferDeviceAddress(mDevice, mesh.mIndexBuffer.mBuffer)},
+        .vertexData = {.deviceAddress = mesh.mVertexRange.mAddress},
+        .vertexStride = (mSpecializationData.vertexLayout == VERTEX_LAYOUT_COMPACT) ? sizeof(glm::vec3) : sizeof(Vertex),  // The compact layout stores positions in their own stream.
+        .maxVertex = static_cast<uint32_t>(mesh.vertexCount() - 1),
+        .indexType = mesh.mIndexType,
+        .indexData = {.deviceAddress = mesh.mIndexRange.mAddress},
         .transformData = {.deviceAddress = 0} //TODO: Dont understand the use of this?
     };
 
@@ -614,6 +1656,7 @@ void VulkanApp::initMeshBlas(ObjMesh& mesh)
     // We query the sizes, which will be filled in the BuildSizesInfo structure. 
     VkAccelerationStructureBuildSizesInfoKHR    buildSizesInfo{ .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR };
     vkGetAccelerationStructureBuildSizesKHR(mDevice, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildGeometryInfo, &meshPrimitiveCount, &buildSizesInfo);
+    checkMemoryBudget(MemoryCategory::Blas, buildSizesInfo.accelerationStructureSize + buildSizesInfo.buildScratchSize);
 
     // Create blas handle and GPU buffer that will store the data.
     {
@@ -623,9 +1666,9 @@ void VulkanApp::initMeshBlas(ObjMesh& mesh)
             .usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
             .sharingMode = VK_SHARING_MODE_EXCLUSIVE
         };
-        const VmaAllocationCreateInfo blasBufferAllocInfo{ .usage = VMA_MEMORY_USAGE_AUTO };
+        const VmaAllocationCreateInfo blasBufferAllocInfo{ .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE };
         VK_CHECK(vmaCreateBuffer(mVmaAllocator, &blasBufferCreateInfo, &blasBufferAllocInfo, &mesh.mBlas.mData.mBuffer, &mesh.mBlas.mData.mAllocation, nullptr));
-        mDeletionQueue.push_function([&]() {vmaDestroyBuffer(mVmaAllocator, mesh.mBlas.mData.mBuffer, mesh.mBlas.mData.mAllocation);});
+        trackAllocation(MemoryCategory::Blas, mesh.mBlas.mData.mAllocation);
 
         const VkAccelerationStructureCreateInfoKHR blasCreateInfo{
             .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
@@ -634,12 +1677,11 @@ void VulkanApp::initMeshBlas(ObjMesh& mesh)
             .type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR
         };
         vkCreateAccelerationStructureKHR(mDevice, &blasCreateInfo, nullptr, &mesh.mBlas.mHandle);
-        mDeletionQueue.push_function([&]() {vkDestroyAccelerationStructureKHR(mDevice, mesh.mBlas.mHandle, nullptr);});
+        mesh.mBlas.mSize = buildSizesInfo.accelerationStructureSize;  // The BLAS is destroyed by the scene deletion queue (see uploadScene).
     }
 
 
     // Allocate a GPU scratch buffer holding the temporary data of the acceleration structure builder.
-    AllocatedBuffer  scratchBuffer;
     {
         const VkBufferCreateInfo scratchBufCreateInfo{
             .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
@@ -649,52 +1691,69 @@ void VulkanApp::initMeshBlas(ObjMesh& mesh)
         };
         const VmaAllocationCreateInfo scratchBufAllocCreateInfo{ .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE };
         VK_CHECK(vmaCreateBuffer(mVmaAllocator, &scratchBufCreateInfo, &scratchBufAllocCreateInfo, &scratchBuffer.mBuffer, &scratchBuffer.mAllocation, &scratchBuffer.mAllocInfo));
+        trackAllocation(MemoryCategory::Scratch, scratchBuffer.mAllocation);
     }
 
-    // Build the blas in a command buffer.
-    immediateSubmit([&](VkCommandBuffer cmd) {
-        // We can fill the rest of the buildGeometry struct.
-        buildGeometryInfo.dstAccelerationStructure = mesh.mBlas.mHandle;
-        buildGeometryInfo.scratchData.deviceAddress = GetBufferDeviceAddress(mDevice, scratchBuffer.mBuffer);
-        const VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo{ meshPrimitiveCount, 0, 0, 0 };
-        const VkAccelerationStructureBuildRangeInfoKHR* pRangeInfos = &buildRangeInfo;
-        vkCmdBuildAccelerationStructuresKHR(cmd, 1, &buildGeometryInfo, &pRangeInfos);
-        });
+    // Record the blas build.
+    // We can fill the rest of the buildGeometry struct.
+    buildGeometryInfo.dstAccelerationStructure = mesh.mBlas.mHandle;
+    buildGeometryInfo.scratchData.deviceAddress = GetBufferDeviceAddress(mDevice, scratchBuffer.mBuffer);
+    const VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo{ meshPrimitiveCount, 0, 0, 0 };
+    const VkAccelerationStructureBuildRangeInfoKHR* pRangeInfos = &buildRangeInfo;
+    vkCmdBuildAccelerationStructuresKHR(cmd, 1, &buildGeometryInfo, &pRangeInfos);
+}
 
+// Creates and builds a blas for a triangle mesh whose buffers have already been uploaded.
+void VulkanApp::initMeshBlas(ObjMesh& mesh)
+{
+    AllocatedBuffer  scratchBuffer;
+    immediateSubmit([&](VkCommandBuffer cmd) { recordMeshBlasBuild(cmd, mesh, scratchBuffer); });
 
     // We no longer need the scratch buffer.
+    untrackAllocation(MemoryCategory::Scratch, scratchBuffer.mAllocation);
     vmaDestroyBuffer(mVmaAllocator, scratchBuffer.mBuffer, scratchBuffer.mAllocation);
 }
 
 void VulkanApp::initSceneTLAS()
 {
+    // The geometry and material of each instance go into an instance record, read by the shader at the instance index.
+    // Instances of the same mesh share its geometry and BLAS. Instances using the mesh's own materials store the base of
+    // its materials, and flag per-triangle material indices.
     std::vector<VkAccelerationStructureInstanceKHR> instances;
-    // TODO (Hack): For now, do triangle meshes first because the value of instanceCustomIndex will be used to index descriptors.
-    // For triangle meshes, the custom index will store the id of the instance.
-    for (uint32_t i = 0; i < mScene.mMeshes.size(); ++i)
+    std::vector<InstanceRecord> instanceRecords;
+    for (const auto& instance : mScene.mMeshInstances)
     {
+        const ObjMesh& mesh = mScene.mMeshes[instance.meshID];
+        const bool bMeshMaterials = instance.materialID == kMeshMaterials;
+        instanceRecords.push_back({
+            .geometryType = GEOMETRY_TRIANGLES,
+            .meshID = instance.meshID,
+            .materialBase = bMeshMaterials ? mesh.mMaterialBase : instance.materialID,
+            .flags = (mesh.mIndexType == VK_INDEX_TYPE_UINT16 ? INSTANCE_INDEX16_BIT : 0u) |
+                (bMeshMaterials && mesh.mTriangleMaterialRange.mBuffer ? INSTANCE_MATERIALS_BIT : 0u) });
         instances.push_back(VkAccelerationStructureInstanceKHR{
-            .transform = glmMat4ToVkTransformMatrixKHR(mScene.mMeshes[i].mTransform),
-            .instanceCustomIndex = i,                                     
+            .transform = glmMat4ToVkTransformMatrixKHR(instance.transform),
+            .instanceCustomIndex = 0,                                                           // Unused, see instanceRecords.
             .mask = 0xFF,                                                                       // No masking. Ray will always be visible.
-            .instanceShaderBindingTableRecordOffset = mScene.mMeshes[i].mMaterialID,
+            .instanceShaderBindingTableRecordOffset = 0,
             .flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR,                 // No face culling, etc.
-            .accelerationStructureReference = getBlasDeviceAddress(mDevice, mScene.mMeshes[i].mBlas.mHandle)  // For meshes, use the address of the mesh BLAS .
+            .accelerationStructureReference = getBlasDeviceAddress(mDevice, mScene.mMeshes[instance.meshID].mBlas.mHandle)  // For meshes, use the address of the mesh BLAS .
             });
     }
 
     // Create an instance for each sphere in the scene.
-    // Each sphere instance has it's own transform, but shares the same custom index.
+    // Each sphere instance has it's own transform, but shares the AABB BLAS.
     for (uint32_t i = 0; i < mScene.mSpheres.size(); ++i)
     {
         glm::mat4 transform = glm::translate(glm::mat4(1.f), mScene.mSpheres[i].center);
         transform = glm::scale(transform, glm::vec3(mScene.mSpheres[i].radius));
 
+        instanceRecords.push_back({ .geometryType = GEOMETRY_SPHERE, .meshID = 0, .materialBase = mScene.mSpheres[i].materialID, .flags = 0 });
         instances.push_back(VkAccelerationStructureInstanceKHR{
            .transform = glmMat4ToVkTransformMatrixKHR(transform),
-           .instanceCustomIndex = SPHERE_CUSTOM_INDEX,                                 // We use the custom index in the shader to determine the geometry type.
+           .instanceCustomIndex = 0,                                                    // Unused, see instanceRecords.
            .mask = 0xFF,                                                                // No masking. Ray will always be visible.
-           .instanceShaderBindingTableRecordOffset = mScene.mSpheres[i].materialID,       // We use this to determine the material of the surface.
+           .instanceShaderBindingTableRecordOffset = 0,
            .flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR,          // No   face culling, etc.
            .accelerationStructureReference = getBlasDeviceAddress(mDevice, mAabbBlas.mHandle) // For procedural geometry, use the address of the AABB BLAS.
             });
@@ -704,30 +1763,44 @@ void VulkanApp::initSceneTLAS()
 
     const uint32_t kInstanceCount =instances.size();
 
-    //TODO: Finish
-    // Upload instanceData to the device via a staging buffer.
-    {
-        const VkBufferCreateInfo instanceBufCreateInfo{
-            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-            .size = sizeof(VkAccelerationStructureInstanceKHR) * instances.size(),
-            .usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
-        };
-        const VmaAllocationCreateInfo instanceBufAllocCreateInfo{
-        .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
-        .usage = VMA_MEMORY_USAGE_AUTO, // Let the allocator decide which memory type to use.
-        .requiredFlags =
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | // Specify that the buffer may be mapped. 
-            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | // 
-            VK_MEMORY_PROPERTY_HOST_CACHED_BIT     // Without this flag, every read of the buffer's memory requires a fetch from GPU memory!
-        };
-        VK_CHECK(vmaCreateBuffer(mVmaAllocator, &instanceBufCreateInfo, &instanceBufAllocCreateInfo, &mTlasInstanceBuffer.mBuffer, &mTlasInstanceBuffer.mAllocation, nullptr));
-        mDeletionQueue.push_function([&]() {vmaDestroyBuffer(mVmaAllocator, mTlasInstanceBuffer.mBuffer, mTlasInstanceBuffer.mAllocation);});
+    // Write the instances and their records straight into their buffers if they are host-visible (unified memory or
+    // ReBAR). Otherwise they go through a staging buffer (instances | records), copied in the same submission as the TLAS build.
+    // The buffers and the TLAS are created once per scene. Later calls (after defragment has moved BLASes) rewrite the
+    // instances and rebuild the TLAS in place, so the descriptors stay valid.
+    const VkDeviceSize instanceBufferSize = sizeof(VkAccelerationStructureInstanceKHR) * instances.size();
+    if (!mTlasInstanceBuffer.mBuffer) {
+        mTlasInstanceBuffer = createUploadBuffer(instanceBufferSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, MemoryCategory::Tlas);
+        mSceneDeletionQueue.push_function([&]() {
+            untrackAllocation(MemoryCategory::Tlas, mTlasInstanceBuffer.mAllocation);
+            vmaDestroyBuffer(mVmaAllocator, mTlasInstanceBuffer.mBuffer, mTlasInstanceBuffer.mAllocation);
+            mTlasInstanceBuffer = {};
+            });
+    }
 
-        void* data;
-        vmaMapMemory(mVmaAllocator, mTlasInstanceBuffer.mAllocation, (void**)&data);
-        memcpy(data, instances.data(), sizeof(VkAccelerationStructureInstanceKHR) * instances.size());
-        vmaUnmapMemory(mVmaAllocator, mTlasInstanceBuffer.mAllocation);
+    const VkDeviceSize instanceRecordBufferSize = sizeof(InstanceRecord) * instanceRecords.size();
+    if (!mInstanceRecordBuffer.mBuffer) {
+        mInstanceRecordBuffer = createUploadBuffer(instanceRecordBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, MemoryCategory::SceneData);
+        mSceneDeletionQueue.push_function([&]() {
+            untrackAllocation(MemoryCategory::SceneData, mInstanceRecordBuffer.mAllocation);
+            vmaDestroyBuffer(mVmaAllocator, mInstanceRecordBuffer.mBuffer, mInstanceRecordBuffer.mAllocation);
+            mInstanceRecordBuffer = {};
+            });
+    }
+
+    AllocatedBuffer instanceStagingBuffer{};
+    void* stagingData = nullptr;
+    const bool bStageInstances = mTlasInstanceBuffer.mAllocInfo.pMappedData == nullptr;
+    const bool bStageRecords = mInstanceRecordBuffer.mAllocInfo.pMappedData == nullptr;
+    if (bStageInstances || bStageRecords) {
+        instanceStagingBuffer = createHostVisibleStagingBuffer(mVmaAllocator, instanceBufferSize + instanceRecordBufferSize);
+        trackAllocation(MemoryCategory::Staging, instanceStagingBuffer.mAllocation);
+        vmaMapMemory(mVmaAllocator, instanceStagingBuffer.mAllocation, &stagingData);
     }
+    memcpy(bStageInstances ? stagingData : mTlasInstanceBuffer.mAllocInfo.pMappedData, instances.data(), instanceBufferSize);
+    memcpy(bStageRecords ? static_cast<char*>(stagingData) + instanceBufferSize : mInstanceRecordBuffer.mAllocInfo.pMappedData, instanceRecords.data(), instanceRecordBufferSize);
+    if (stagingData) { vmaUnmapMemory(mVmaAllocator, instanceStagingBuffer.mAllocation); }
+    if (!bStageInstances) { flushUploadBuffer(mTlasInstanceBuffer); }
+    if (!bStageRecords) { flushUploadBuffer(mInstanceRecordBuffer); }
 
     // Now we can build the TLAS.
 
@@ -754,18 +1827,24 @@ void VulkanApp::initSceneTLAS()
     };
     VkAccelerationStructureBuildSizesInfoKHR buildSizesInfo = { .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR };
     vkGetAccelerationStructureBuildSizesKHR(mDevice, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildGeometryInfo, &kInstanceCount, &buildSizesInfo);
+    checkMemoryBudget(MemoryCategory::Tlas, (mTlas.mHandle ? 0 : buildSizesInfo.accelerationStructureSize) + buildSizesInfo.buildScratchSize);
 
     // Create tlas handle and GPU buffer that will store the data.
-    {
+    if (!mTlas.mHandle) {
         const VkBufferCreateInfo tlasBufCreateInfo{
             .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
             .size = buildSizesInfo.accelerationStructureSize,
             .usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
             .sharingMode = VK_SHARING_MODE_EXCLUSIVE
         };
-        const VmaAllocationCreateInfo tlasBufAllocInfo{ .usage = VMA_MEMORY_USAGE_AUTO };
+        const VmaAllocationCreateInfo tlasBufAllocInfo{ .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE };
         VK_CHECK(vmaCreateBuffer(mVmaAllocator, &tlasBufCreateInfo, &tlasBufAllocInfo, &mTlas.mData.mBuffer, &mTlas.mData.mAllocation, nullptr));
-        mDeletionQueue.push_function([&]() {vmaDestroyBuffer(mVmaAllocator, mTlas.mData.mBuffer, mTlas.mData.mAllocation);});
+        trackAllocation(MemoryCategory::Tlas, mTlas.mData.mAllocation);
+        mSceneDeletionQueue.push_function([&]() {
+            untrackAllocation(MemoryCategory::Tlas, mTlas.mData.mAllocation);
+            vmaDestroyBuffer(mVmaAllocator, mTlas.mData.mBuffer, mTlas.mData.mAllocation);
+            mTlas = {};
+            });
 
         const VkAccelerationStructureCreateInfoKHR tlasCreateInfo{
             .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
@@ -774,33 +1853,54 @@ void VulkanApp::initSceneTLAS()
             .type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR
         };
         vkCreateAccelerationStructureKHR(mDevice, &tlasCreateInfo, nullptr, &mTlas.mHandle);
-        mDeletionQueue.push_function([&]() {vkDestroyAccelerationStructureKHR(mDevice, mTlas.mHandle, nullptr);});
+        mTlas.mSize = buildSizesInfo.accelerationStructureSize;
+        mSceneDeletionQueue.push_function([&]() {vkDestroyAccelerationStructureKHR(mDevice, mTlas.mHandle, nullptr);});
     }
 
-    // Create scratch buffer for the tlas.
-    AllocatedBuffer   scratchBuffer;
-    const VkBufferCreateInfo scratchBufCreateInfo{
-        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-        .size = buildSizesInfo.buildScratchSize ,
-        .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-        .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-    };
-    const VmaAllocationCreateInfo scratchBufAllocCreateInfo{ .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE };
-    VK_CHECK(vmaCreateBuffer(mVmaAllocator, &scratchBufCreateInfo, &scratchBufAllocCreateInfo, &scratchBuffer.mBuffer, &scratchBuffer.mAllocation, &scratchBuffer.mAllocInfo));
-    const auto scratchAddress = GetBufferDeviceAddress(mDevice, scratchBuffer.mBuffer);
-
-    // Build the TLAS.
-    immediateSubmit([&](VkCommandBuffer cmd) {
-        // Update build info
-        buildGeometryInfo.dstAccelerationStructure = mTlas.mHandle;
-        buildGeometryInfo.scratchData.deviceAddress = scratchAddress;
-
-        const VkAccelerationStructureBuildRangeInfoKHR buildOffsetInfo{ kInstanceCount, 0, 0, 0 };
-        const VkAccelerationStructureBuildRangeInfoKHR* pBuildOffsetInfo = &buildOffsetInfo;
-        vkCmdBuildAccelerationStructuresKHR(cmd, 1, &buildGeometryInfo, &pBuildOffsetInfo);
+    // Upload (if staged) and build passes. The scratch buffer is transient memory of the render graph, and the
+    // graph orders the build after the AABB BLAS build and any earlier render reading the TLAS.
+    RenderGraph::ResourceState instanceState, recordState;
+    mRenderGraph.reset();
+    const auto instanceBuffer = mRenderGraph.importBuffer(mTlasInstanceBuffer.mBuffer, instanceState);
+    const auto recordBuffer = mRenderGraph.importBuffer(mInstanceRecordBuffer.mBuffer, recordState);
+    const auto aabbBlas = mRenderGraph.importBuffer(mAabbBlas.mData.mBuffer, mAabbBlasState);
+    const auto tlas = mRenderGraph.importBuffer(mTlas.mData.mBuffer, mTlasState);
+    const auto scratch = mRenderGraph.createBuffer(buildSizesInfo.buildScratchSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, mScratchAlignment);
+    if (bStageInstances || bStageRecords) {
+        std::vector<RenderGraph::Access> accesses;
+        if (bStageInstances) { accesses.push_back({ instanceBuffer, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT }); }
+        if (bStageRecords) { accesses.push_back({ recordBuffer, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT }); }
+        mRenderGraph.addPass(std::move(accesses), [&](VkCommandBuffer cmd) {
+            if (bStageRecords) {
+                const VkBufferCopy copy{ .srcOffset = instanceBufferSize, .dstOffset = 0, .size = instanceRecordBufferSize };
+                vkCmdCopyBuffer(cmd, instanceStagingBuffer.mBuffer, mInstanceRecordBuffer.mBuffer, 1, &copy);
+            }
+            if (bStageInstances) {
+                const VkBufferCopy copy{ .srcOffset = 0, .dstOffset = 0, .size = instanceBufferSize };
+                vkCmdCopyBuffer(cmd, instanceStagingBuffer.mBuffer, mTlasInstanceBuffer.mBuffer, 1, &copy);
+            }
+            });
+    }
+    mRenderGraph.addPass({
+        { instanceBuffer, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_ACCESS_2_SHADER_READ_BIT },
+        { aabbBlas, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR },
+        { scratch, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR },
+        { tlas, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR } },
+        [&](VkCommandBuffer cmd) {
+            // Update build info
+            buildGeometryInfo.dstAccelerationStructure = mTlas.mHandle;
+            buildGeometryInfo.scratchData.deviceAddress = mRenderGraph.address(scratch);
+
+            const VkAccelerationStructureBuildRangeInfoKHR buildOffsetInfo{ kInstanceCount, 0, 0, 0 };
+            const VkAccelerationStructureBuildRangeInfoKHR* pBuildOffsetInfo = &buildOffsetInfo;
+            vkCmdBuildAccelerationStructuresKHR(cmd, 1, &buildGeometryInfo, &pBuildOffsetInfo);
         });
-    vmaDestroyBuffer(mVmaAllocator, scratchBuffer.mBuffer, scratchBuffer.mAllocation);
+    // The shader reads the records in later submissions: make the copy visible to it.
+    if (bStageRecords) { mRenderGraph.addPass({ { recordBuffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT } }); }
+    immediateSubmit([&](VkCommandBuffer cmd) { mRenderGraph.execute(cmd); });
 
+    if (instanceStagingBuffer.mBuffer) { untrackAllocation(MemoryCategory::Staging, instanceStagingBuffer.mAllocation); }
+    vmaDestroyBuffer(mVmaAllocator, instanceStagingBuffer.mBuffer, instanceStagingBuffer.mAllocation);
 }
 
 void VulkanApp::initImages()
@@ -823,6 +1923,7 @@ void VulkanApp::initImages()
             .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
     };
     VK_CHECK(vmaCreateImage(mVmaAllocator, &imageCreateInfo, &imageGPUAllocCreateInfo, &mImageRender.mImage, &mImageRender.mAllocation, nullptr));
+    trackAllocation(MemoryCategory::Images, mImageRender.mAllocation);
     mDeletionQueue.push_function([&]() {vmaDestroyImage(mVmaAllocator, mImageRender.mImage, mImageRender.mAllocation);});
 
 
@@ -849,66 +1950,23 @@ void VulkanApp::initImages()
         .requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT
     };
     VK_CHECK(vmaCreateImage(mVmaAllocator, &imageCreateInfo, &imageLinearAllocCreateInfo, &mImageLinear.mImage, &mImageLinear.mAllocation, nullptr));
+    trackAllocation(MemoryCategory::Images, mImageLinear.mAllocation);
     mDeletionQueue.push_function([&]() {vmaDestroyImage(mVmaAllocator, mImageLinear.mImage, mImageLinear.mAllocation);});
 
 
 
-    // Perform layout transitions using image barriers.
-    //
-    // 1) We'll need to make imageRender accessible to shader reads and writes, 
-    // and transition it from VK_IMAGE_LAYOUT_UNDEFINED to VK_IMAGE_LAYOUT_GENERAL.
-    //
-    // 2) We'll need to make imageLinear accessible to transfer writes (since we'll copy image to it later), 
-    // and transition it from VK_IMAGE_LAYOUT_UNDEFINED to VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL.
-    immediateSubmit([&](VkCommandBuffer cmd) {
-        const VkAccessFlags dstImageRenderAccesses = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
-        const VkAccessFlags dstImageLinearAccesses = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-        const VkImageSubresourceRange range{
-            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .baseMipLevel = 0,
-            .levelCount = 1,
-            .baseArrayLayer = 0,
-            .layerCount = 1
-        };
-
-        // Image memory barrier for `imageRender` from UNDEFINED to GENERAL layout:
-        std::array<VkImageMemoryBarrier, 2> imageBarriers = {};
-        imageBarriers[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        imageBarriers[0].srcAccessMask = 0;
-        imageBarriers[0].dstAccessMask = dstImageRenderAccesses;
-        imageBarriers[0].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        imageBarriers[0].newLayout = VK_IMAGE_LAYOUT_GENERAL;
-        imageBarriers[0].image = mImageRender.mImage;
-        imageBarriers[0].subresourceRange = range;
-
-        // Image memory barrier for `imageLinear` from UNDEFINED to TRANSFER_DST_OPTIMAL layout:
-        // Later it will be the destination of a copy.
-        imageBarriers[1].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        imageBarriers[1].srcAccessMask = 0;
-        imageBarriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        imageBarriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        imageBarriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        imageBarriers[1].image = mImageLinear.mImage;
-        imageBarriers[1].subresourceRange = range;
-
-
-        vkCmdPipelineBarrier(cmd,
-            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, //TODO: ??
-            0,
-            0, nullptr,
-            0, nullptr,
-            2, imageBarriers.data());
-        });
-
+    // Both images start out in VK_IMAGE_LAYOUT_UNDEFINED. The render graph transitions them on first use (see render).
+    mImageRenderState = {};
+    mImageLinearState = {};
 }
 
 // Defines the layout for the descriptor set.
 // Creates a descriptor pool to allocate descriptors from.
 // Allocates a descriptor set from the pool.
 // Binds the descriptors in the set to their resources.
-void VulkanApp::initDescriptorSets()
+// Creates the descriptor set layout. It only depends on the shader interface, so the pipeline can be created
+// from it before the scene resources exist.
+void VulkanApp::initDescriptorSetLayout()
 {
     std::vector<VkDescriptorSetLayoutBinding> bindingInfo;
 
@@ -916,31 +1974,44 @@ void VulkanApp::initDescriptorSets()
     bindingInfo.emplace_back(0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT);
     // For scene TLAS.
     bindingInfo.emplace_back(1, VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1, VK_SHADER_STAGE_COMPUTE_BIT);
-    //TODO: (HACK) Make count == meshes.size()
-    // Buffer for triangle mesh vertices.
-    bindingInfo.emplace_back(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MAX_MESH_COUNT, VK_SHADER_STAGE_COMPUTE_BIT);
-    // Buffer for triangle mesh indices.
-    bindingInfo.emplace_back(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MAX_MESH_COUNT, VK_SHADER_STAGE_COMPUTE_BIT);
+    // Buffer for the mesh table (geometry addresses of every mesh).
+    bindingInfo.emplace_back(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    // Buffer for the instance records (geometry and material of every TLAS instance).
+    bindingInfo.emplace_back(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
     // Buffer for scene materials.
     bindingInfo.emplace_back(4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
-    // Sampler for scene textures.
-    bindingInfo.emplace_back(5, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
-
+    // Scene textures, indexed by Material::albedoTexture. The array is sized for the scene when the set is allocated.
+    bindingInfo.emplace_back(5, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, MAX_TEXTURE_COUNT, VK_SHADER_STAGE_COMPUTE_BIT);
+
+    std::vector<VkDescriptorBindingFlags> bindingFlags(bindingInfo.size(), 0);
+    bindingFlags[5] = VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT;
+    const VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo{
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+        .bindingCount = static_cast<uint32_t>(bindingFlags.size()),
+        .pBindingFlags = bindingFlags.data()
+    };
 
     const VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo{
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .pNext = &bindingFlagsInfo,
         .bindingCount = static_cast<uint32_t>(bindingInfo.size()),
         .pBindings = bindingInfo.data()
     };
     VK_CHECK(vkCreateDescriptorSetLayout(mDevice, &descriptorSetLayoutCreateInfo, nullptr, &mDescriptorSetLayout););
     mDeletionQueue.push_function([&]() {vkDestroyDescriptorSetLayout(mDevice, mDescriptorSetLayout, nullptr);});
+}
+
+// Allocates the descriptor set and points it at the scene resources.
+void VulkanApp::initDescriptorSets()
+{
+    if (mDescriptorSetLayout == VK_NULL_HANDLE) { initDescriptorSetLayout(); }
 
     // Create a descriptor pool for the resources we will need.
     std::vector<VkDescriptorPoolSize> sizes;
     sizes.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 );
-    sizes.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 + (2 * MAX_MESH_COUNT) );
+    sizes.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3 );
     sizes.emplace_back(VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1 );
-    sizes.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1);
+    sizes.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, static_cast<uint32_t>(mTextures.size()));
 
     const VkDescriptorPoolCreateInfo info{
     .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
@@ -949,11 +2020,18 @@ void VulkanApp::initDescriptorSets()
     .pPoolSizes = sizes.data()
     };
     VK_CHECK(vkCreateDescriptorPool(mDevice, &info, nullptr, &mDescriptorPool););
-    mDeletionQueue.push_function([&]() {    vkDestroyDescriptorPool(mDevice,mDescriptorPool,nullptr);});
-
-    // Allocate a descriptor set from the pool.
+    mSceneDeletionQueue.push_function([&]() {    vkDestroyDescriptorPool(mDevice,mDescriptorPool,nullptr);});
+
+    // Allocate a descriptor set from the pool, with a texture array the size of the scene's.
+    const uint32_t textureCount = static_cast<uint32_t>(mTextures.size());
+    const VkDescriptorSetVariableDescriptorCountAllocateInfo variableCountInfo{
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO,
+        .descriptorSetCount = 1,
+        .pDescriptorCounts = &textureCount
+    };
     const VkDescriptorSetAllocateInfo descriptorSetAllocInfo{
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .pNext = &variableCountInfo,
         .descriptorPool = mDescriptorPool,
         .descriptorSetCount = 1,            
         .pSetLayouts = &mDescriptorSetLayout
@@ -989,31 +2067,27 @@ void VulkanApp::initDescriptorSets()
         .descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR,
     };
 
-    // Create a descriptor array for mesh vertices/indices.
-    std::vector<VkDescriptorBufferInfo> meshVertexBufferDescriptorArrayInfo;
-    std::vector<VkDescriptorBufferInfo> meshIndexBufferDescriptorArrayInfo;
-    for (int i = 0;i < mScene.mMeshes.size(); ++i)
-    {
-        meshVertexBufferDescriptorArrayInfo.emplace_back(mScene.mMeshes[i].mVertexBuffer.mBuffer, 0, mScene.mMeshes[i].mVertices.size() * sizeof(Vertex));
-        meshIndexBufferDescriptorArrayInfo.emplace_back(mScene.mMeshes[i].mIndexBuffer.mBuffer, 0, mScene.mMeshes[i].mIndices.size() * sizeof(uint32_t));
-    }
+    // Mesh geometry is read through the addresses in the mesh table, whatever the number of meshes.
+    const VkDescriptorBufferInfo meshTableDescriptorInfo{ .buffer = mMeshTableBuffer.mBuffer, .offset = 0, .range = VK_WHOLE_SIZE };
     writeDescriptorSets[2] = {
         .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
         .dstSet = mDescriptorSet,
         .dstBinding = 2,
         .dstArrayElement = 0,
-        .descriptorCount = static_cast<uint32_t>(mScene.mMeshes.size()),
+        .descriptorCount = 1,
         .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-        .pBufferInfo = meshVertexBufferDescriptorArrayInfo.data()
+        .pBufferInfo = &meshTableDescriptorInfo
     };
+
+    const VkDescriptorBufferInfo instanceRecordDescriptorInfo{ .buffer = mInstanceRecordBuffer.mBuffer, .offset = 0, .range = VK_WHOLE_SIZE };
     writeDescriptorSets[3] = {
         .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
         .dstSet = mDescriptorSet,
         .dstBinding = 3,
         .dstArrayElement = 0,
-        .descriptorCount = static_cast<uint32_t>(mScene.mMeshes.size()),
+        .descriptorCount = 1,
         .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-        .pBufferInfo = meshIndexBufferDescriptorArrayInfo.data()
+        .pBufferInfo = &instanceRecordDescriptorInfo
     };
 
     const VkDescriptorBufferInfo materialBufferDescriptorInfo{ .buffer = mScene.mMaterialsBuffer.mBuffer, .range = mScene.mMaterialsBuffer.mAllocInfo.size };
@@ -1027,15 +2101,18 @@ void VulkanApp::initDescriptorSets()
         .pBufferInfo = &materialBufferDescriptorInfo
     };
 
-    const VkDescriptorImageInfo imageInfo{ .sampler = mTextureSampler, .imageView = mTextureImageView, .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+    std::vector<VkDescriptorImageInfo> textureInfos;
+    for (const auto& texture : mTextures) {
+        textureInfos.push_back({ .sampler = mTextureSampler, .imageView = texture.mImageView, .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL });
+    }
     writeDescriptorSets[5] = {
         .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
         .dstSet = mDescriptorSet,
         .dstBinding = 5,
         .dstArrayElement = 0,
-        .descriptorCount = 1,
+        .descriptorCount = textureCount,
         .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .pImageInfo = &imageInfo
+        .pImageInfo = textureInfos.data()
     };
 
     vkUpdateDescriptorSets(mDevice, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
@@ -1044,10 +2121,13 @@ void VulkanApp::initDescriptorSets()
 void VulkanApp::initComputePipeline()
 {
     // Specify specialization constants.
-    std::array<VkSpecializationMapEntry, 1> specializationMapEntries;
+    std::array<VkSpecializationMapEntry, 2> specializationMapEntries;
     specializationMapEntries[0].constantID = 0;
     specializationMapEntries[0].size = sizeof(mSpecializationData.integrator);
-    specializationMapEntries[0].offset = 0;
+    specializationMapEntries[0].offset = offsetof(SpecializationData, integrator);
+    specializationMapEntries[1].constantID = 1;
+    specializationMapEntries[1].size = sizeof(mSpecializationData.vertexLayout);
+    specializationMapEntries[1].offset = offsetof(SpecializationData, vertexLayout);
 
     VkSpecializationInfo specializationInfo = {};
     specializationInfo.dataSize         = sizeof(SpecializationData);
@@ -1099,43 +2179,41 @@ void VulkanApp::initComputePipeline()
 
 void VulkanApp::render()
 {
+    const auto renderStart = std::chrono::steady_clock::now();
     for (uint32_t sampleBatch = 0; sampleBatch < mNumBatches; ++sampleBatch)
     {
-        immediateSubmit([&](VkCommandBuffer cmd) {
-            // Bind the compute pipeline and all the resources used by the pipeline.
-            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mComputePipeline);
-            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mPipelineLayout, 0, 1, &mDescriptorSet, 0, nullptr);
-
-            vkCmdPushConstants(cmd, mPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(Camera), &mScene.mCamera);
-            mSamplingParams.mBatchID = sampleBatch;
-            vkCmdPushConstants(cmd, mPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, sizeof(Camera), sizeof(SamplingParameters), &mSamplingParams);
-
-            // Run the compute shader for this batch.
-            vkCmdDispatch(cmd, std::ceil(mWindowExtents.width / 16), std::ceil(mWindowExtents.height / 16), 1);
-
-            if (sampleBatch == mNumBatches - 1)
-            {
-
-                // Before we copy from the GPU image to the host-visible one, we need to 
-                // 1) Perform an image layout transition for the GPU image.
-                // 2) Place a memory barrier ensuring the compute shader has finished reading/writing from the GPU image before copying from it.
-                {
-                    VkImageMemoryBarrier imageBarrier = { .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
-                    imageBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;    // Shader reads/writes to this image must have completed and be available
-                    imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;                               // Before reading from it in a transfer operation.
-                    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
-                    imageBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-                    imageBarrier.image = mImageRender.mImage;
-                    imageBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-
-                    vkCmdPipelineBarrier(cmd,
-                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,  // Src and dst pipeline stages
-                        0,
-                        0, nullptr, 0, nullptr,
-                        1, &imageBarrier);
+        // Trace pass, then on the last batch copy the render image to the host-visible image, for the host to read.
+        // Batches accumulate into the render image, so each trace waits for the previous one.
+        const VkImageSubresourceRange colorRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        mRenderGraph.reset();
+        const auto renderImage = mRenderGraph.importImage(mImageRender.mImage, colorRange, mImageRenderState);
+        const auto tlas = mRenderGraph.importBuffer(mTlas.mData.mBuffer, mTlasState);
+        mRenderGraph.addPass({
+            { renderImage, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL },
+            { tlas, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR } },
+            [&](VkCommandBuffer cmd) {
+                // Bind the compute pipeline and all the resources used by the pipeline.
+                vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mComputePipeline);
+                vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mPipelineLayout, 0, 1, &mDescriptorSet, 0, nullptr);
+
+                vkCmdPushConstants(cmd, mPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(Camera), &mScene.mCamera);
+                mSamplingParams.mBatchID = sampleBatch;
+                vkCmdPushConstants(cmd, mPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, sizeof(Camera), sizeof(SamplingParameters), &mSamplingParams);
+
+                // Run the compute shader for this batch.
+                vkCmdDispatch(cmd, std::ceil(mWindowExtents.width / 16), std::ceil(mWindowExtents.height / 16), 1);
+            });
 
+        if (sampleBatch == mNumBatches - 1)
+        {
+            // The host reads the linear image in the general layout, so it is copied to in that layout too.
+            const auto linearImage = mRenderGraph.importImage(mImageLinear.mImage, colorRange, mImageLinearState);
+            mRenderGraph.addPass({
+                { renderImage, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL },
+                { linearImage, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL } },
+                [&](VkCommandBuffer cmd) {
                     // Copy data from GPU image to Host-visible image.
-                    VkImageCopy region{
+                    const VkImageCopy region{
                         .srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT,0,0,1},
                         .srcOffset = {0, 0, 0},
                         .dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT,0,0,1},
@@ -1146,28 +2224,20 @@ void VulkanApp::render()
                         mImageRender.mImage,
                         VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
                         mImageLinear.mImage,
-                        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                        VK_IMAGE_LAYOUT_GENERAL,
                         1, &region);
-                }
-
+                });
+            mRenderGraph.addPass({ { linearImage, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT, VK_IMAGE_LAYOUT_GENERAL } });
+        }
 
-                // Place a global pipeline memory barrier that ensures all transfer writes must be made visible
-                // Before reading from the Host.
-                const VkMemoryBarrier memoryBarrier = {
-                    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
-                    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-                    .dstAccessMask = VK_ACCESS_HOST_READ_BIT
-                };
-                vkCmdPipelineBarrier(cmd,
-                    VK_PIPELINE_STAGE_TRANSFER_BIT,
-                    VK_PIPELINE_STAGE_HOST_BIT,
-                    0,
-                    1, &memoryBarrier,
-                    0, nullptr, 0, nullptr);
-            }
-            fmt::print("\rRendering batch {}/{}", sampleBatch + 1, mNumBatches);
-            });
+        immediateSubmit([&](VkCommandBuffer cmd) { mRenderGraph.execute(cmd); });
+        fmt::print("\rRendering batch {}/{}", sampleBatch + 1, mNumBatches);
     }
+
+    // Camera paths traced per second. immediateSubmit waits on each batch, so wall time covers the GPU work.
+    const double renderSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count();
+    const double primaryRays = double(mWindowExtents.width) * mWindowExtents.height * mSamplingParams.mNumSamples * mNumBatches;
+    fmt::print("\nRendered in {:.1f} ms ({:.2f} M primary rays/s)", renderSeconds * 1000.0, primaryRays / renderSeconds * 1e-6);
 }
 
 // Write image data to external file.
@@ -1182,6 +2252,8 @@ void VulkanApp::writeImage(const fs::path& path)
 
 void VulkanApp::cleanup()
 {
+    waitSceneLoads();
     vkDeviceWaitIdle(mDevice);
+    mSceneDeletionQueue.flush();
     mDeletionQueue.flush();
 }
@@ -6,7 +6,16 @@
 #include "vk_types.h"
 #include "vk_mem_alloc.h"
 
+#include "geometry_arena.h"
 #include "host_device_common.h"
+#include "memory_report.h"
+#include "render_graph.h"
+#include "staging_ring.h"
+#include "texture_cache.h"
+
+#include <chrono>
+#include <future>
+#include <mutex>
 
 
 class VulkanApp {
@@ -30,6 +39,7 @@ public:
 	struct SpecializationData
 	{
 		uint32_t integrator{ PATH };
+		uint32_t vertexLayout{ VERTEX_LAYOUT_STANDARD };	// VERTEX_LAYOUT_COMPACT: position stream + packed normals/uvs, 16-bit indices where possible.
 		//uint32_t sampler;
 	};
 	SpecializationData mSpecializationData;
@@ -41,12 +51,24 @@ public:
 
 	void initAabbBlas();
 	void initMeshBlas(ObjMesh& mesh);
+	void recordMeshBlasBuild(VkCommandBuffer cmd, ObjMesh& mesh, AllocatedBuffer& scratchBuffer);
 	void initSceneTLAS();
 
+	void initDescriptorSetLayout();
 	void initDescriptorSets();
-	void initComputePipeline();
+	void initComputePipeline();		// Needs the descriptor set layout. Safe to run on another thread during uploadScene.
+
+	void startSceneLoad();
+	bool uploadScene();
+	// Destroys the scene's GPU resources and clears mScene, so that another scene can be loaded. Geometry arena blocks
+	// left empty are released.
+	void unloadScene();
 
-	void uploadScene();
+	// Compacts device memory, for a long-running process once a job's scene is resident (the device must be idle). Geometry arena blocks
+	// and mesh BLASes are moved with VMA's defragmentation, at most kDefragmentationBytesPerPass per pass: their contents
+	// are copied on the GPU, then the mesh table and the TLAS are updated to the new addresses. Stops after maxPasses,
+	// so that the work can be spread over several idle periods.
+	void defragment(uint32_t maxPasses = UINT32_MAX);
 
 
 	
@@ -55,6 +77,12 @@ public:
 	void cleanup();
 
 
+	// GPU memory use per category, against the heap budgets. The report can also be written as JSON, along with VMA's
+	// detailed statistics.
+	void printMemoryReport();
+	bool writeMemoryReport(const fs::path& path);
+
+
 	// Submit operations to the queue, and wait for them to complete.
 	void immediateSubmit(std::function<void(VkCommandBuffer cmd)>&& function);
 
@@ -73,7 +101,14 @@ private:
 	VkDebugUtilsMessengerEXT	mDebugMessenger;
 	VkQueue						mComputeQueue;
 	uint32_t					mComputeQueueFamily;
+	VkQueue						mTransferQueue{ VK_NULL_HANDLE };	// Dedicated transfer queue, if the device has one.
+	uint32_t					mTransferQueueFamily{ VK_QUEUE_FAMILY_IGNORED };
 	VmaAllocator				mVmaAllocator;
+	VkDeviceSize				mHostImportAlignment = 0;	// minImportedHostPointerAlignment, 0 without VK_EXT_external_memory_host.
+	bool						bMemoryBudget = false;		// VK_EXT_memory_budget is enabled: VMA reports the driver's budgets.
+	bool						bTextureCompressionBC = false;	// textureCompressionBC is enabled: textures are uploaded as BC1.
+	VkDeviceSize				mScratchAlignment = 1;		// minAccelerationStructureScratchOffsetAlignment.
+	VkDeviceSize				mBufferImageGranularity = 1;
 	//-----------------------------------------------
 
 	// Synchronisation resources
@@ -82,12 +117,89 @@ private:
 	// Allocators.
 	//-----------------------------------------------
 	VkCommandPool				mCommandPool;
+	VkCommandPool				mTransferCommandPool{ VK_NULL_HANDLE };
 	VkCommandBuffer				mImmediateCmdBuf;
 
+	// A copy from staging memory into the uploaded levels of a new image.
+	struct PendingImageCopy
+	{
+		VkBuffer						mBuffer;
+		VkImage							mImage;
+		std::vector<VkBufferImageCopy>	mRegions;
+	};
+
+	// Ring of command buffers used to stream scene data to the GPU. Each one batches the uploads of several meshes.
+	struct UploadFrame
+	{
+		VkCommandBuffer					mCmd;					// Compute queue: ownership acquires and BLAS builds.
+		VkCommandBuffer					mTransferCmd;			// Copies. The same as mCmd without a dedicated transfer queue.
+		VkSemaphore						mTransferSemaphore{ VK_NULL_HANDLE };	// Signalled by mTransferCmd, waited on by mCmd.
+		VkFence							mFence;
+		uint64_t						mStagingRingEnd{ 0 };	// Staging ring position released when the frame completes.
+		uint64_t						mSubmitIndex{ 0 };
+		std::vector<AllocatedBuffer>	mStagingBuffers;		// Dedicated staging for uploads that don't fit in the ring.
+		std::vector<ImportedHostBuffer>	mImportedBuffers;		// Mapped mesh caches imported as copy sources.
+		std::vector<AllocatedBuffer>	mScratchBuffers;		// BLAS build scratch, one per mesh.
+		std::vector<uint32_t>			mPendingBuilds;			// Meshes whose copies are recorded, built by recordPendingBlasBuilds.
+		std::vector<PendingImageCopy>	mPendingImageCopies;	// Texture copies, recorded in one batch by recordPendingImageCopies.
+		std::vector<VkBuffer>			mReleasedBuffers;		// Written by the copies, handed over by recordUploadHandoff.
+		std::vector<VkImage>			mReleasedImages;
+		bool							bArenaWrites{ false };	// Copies into the geometry arena were recorded.
+		bool							bInFlight{ false };
+	};
+	static constexpr uint32_t kUploadFramesInFlight = 3;
+	std::array<UploadFrame, kUploadFramesInFlight> mUploadFrames;
+	uint64_t mUploadSubmitCount{ 0 };
+
+	static constexpr VkDeviceSize kStagingRingSize = 64ull << 20;
+	StagingRing mStagingRing;
+
+	// Mesh geometry, and the table of its addresses read by the shader (MeshRecord per mesh ID).
+	static constexpr VkDeviceSize kGeometryArenaBlockSize = 128ull << 20;
+	GeometryArena				mGeometryArena;
+	AllocatedBuffer				mMeshTableBuffer{};
+	std::vector<MeshRecord> buildMeshTable() const;
+
+	static constexpr VkDeviceSize kDefragmentationBytesPerPass = 256ull << 20;
+	static constexpr uint32_t kDefragmentationMovesPerPass = 64;
+
+	void beginUploadFrame(UploadFrame& frame);
+	void submitUploadFrame(UploadFrame& frame);
+	void waitUploadFrame(UploadFrame& frame);
+	void retireUploadFrames();
+	StagingRing::Allocation allocateStaging(UploadFrame& frame, VkDeviceSize size);
+	bool importHostMemory(const void* data, VkDeviceSize size, ImportedHostBuffer& importedBuffer);
+	AllocatedBuffer createUploadBuffer(VkDeviceSize size, VkBufferUsageFlags usage, MemoryCategory category);
+	void flushUploadBuffer(const AllocatedBuffer& buffer);
+	void recordMeshUpload(UploadFrame& frame, ObjMesh& mesh);
+	void recordPendingBlasBuilds(UploadFrame& frame);
+	void recordPendingImageCopies(UploadFrame& frame);
+	void recordUploadHandoff(UploadFrame& frame);
+
+	// Memory tracking (see memory_report.h).
+	MemoryTracker				mMemoryTracker;
+	void trackAllocation(MemoryCategory category, VmaAllocation allocation);
+	void untrackAllocation(MemoryCategory category, VmaAllocation allocation);
+	void checkMemoryBudget(MemoryCategory category, VkDeviceSize size);
+
+	// Passes of the AS builds and of rendering, with their barriers and transient scratch (see render_graph.h).
+	RenderGraph					mRenderGraph;
+
+	// Stages that read uploaded data on the compute queue.
+	static constexpr VkPipelineStageFlags2 kUploadConsumerStages = VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+
+	// Asset loads started by startSceneLoad.
+	std::vector<std::future<void>>	mMeshLoads;		// Parallel to mScene.mMeshes.
+	std::vector<std::future<TextureData>>	mTextureLoads;	// Parallel to mScene.mTextures.
+	std::chrono::steady_clock::time_point mLoadStart;
+	bool							bSceneLoadStarted{ false };
+	void startTextureLoads();
+	void waitSceneLoads();
+
 	// Descriptors
 	//-----------------------------------------------
 	VkDescriptorPool			mDescriptorPool;
-	VkDescriptorSetLayout		mDescriptorSetLayout;
+	VkDescriptorSetLayout		mDescriptorSetLayout{ VK_NULL_HANDLE };
 	VkDescriptorSet				mDescriptorSet;
 
 	// Image
@@ -95,23 +207,34 @@ private:
 	Image						mImageLinear;
 	Image						mImageRender;
 	VkImageView					mImageView;
+	RenderGraph::ResourceState	mImageLinearState;
+	RenderGraph::ResourceState	mImageRenderState;
 
-	// Texture
+	// Textures
 	//-----------------------------------------------
-	Image		mTextureImage;
-	uint32_t	mTextureByteSize;
-	VkExtent2D	mTextureExtents;
-
-	VkImageView mTextureImageView;
-	VkSampler	mTextureSampler;
+	std::vector<Texture>		mTextures;		// Indexed by Material::albedoTexture: a white texture, then mScene.mTextures.
+	VkSampler					mTextureSampler;
+	void recordTextureUpload(UploadFrame& frame, Texture& texture, const TextureData& data);
+	void generateMipmaps();
+
+	// Mip generation (shaders/mipmap.comp.glsl).
+	VkShaderModule				mMipmapShader;
+	VkDescriptorSetLayout		mMipmapSetLayout;
+	VkPipelineLayout			mMipmapPipelineLayout;
+	VkPipeline					mMipmapPipeline{ VK_NULL_HANDLE };
+	VkSampler					mMipmapSampler;
+	void initMipmapPipeline();
 
 	// Acceleration structures
 	//-----------------------------------------------
 	AccelerationStructure		mAabbBlas;
 	AllocatedBuffer				mAabbGeometryBuffer;
+	RenderGraph::ResourceState	mAabbBlasState;
 	
-	AccelerationStructure		mTlas;
-	AllocatedBuffer				mTlasInstanceBuffer;  // Stores the per-instance data (matrices, materialID etc...) 
+	AccelerationStructure		mTlas{};				// Rebuilt in place by initSceneTLAS once created.
+	AllocatedBuffer				mTlasInstanceBuffer{};	// VkAccelerationStructureInstanceKHR per instance (transform and BLAS).
+	AllocatedBuffer				mInstanceRecordBuffer{};	// InstanceRecord per instance (geometry and material), read by the shader.
+	RenderGraph::ResourceState	mTlasState;
 
 	// Pipeline Data
 	//-----------------------------------------------
@@ -123,8 +246,10 @@ private:
 	struct DeletionQueue
 	{
 		std::deque<std::function<void()>> deletors;
+		std::mutex mutex;	// Resources may be created on several threads during startup.
 
 		void push_function(std::function<void()>&& function) {
+			std::lock_guard lock(mutex);
 			deletors.push_back(function);
 		}
 
@@ -138,6 +263,7 @@ private:
 		}
 	};
 	DeletionQueue mDeletionQueue;
+	DeletionQueue mSceneDeletionQueue;	// Resources of the current scene, flushed by unloadScene.
 
 
 };
\ No newline at end of file
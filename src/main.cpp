@@ -1,6 +1,8 @@
 ﻿#include "app.h"
+#include "scene_file.h"
 
 #include <chrono>
+#include <future>
 
 #ifdef NDEBUG
 constexpr bool validation = false;
@@ -9,38 +11,129 @@ constexpr bool validation = true;
 #endif
 
 
-int main()
+// Usage: path_tracer [--memory-report=<file.json>] [scene file | glTF file] [output directory]
+//        path_tracer [--memory-report=<file.json>] --jobs <scene file | glTF file>...
+// With --jobs, the scenes are rendered one after the other on the same device, and their images written to the default
+// scene directory.
+int main(int argc, char* argv[])
 {
+    const auto startupStart = std::chrono::steady_clock::now();
     VulkanApp engine;
-    
-    // Initialization 
-    engine.initVulkanContext(validation);
-    engine.initVulkanResources();
+
+    // Split the options from the positional arguments.
+    std::vector<std::string_view> args;
+    fs::path memoryReportPath;
+    bool bJobs = false;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg(argv[i]);
+        if (arg.starts_with("--memory-report=")) { memoryReportPath = arg.substr(arg.find('=') + 1); }
+        else if (arg == "--jobs") { bJobs = true; }
+        else { args.push_back(arg); }
+    }
+
+    // Bring up the instance, device and allocator on their own thread, while the scene is parsed and its assets start
+    // loading on the thread pool. None of the asset loading touches Vulkan.
+    auto deviceInit = std::async(std::launch::async, [&engine]() {
+        engine.initVulkanContext(validation);
+        engine.initVulkanResources();
+        engine.initDescriptorSetLayout();
+        });
+    const auto fail = [&]() {
+        if (deviceInit.valid()) { deviceInit.get(); }
+        engine.cleanup();
+        return EXIT_FAILURE;
+    };
+
+    // Describe a scene from a scene file or a bare glTF file.
+    const auto parseScene = [&engine](const fs::path& scenePath) {
+        const auto parseStart = std::chrono::steady_clock::now();
+        if (scenePath.extension() == ".gltf" || scenePath.extension() == ".glb") {
+            // A bare glTF file: use its first camera, or frame its contents.
+            engine.mScene.mName = scenePath.stem().string();
+            engine.mScene.mCamera = Camera{ .center = glm::vec3(0.f), .eye = glm::vec3(0.f, 0.f, -1.f), .backgroundColor = glm::vec3(0.f), .fovY = 40.f, .focalDistance = 1.f };
+            if (!gltf::importFile(scenePath, engine.mScene, glm::mat4(1.f), true)) { return false; }
+        }
+        else if (!scene_file::loadSceneFile(scenePath, engine.mScene)) {
+            return false;
+        }
+        fmt::println("Parsed scene file {} in {:.1f} ms", scenePath.string(), std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - parseStart).count());
+        return true;
+    };
+
+    // The scenes to render: every positional argument with --jobs, otherwise the first one.
+    std::vector<fs::path> scenes;
+    for (size_t i = 0; i < args.size() && (bJobs || i == 0); ++i) { scenes.emplace_back(args[i]); }
+    const fs::path sceneDirectory(!bJobs && args.size() > 1 ? args[1] : "../../scenes");
+
+    // The first scene, or the default built-in scene.
+    if (scenes.empty()) {
+        engine.mScene = createBuddhaCornellBox();
+    }
+    else if (!parseScene(scenes[0])) {
+        return fail();
+    }
+
+    // Start reading meshes and textures from disk on the thread pool.
+    engine.startSceneLoad();
+    deviceInit.get();
+
+    // The pipeline only needs the descriptor set layout: compile it on its own thread while the scene uploads.
+    auto pipelineBuild = std::async(std::launch::async, [&engine]() { engine.initComputePipeline(); });
+
     engine.initImages();
 
-    // Upload scene data to the GPU.
-    engine.uploadScene();
+    for (size_t job = 0; job < std::max<size_t>(scenes.size(), 1); ++job) {
+        // Running out of GPU memory, or failing to re-read a mesh, throws: release what was created and exit cleanly.
+        try {
+            if (job > 0) {
+                // Free the previous scene, and the geometry arena blocks it leaves empty, before loading the next one.
+                engine.unloadScene();
+                if (!parseScene(scenes[job])) { return fail(); }
+                engine.startSceneLoad();
+            }
+
+            // Upload the scene to the GPU and build the mesh BLASes as the meshes finish loading.
+            if (!engine.uploadScene()) {
+                if (pipelineBuild.valid()) { pipelineBuild.get(); }
+                return fail();
+            }
+
+            // Initialize the remaining acceleration structures for the scene.
+            engine.initAabbBlas();
+            engine.initSceneTLAS();
 
-    // Initialize the acceleration structures for the scene.
-    engine.initAabbBlas();
-    for (std::size_t i = 0; i < engine.mScene.mMeshes.size(); ++i) { engine.initMeshBlas(engine.mScene.mMeshes[i]);}
-    engine.initSceneTLAS();
+            // Compact the holes the previous scenes left in memory, while this one is resident: its BLASes and geometry blocks
+            // can move, and the TLAS and mesh table follow them.
+            if (job > 0) { engine.defragment(); }
+            engine.printMemoryReport();
+            if (!memoryReportPath.empty() && engine.writeMemoryReport(memoryReportPath)) {
+                fmt::println("Memory report written to: {}", fs::absolute(memoryReportPath).string());
+            }
 
     
-    engine.initDescriptorSets();
-    engine.initComputePipeline();
+            engine.initDescriptorSets();
+            if (pipelineBuild.valid()) {
+                pipelineBuild.get();
+                fmt::println("Ready to render after {:.1f} ms", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupStart).count());
+            }
 
 
-    engine.render();
-    fmt::println("\nSample count: {} * {} = {}", engine.mSamplingParams.mNumSamples, engine.mNumBatches, engine.mSamplingParams.mNumSamples * engine.mNumBatches);
-    fmt::println("Recursion depth: {}", engine.mSamplingParams.mNumBounces);
+            engine.render();
+            fmt::println("\nSample count: {} * {} = {}", engine.mSamplingParams.mNumSamples, engine.mNumBatches, engine.mSamplingParams.mNumSamples * engine.mNumBatches);
+            fmt::println("Recursion depth: {}", engine.mSamplingParams.mNumBounces);
 
 
-    // Write rendered image to file.
-    const fs::path sceneDirectory("../../scenes"); // TODO: Use Command line args to specify out folder.
-    const auto outPath = (sceneDirectory / engine.mScene.mName).replace_extension(".hdr");
-    engine.writeImage(outPath);
-    fmt::println("Image written to: {}", fs::absolute(outPath).string());
+            // Write rendered image to file.
+            const auto outPath = (sceneDirectory / engine.mScene.mName).replace_extension(".hdr");
+            engine.writeImage(outPath);
+            fmt::println("Image written to: {}", fs::absolute(outPath).string());
+        }
+        catch (const std::exception& e) {
+            fmt::println("Error: {}", e.what());
+            if (pipelineBuild.valid()) { pipelineBuild.get(); }
+            return fail();
+        }
+    }
 
     engine.cleanup();
 }